@@ -3079,6 +3079,42 @@ void BB_color_blit_from_RGB32(BlitBuffer * restrict dst, const BlitBuffer * rest
     }
 }
 
+void BB_blit_indexed_RGB32(BlitBuffer * restrict bb, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+        const uint8_t * restrict indices, unsigned int stride, const ColorRGB32 * restrict palette, int transparent) {
+    // Only ever used to composite paletted (e.g., GIF) frames onto an RGB32 canvas
+    const int bb_type = GET_BB_TYPE(bb);
+    if (bb_type != TYPE_BBRGB32) {
+        return;
+    }
+    const int bb_rotation = GET_BB_ROTATION(bb);
+    for (unsigned int j = 0; j < h; j++) {
+        const uint8_t * restrict src = indices + stride*j;
+        if (bb_rotation == 0) {
+            // Straight scanline lookup
+            ColorRGB32 * restrict dstptr = (ColorRGB32 *) (bb->data + bb->stride*(y+j)) + x;
+            if (transparent < 0) {
+                for (unsigned int i = 0; i < w; i++) {
+                    dstptr[i] = palette[src[i]];
+                }
+            } else {
+                for (unsigned int i = 0; i < w; i++) {
+                    if (src[i] != transparent) {
+                        dstptr[i] = palette[src[i]];
+                    }
+                }
+            }
+        } else {
+            for (unsigned int i = 0; i < w; i++) {
+                if (transparent < 0 || src[i] != transparent) {
+                    ColorRGB32 * restrict dstptr;
+                    BB_GET_PIXEL(bb, bb_rotation, ColorRGB32, x+i, y+j, &dstptr);
+                    *dstptr = palette[src[i]];
+                }
+            }
+        }
+    }
+}
+
 // Information about those three algorithms can be found on http://members.chello.at/~easyfilter/ (Zingl Alois)
 void BB_paint_rounded_corner_noAA(BlitBuffer * restrict bb, unsigned int off_x, unsigned int off_y, unsigned int w, unsigned int h, int bw, int r, uint8_t c);
 void BB_paint_rounded_corner_AA(BlitBuffer * restrict bb, unsigned int off_x, unsigned int off_y, unsigned int w, unsigned int h, int bw, int r, uint8_t c);
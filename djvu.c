@@ -17,8 +17,11 @@
 */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <libdjvu/miniexp.h>
 #include <libdjvu/ddjvuapi.h>
@@ -28,6 +31,10 @@
 #include "drawcontext.h"
 #include "koptcontext.h"
 
+/* Tiles are square, in pixels of the zoomed page */
+#define TILE_SIZE 256
+#define TILE_CACHE_DEFAULT_SIZE (16 << 20)
+
 #define ABS(x) ((x<0)?(-x):(x))
 
 #define MIN(a, b)      ((a) < (b) ? (a) : (b))
@@ -42,11 +49,75 @@
 
 #define True 1
 
+typedef enum DjvuRenderJobStatus {
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED
+} DjvuRenderJobStatus;
+
+/* A page render request, processed by the document's render thread */
+typedef struct DjvuRenderJob {
+	int id;
+	int pageno; /* djvulibre counts page starts from 0 */
+	ddjvu_render_mode_t mode;
+	double zoom;
+	double gamma;
+	double saturation;
+	int offset_x;
+	int offset_y;
+	int w;
+	int h;
+	int pixelsize;
+	DjvuRenderJobStatus status;
+	int cancelled; /* free it when done, nobody wants the result anymore */
+	uint8_t *data; /* w*h*pixelsize bytes, owned by the job */
+	struct DjvuRenderJob *next;
+} DjvuRenderJob;
+
+typedef struct DjvuRenderer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* signaled on new job, job completion and quit */
+	DjvuRenderJob *jobs;
+	int next_id;
+	int quit;
+	/* bumped (and msg_cond signaled) whenever ddjvu posts a message, see messageCallback() */
+	pthread_mutex_t msg_lock;
+	pthread_cond_t msg_cond;
+	unsigned int msg_seq;
+} DjvuRenderer;
+
+/* A rendered tile, see drawPageTiled() */
+typedef struct DjvuTile {
+	int pageno;
+	double zoom;
+	double gamma;
+	ddjvu_render_mode_t mode;
+	int pixelsize;
+	int tx; /* tile column, in the zoomed page */
+	int ty; /* tile row */
+	int w; /* may be less than TILE_SIZE on the right and bottom edges */
+	int h;
+	uint8_t *data;
+	struct DjvuTile *prev;
+	struct DjvuTile *next;
+} DjvuTile;
+
+typedef struct DjvuTileCache {
+	DjvuTile *head; /* most recently used */
+	DjvuTile *tail; /* least recently used, evicted first */
+	size_t used;
+	size_t max_size;
+} DjvuTileCache;
+
 typedef struct DjvuDocument {
 	ddjvu_context_t *context;
 	ddjvu_document_t *doc_ref;
 	ddjvu_format_t *pixelformat;
 	int pixelsize;
+	DjvuRenderer *renderer; /* created on first async render request */
+	DjvuTileCache tiles;
 } DjvuDocument;
 
 typedef struct DjvuPage {
@@ -139,6 +210,9 @@ static int openDocument(lua_State *L) {
 	DjvuDocument *doc = (DjvuDocument*) lua_newuserdata(L, sizeof(DjvuDocument));
 	luaL_getmetatable(L, "djvudocument");
 	lua_setmetatable(L, -2);
+	doc->renderer = NULL;
+	memset(&doc->tiles, 0, sizeof(DjvuTileCache));
+	doc->tiles.max_size = TILE_CACHE_DEFAULT_SIZE;
 
 	doc->context = ddjvu_context_create("kindlepdfviewer");
 	if (! doc->context) {
@@ -177,9 +251,16 @@ static int openDocument(lua_State *L) {
 	return 1;
 }
 
+static void stopRenderer(DjvuDocument *doc);
+static void clearTiles(DjvuDocument *doc);
+
 static int closeDocument(lua_State *L) {
 	DjvuDocument *doc = (DjvuDocument*) luaL_checkudata(L, 1, "djvudocument");
 
+	// the render thread uses doc_ref, so stop it first
+	stopRenderer(doc);
+	clearTiles(doc);
+
 	// should be safe if called twice
 	if (doc->doc_ref != NULL) {
 		ddjvu_document_release(doc->doc_ref);
@@ -529,6 +610,159 @@ static int getPageText(lua_State *L) {
 	return 1;
 }
 
+/* Walk the zones of a page text s-expression, calling back for each word,
+ * with the 1-based index of its line (words outside of a line zone get a
+ * line of their own).
+ */
+typedef struct DjvuWordWalk {
+	lua_State *L;
+	int yheight;
+	int nwords;
+	int nlines;
+	int in_line;
+	int fill; /* 0: only count words, 1: push them into the tables at 1..6 of the walker's base */
+	int base;
+} DjvuWordWalk;
+
+static void walkPageWords(DjvuWordWalk *walk, miniexp_t zone) {
+	if (!miniexp_consp(zone)) {
+		return;
+	}
+	miniexp_t zone_type = miniexp_nth(SI_ZONE_NAME, zone);
+	if (!miniexp_symbolp(zone_type)) {
+		return;
+	}
+	const char *zname = miniexp_to_name(zone_type);
+	int is_line = !strcmp(zname, "line");
+	int is_word = !strcmp(zname, "word");
+	if (is_line) {
+		walk->nlines++;
+		walk->in_line = 1;
+	}
+	int length = miniexp_length(zone);
+	for (int i = SI_ZONE_DATA; i < length; i++) {
+		miniexp_t data = miniexp_nth(i, zone);
+		if (!miniexp_stringp(data)) {
+			walkPageWords(walk, data);
+			continue;
+		}
+		if (!is_word) {
+			continue;
+		}
+		if (!walk->in_line) {
+			walk->nlines++;
+		}
+		int n = ++walk->nwords;
+		if (!walk->fill) {
+			continue;
+		}
+		lua_State *L = walk->L;
+		int base = walk->base;
+		lua_pushstring(L, miniexp_to_str(data));
+		lua_rawseti(L, base, n);
+		lua_pushinteger(L, int_from_miniexp_nth(SI_ZONE_XMIN, zone));
+		lua_rawseti(L, base + 1, n);
+		lua_pushinteger(L, walk->yheight - int_from_miniexp_nth(SI_ZONE_YMAX, zone));
+		lua_rawseti(L, base + 2, n);
+		lua_pushinteger(L, int_from_miniexp_nth(SI_ZONE_XMAX, zone));
+		lua_rawseti(L, base + 3, n);
+		lua_pushinteger(L, walk->yheight - int_from_miniexp_nth(SI_ZONE_YMIN, zone));
+		lua_rawseti(L, base + 4, n);
+		lua_pushinteger(L, walk->nlines);
+		lua_rawseti(L, base + 5, n);
+	}
+	if (is_line) {
+		walk->in_line = 0;
+	}
+}
+
+/* doc:getPageWords(pageno)
+ * Flat alternative to getPageText(): returns a table of parallel arrays
+ * { word = {...}, x0 = {...}, y0 = {...}, x1 = {...}, y1 = {...}, line = {...} },
+ * with the same top-left origined coordinates, and 1-based line indices.
+ */
+static int getPageWords(lua_State *L) {
+	DjvuDocument *doc = (DjvuDocument*) luaL_checkudata(L, 1, "djvudocument");
+	int pageno = luaL_checkint(L, 2);
+	if (pageno < 1 || pageno > ddjvu_document_get_pagenum(doc->doc_ref)) {
+		return luaL_error(L, "page #%d out of range (1-%d)", pageno, ddjvu_document_get_pagenum(doc->doc_ref));
+	}
+	lua_settop(L, 0); // Pop function args
+
+	/* get page height for coordinates transform */
+	ddjvu_pageinfo_t info;
+	ddjvu_status_t r;
+	while ((r=ddjvu_document_get_pageinfo(
+				   doc->doc_ref, pageno-1, &info))<DDJVU_JOB_OK) {
+		handle(L, doc->context, TRUE);
+	}
+	if (r>=DDJVU_JOB_FAILED)
+		return luaL_error(L, "cannot get page #%d information", pageno);
+
+	miniexp_t sexp;
+	while ((sexp = ddjvu_document_get_pagetext(doc->doc_ref, pageno-1, "word"))
+				== miniexp_dummy) {
+		handle(L, doc->context, True);
+	}
+
+	/* First pass to count words, so the arrays can be pre-allocated */
+	DjvuWordWalk walk = { L, info.height, 0, 0, 0, 0, 0 };
+	walkPageWords(&walk, sexp);
+	int nwords = walk.nwords;
+
+	static const char *keys[] = { "word", "x0", "y0", "x1", "y1", "line" };
+	for (int i = 0; i < 6; i++) {
+		lua_createtable(L, nwords, 0);
+	}
+	walk.nwords = 0;
+	walk.nlines = 0;
+	walk.in_line = 0;
+	walk.fill = 1;
+	walk.base = 1;
+	walkPageWords(&walk, sexp);
+	ddjvu_miniexp_release(doc->doc_ref, sexp);
+
+	lua_createtable(L, 0, 6);
+	for (int i = 0; i < 6; i++) {
+		lua_pushstring(L, keys[i]);
+		lua_pushvalue(L, i + 1);
+		lua_rawset(L, -3);
+	}
+	return 1;
+}
+
+/* doc:getTextDump(first, last)
+ * Returns an array of the plain text of pages first..last (defaulting to the
+ * whole document), indexed by page number, "" for pages without a text layer.
+ * Meant to build a search index in one go: only the page level text is
+ * requested from djvulibre, no zone is converted.
+ */
+static int getTextDump(lua_State *L) {
+	DjvuDocument *doc = (DjvuDocument*) luaL_checkudata(L, 1, "djvudocument");
+	int npages = ddjvu_document_get_pagenum(doc->doc_ref);
+	int first = luaL_optint(L, 2, 1);
+	int last = luaL_optint(L, 3, npages);
+	if (first < 1 || last > npages || first > last) {
+		return luaL_error(L, "invalid page range %d-%d (1-%d)", first, last, npages);
+	}
+	lua_settop(L, 0); // Pop function args
+
+	lua_createtable(L, last, 0);
+	for (int pageno = first; pageno <= last; pageno++) {
+		miniexp_t sexp;
+		while ((sexp = ddjvu_document_get_pagetext(doc->doc_ref, pageno-1, "page"))
+					== miniexp_dummy) {
+			handle(L, doc->context, True);
+		}
+		/* (page xmin ymin xmax ymax "text") */
+		miniexp_t data = miniexp_nth(SI_ZONE_DATA, sexp);
+		lua_pushstring(L, miniexp_stringp(data) ? miniexp_to_str(data) : "");
+		lua_rawseti(L, -2, pageno);
+		ddjvu_miniexp_release(doc->doc_ref, sexp);
+	}
+	return 1;
+}
+
 static int closePage(lua_State *L) {
 	DjvuPage *page = (DjvuPage*) luaL_checkudata(L, 1, "djvupage");
 
@@ -574,6 +808,15 @@ static int getPagePix(lua_State *L) {
            page->doc->pixelsize == 3 ? "color" : "grey", render_mode_str(mode));
 #endif
 
+	/* the word boxes cached for the previous bitmap are stale now */
+	lua_getfield(L, 2, "invalidateWordBoxes");
+	if (lua_isfunction(L, -1)) {
+		lua_pushvalue(L, 2);
+		lua_call(L, 1, 0);
+	} else {
+		lua_pop(L, 1);
+	}
+
 	WILLUSBITMAP *dst = &kctx->src;
 	bmp_init(dst);
 	dst->width = rrect.w;
@@ -599,15 +842,10 @@ static int getPagePix(lua_State *L) {
 	return 0;
 }
 
-static int drawPage(lua_State *L) {
-	DjvuPage *page = (DjvuPage*) luaL_checkudata(L, 1, "djvupage");
-	DrawContext *dc = (DrawContext*) lua_topointer(L, 2);
-	BlitBuffer *bb = (BlitBuffer*) lua_topointer(L, 3);
-	ddjvu_render_mode_t djvu_render_mode = (int) luaL_checkint(L, 6);
-	ddjvu_rect_t pagerect, renderrect;
-	// map KOReader gamma to djvulibre gamma
+/* map KOReader gamma to djvulibre gamma */
+static double djvu_gamma(double dc_gamma) {
 	// djvulibre goes from 0.5 to 5.0
-	double gamma = ABS(dc->gamma); // not sure why, but 1 is given as -1?
+	double gamma = ABS(dc_gamma); // not sure why, but 1 is given as -1?
 	if (gamma == 2) {
 		// default
 		gamma = 2.2;
@@ -624,7 +862,16 @@ static int drawPage(lua_State *L) {
 			gamma = 0.5;
 		}
 	}
-	ddjvu_format_set_gamma(page->doc->pixelformat, gamma);
+	return gamma;
+}
+
+static int drawPage(lua_State *L) {
+	DjvuPage *page = (DjvuPage*) luaL_checkudata(L, 1, "djvupage");
+	DrawContext *dc = (DrawContext*) lua_topointer(L, 2);
+	BlitBuffer *bb = (BlitBuffer*) lua_topointer(L, 3);
+	ddjvu_render_mode_t djvu_render_mode = (int) luaL_checkint(L, 6);
+	ddjvu_rect_t pagerect, renderrect;
+	ddjvu_format_set_gamma(page->doc->pixelformat, djvu_gamma(dc->gamma));
 	size_t bbsize = (bb->w)*(bb->h)*page->doc->pixelsize;
 	uint8_t *imagebuffer = bb->data;
 
@@ -672,6 +919,535 @@ static int drawPage(lua_State *L) {
 	return 0;
 }
 
+/* Tiled rendering
+ *
+ * When zoomed in, panning around a page with page:draw() re-renders the
+ * whole viewport each time. page:drawTiled() instead assembles the viewport
+ * from fixed-size tiles of the zoomed page, rendered on demand and kept in a
+ * per-document LRU cache with a byte budget: only newly exposed tiles have to
+ * be rendered.
+ */
+
+static void unlinkTile(DjvuTileCache *cache, DjvuTile *tile) {
+	if (tile->prev)
+		tile->prev->next = tile->next;
+	else
+		cache->head = tile->next;
+	if (tile->next)
+		tile->next->prev = tile->prev;
+	else
+		cache->tail = tile->prev;
+	tile->prev = tile->next = NULL;
+}
+
+static void pushTile(DjvuTileCache *cache, DjvuTile *tile) {
+	tile->prev = NULL;
+	tile->next = cache->head;
+	if (cache->head)
+		cache->head->prev = tile;
+	cache->head = tile;
+	if (!cache->tail)
+		cache->tail = tile;
+}
+
+static size_t tileSize(DjvuTile *tile) {
+	return (size_t)tile->w * tile->h * tile->pixelsize;
+}
+
+static void freeTile(DjvuTile *tile) {
+	free(tile->data);
+	free(tile);
+}
+
+/* Evict least recently used tiles until we fit in max_size */
+static void trimTiles(DjvuTileCache *cache, size_t max_size) {
+	while (cache->tail && cache->used > max_size) {
+		DjvuTile *tile = cache->tail;
+		unlinkTile(cache, tile);
+		cache->used -= tileSize(tile);
+		freeTile(tile);
+	}
+}
+
+static void clearTiles(DjvuDocument *doc) {
+	trimTiles(&doc->tiles, 0);
+}
+
+/* Return the requested tile, from the cache or freshly rendered (and then
+ * cached). Returns NULL on allocation failure. */
+static DjvuTile *getTile(DjvuPage *page, double zoom, double gamma, ddjvu_render_mode_t mode, int tx, int ty) {
+	DjvuDocument *doc = page->doc;
+	DjvuTileCache *cache = &doc->tiles;
+	DjvuTile *tile;
+	for (tile = cache->head; tile; tile = tile->next) {
+		if (tile->tx == tx && tile->ty == ty && tile->pageno == page->num
+				&& tile->zoom == zoom && tile->gamma == gamma
+				&& tile->mode == mode && tile->pixelsize == doc->pixelsize) {
+			unlinkTile(cache, tile);
+			pushTile(cache, tile);
+			return tile;
+		}
+	}
+
+	ddjvu_rect_t pagerect, renderrect;
+	pagerect.x = 0;
+	pagerect.y = 0;
+	pagerect.w = page->info.width * zoom;
+	pagerect.h = page->info.height * zoom;
+	renderrect.x = tx * TILE_SIZE;
+	renderrect.y = ty * TILE_SIZE;
+	renderrect.w = MIN((int)pagerect.w - renderrect.x, TILE_SIZE);
+	renderrect.h = MIN((int)pagerect.h - renderrect.y, TILE_SIZE);
+
+	tile = calloc(1, sizeof(DjvuTile));
+	if (!tile)
+		return NULL;
+	tile->pageno = page->num;
+	tile->zoom = zoom;
+	tile->gamma = gamma;
+	tile->mode = mode;
+	tile->pixelsize = doc->pixelsize;
+	tile->tx = tx;
+	tile->ty = ty;
+	tile->w = renderrect.w;
+	tile->h = renderrect.h;
+	tile->data = malloc(tileSize(tile));
+	if (!tile->data) {
+		free(tile);
+		return NULL;
+	}
+
+	ddjvu_format_set_gamma(doc->pixelformat, gamma);
+	if (!ddjvu_page_render(page->page_ref, mode, &pagerect, &renderrect, doc->pixelformat, tile->w*tile->pixelsize, (char *)tile->data)) {
+		// Clear to white on failure
+		memset(tile->data, 0xFF, tileSize(tile));
+	}
+
+	pushTile(cache, tile);
+	cache->used += tileSize(tile);
+	return tile;
+}
+
+/* page:drawTiled(dc, bb, render_mode)
+ * Same result as page:draw(dc, bb, 0, 0, render_mode), but going through
+ * the document's tile cache. */
+static int drawPageTiled(lua_State *L) {
+	DjvuPage *page = (DjvuPage*) luaL_checkudata(L, 1, "djvupage");
+	DrawContext *dc = (DrawContext*) lua_topointer(L, 2);
+	BlitBuffer *bb = (BlitBuffer*) lua_topointer(L, 3);
+	ddjvu_render_mode_t mode = (int) luaL_checkint(L, 4);
+	DjvuDocument *doc = page->doc;
+	double gamma = djvu_gamma(dc->gamma);
+	int pixelsize = doc->pixelsize;
+
+	/* Visible part of the zoomed page, as in drawPage() */
+	int page_w = page->info.width * dc->zoom;
+	int page_h = page->info.height * dc->zoom;
+	int x0 = MAX(-dc->offset_x, 0);
+	int y0 = MAX(-dc->offset_y, 0);
+	int x1 = x0 + MIN(page_w - x0, (int)bb->w);
+	int y1 = y0 + MIN(page_h - y0, (int)bb->h);
+
+	for (int ty = y0 / TILE_SIZE; ty * TILE_SIZE < y1; ty++) {
+		for (int tx = x0 / TILE_SIZE; tx * TILE_SIZE < x1; tx++) {
+			DjvuTile *tile = getTile(page, dc->zoom, gamma, mode, tx, ty);
+			if (!tile) {
+				return luaL_error(L, "cannot allocate DjVu tile");
+			}
+			/* Intersection of the tile and the viewport, in page coordinates */
+			int ix0 = MAX(x0, tx * TILE_SIZE);
+			int iy0 = MAX(y0, ty * TILE_SIZE);
+			int ix1 = MIN(x1, tx * TILE_SIZE + tile->w);
+			int iy1 = MIN(y1, ty * TILE_SIZE + tile->h);
+			size_t row_size = (size_t)(ix1 - ix0) * pixelsize;
+			for (int y = iy0; y < iy1; y++) {
+				memcpy(bb->data + (size_t)(y - y0) * bb->stride + (size_t)(ix0 - x0) * pixelsize,
+					tile->data + ((size_t)(y - ty * TILE_SIZE) * tile->w + (ix0 - tx * TILE_SIZE)) * pixelsize,
+					row_size);
+			}
+		}
+		// Keep within budget as we go (tiles are copied right after being fetched)
+		trimTiles(&doc->tiles, doc->tiles.max_size);
+	}
+
+	if (pixelsize == 3 && dc->saturation != 1.0) {
+		BB_saturate_rect(bb, 0, 0, MAX(x1 - x0, 0), MAX(y1 - y0, 0), dc->saturation);
+	}
+
+	return 0;
+}
+
+/* doc:setTileCacheSize(bytes): set the tile cache budget, returns the
+ * previous budget and the number of bytes currently used. */
+static int setTileCacheSize(lua_State *L) {
+	DjvuDocument *doc = (DjvuDocument*) luaL_checkudata(L, 1, "djvudocument");
+	lua_Integer max_size = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, max_size >= 0, 2, "size must be positive");
+	lua_pushinteger(L, doc->tiles.max_size);
+	lua_pushinteger(L, doc->tiles.used);
+	doc->tiles.max_size = max_size;
+	trimTiles(&doc->tiles, doc->tiles.max_size);
+	return 2;
+}
+
+static int clearTileCache(lua_State *L) {
+	DjvuDocument *doc = (DjvuDocument*) luaL_checkudata(L, 1, "djvudocument");
+	clearTiles(doc);
+	return 0;
+}
+
+/* Asynchronous page rendering
+ *
+ * Page decoding and rendering happen on a per-document worker thread,
+ * sharing the document's ddjvu context (the ddjvu API is thread safe),
+ * so the frontend can overlap the next page decoding with other work
+ * (like refreshing the screen) and collect the result later.
+ *
+ * The worker renders into a buffer owned by the job, which is copied
+ * into the caller's BlitBuffer when collected with waitRender(): this way,
+ * the BlitBuffer doesn't need to stay alive while the job is pending.
+ */
+
+/* Called by ddjvu (from any of its threads, with its own locks held) when
+ * a message is posted: only touch our own message lock, never ddjvu. */
+static void messageCallback(ddjvu_context_t *context, void *closure) {
+	(void) context;
+	DjvuRenderer *r = (DjvuRenderer *) closure;
+	pthread_mutex_lock(&r->msg_lock);
+	r->msg_seq++;
+	pthread_cond_broadcast(&r->msg_cond);
+	pthread_mutex_unlock(&r->msg_lock);
+}
+
+static void waitPageDecoding(DjvuRenderer *r, ddjvu_page_t *djvu_page) {
+	for (;;) {
+		/* Snapshot the sequence before checking, so a message posted
+		 * in between isn't missed (ddjvu is called without msg_lock held) */
+		pthread_mutex_lock(&r->msg_lock);
+		unsigned int seq = r->msg_seq;
+		int quit = r->quit;
+		pthread_mutex_unlock(&r->msg_lock);
+		if (quit || ddjvu_page_decoding_done(djvu_page))
+			return;
+		/* The timeout is only a safety net, in case the status changes
+		 * without a message being posted */
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 100 * 1000 * 1000; // 100ms
+		if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000 * 1000 * 1000;
+		}
+		pthread_mutex_lock(&r->msg_lock);
+		while (r->msg_seq == seq && !r->quit) {
+			if (pthread_cond_timedwait(&r->msg_cond, &r->msg_lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+		pthread_mutex_unlock(&r->msg_lock);
+	}
+}
+
+/* Renders job, without touching its status (the render thread sets it, under
+ * the renderer lock): returns JOB_DONE, or JOB_FAILED. */
+static int renderJob(DjvuDocument *doc, DjvuRenderJob *job) {
+	ddjvu_page_t *djvu_page = ddjvu_page_create_by_pageno(doc->doc_ref, job->pageno);
+	if (!djvu_page) {
+		return JOB_FAILED;
+	}
+	/* Messages are popped by the main thread (see handle()): decoding
+	 * goes on in djvulibre's own threads, we only have to wait for it,
+	 * rechecking each time ddjvu posts a message (which it does when a
+	 * page is decoded). */
+	waitPageDecoding(doc->renderer, djvu_page);
+	if (!ddjvu_page_decoding_done(djvu_page) || ddjvu_page_decoding_error(djvu_page)) {
+		ddjvu_page_release(djvu_page);
+		return JOB_FAILED;
+	}
+
+	/* Our own pixel format: the document's one gets its gamma updated by drawPage() */
+	ddjvu_format_t *pixelformat = ddjvu_format_create(
+		job->pixelsize == 3 ? DDJVU_FORMAT_RGB24 : DDJVU_FORMAT_GREY8, 0, NULL);
+	if (!pixelformat) {
+		ddjvu_page_release(djvu_page);
+		return JOB_FAILED;
+	}
+	ddjvu_format_set_row_order(pixelformat, 1);
+	ddjvu_format_set_y_direction(pixelformat, 1);
+	ddjvu_format_set_gamma(pixelformat, job->gamma);
+
+	size_t size = (size_t)job->w * job->h * job->pixelsize;
+	job->data = malloc(size);
+	if (!job->data) {
+		ddjvu_format_release(pixelformat);
+		ddjvu_page_release(djvu_page);
+		return JOB_FAILED;
+	}
+
+	/* Same rectangles as drawPage() */
+	ddjvu_rect_t pagerect, renderrect;
+	pagerect.x = 0;
+	pagerect.y = 0;
+	pagerect.w = ddjvu_page_get_width(djvu_page) * job->zoom;
+	pagerect.h = ddjvu_page_get_height(djvu_page) * job->zoom;
+	renderrect.x = MAX(-job->offset_x, 0);
+	renderrect.y = MAX(-job->offset_y, 0);
+	renderrect.w = MIN(pagerect.w - renderrect.x, job->w);
+	renderrect.h = MIN(pagerect.h - renderrect.y, job->h);
+
+	if (!ddjvu_page_render(djvu_page, job->mode, &pagerect, &renderrect, pixelformat, job->w*job->pixelsize, (char *)job->data)) {
+		// Clear to white on failure
+		memset(job->data, 0xFF, size);
+	}
+
+	ddjvu_format_release(pixelformat);
+	ddjvu_page_release(djvu_page);
+	return JOB_DONE;
+}
+
+static void freeJob(DjvuRenderJob *job) {
+	free(job->data);
+	free(job);
+}
+
+/* Unlink job from the queue (renderer lock must be held) */
+static void unlinkJob(DjvuRenderer *r, DjvuRenderJob *job) {
+	DjvuRenderJob **prev = &r->jobs;
+	while (*prev && *prev != job)
+		prev = &(*prev)->next;
+	if (*prev)
+		*prev = job->next;
+}
+
+static void *renderThread(void *arg) {
+	DjvuDocument *doc = (DjvuDocument *) arg;
+	DjvuRenderer *r = doc->renderer;
+	pthread_mutex_lock(&r->lock);
+	while (!r->quit) {
+		DjvuRenderJob *job = r->jobs;
+		while (job && job->status != JOB_PENDING)
+			job = job->next;
+		if (!job) {
+			pthread_cond_wait(&r->cond, &r->lock);
+			continue;
+		}
+		job->status = JOB_RUNNING;
+		pthread_mutex_unlock(&r->lock);
+		int status = renderJob(doc, job);
+		pthread_mutex_lock(&r->lock);
+		if (job->cancelled) {
+			// already unlinked by cancelRender(), nobody else can reach it
+			freeJob(job);
+		} else {
+			job->status = status;
+		}
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static DjvuRenderer *getRenderer(DjvuDocument *doc) {
+	if (doc->renderer)
+		return doc->renderer;
+	DjvuRenderer *r = calloc(1, sizeof(DjvuRenderer));
+	if (!r)
+		return NULL;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	pthread_mutex_init(&r->msg_lock, NULL);
+	pthread_cond_init(&r->msg_cond, NULL);
+	r->next_id = 1;
+	doc->renderer = r;
+	if (pthread_create(&r->thread, NULL, renderThread, doc) != 0) {
+		pthread_cond_destroy(&r->msg_cond);
+		pthread_mutex_destroy(&r->msg_lock);
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->lock);
+		free(r);
+		doc->renderer = NULL;
+		return NULL;
+	}
+	ddjvu_message_set_callback(doc->context, messageCallback, r);
+	return r;
+}
+
+static void stopRenderer(DjvuDocument *doc) {
+	DjvuRenderer *r = doc->renderer;
+	if (!r)
+		return;
+	ddjvu_message_set_callback(doc->context, NULL, NULL);
+	/* quit is read under either lock: waiting for a job, or for a page to be decoded */
+	pthread_mutex_lock(&r->lock);
+	pthread_mutex_lock(&r->msg_lock);
+	r->quit = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_cond_broadcast(&r->msg_cond);
+	pthread_mutex_unlock(&r->msg_lock);
+	pthread_mutex_unlock(&r->lock);
+	// lets the current job, if any, finish
+	pthread_join(r->thread, NULL);
+	while (r->jobs) {
+		DjvuRenderJob *job = r->jobs;
+		r->jobs = job->next;
+		freeJob(job);
+	}
+	pthread_cond_destroy(&r->msg_cond);
+	pthread_mutex_destroy(&r->msg_lock);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+	doc->renderer = NULL;
+}
+
+static DjvuRenderJob *findJob(DjvuRenderer *r, int id) {
+	DjvuRenderJob *job = r->jobs;
+	while (job && job->id != id)
+		job = job->next;
+	return job;
+}
+
+/* doc:renderPageAsync(pageno, dc, width, height, render_mode)
+ * Queue rendering of a page, as page:draw() would do with a BlitBuffer of
+ * width x height. Returns a job id, to use with isRenderDone(), waitRender()
+ * and cancelRender(). */
+static int renderPageAsync(lua_State *L) {
+	DjvuDocument *doc = (DjvuDocument*) luaL_checkudata(L, 1, "djvudocument");
+	int pageno = luaL_checkint(L, 2);
+	DrawContext *dc = (DrawContext*) lua_topointer(L, 3);
+	int width = luaL_checkint(L, 4);
+	int height = luaL_checkint(L, 5);
+	ddjvu_render_mode_t mode = (int) luaL_checkint(L, 6);
+	if (pageno < 1 || pageno > ddjvu_document_get_pagenum(doc->doc_ref)) {
+		return luaL_error(L, "cannot render page #%d, out of range (1-%d)", pageno, ddjvu_document_get_pagenum(doc->doc_ref));
+	}
+	if (!dc) {
+		return luaL_argerror(L, 3, "expected a DrawContext");
+	}
+	luaL_argcheck(L, width > 0, 4, "width must be strictly positive");
+	luaL_argcheck(L, height > 0, 5, "height must be strictly positive");
+
+	DjvuRenderer *r = getRenderer(doc);
+	if (!r) {
+		return luaL_error(L, "cannot start DjVu render thread");
+	}
+	DjvuRenderJob *job = calloc(1, sizeof(DjvuRenderJob));
+	if (!job) {
+		return luaL_error(L, "cannot allocate DjVu render job");
+	}
+	job->pageno = pageno - 1;
+	job->mode = mode;
+	job->zoom = dc->zoom;
+	job->gamma = djvu_gamma(dc->gamma);
+	job->saturation = dc->saturation;
+	job->offset_x = dc->offset_x;
+	job->offset_y = dc->offset_y;
+	job->w = width;
+	job->h = height;
+	job->pixelsize = doc->pixelsize;
+	job->status = JOB_PENDING;
+
+	pthread_mutex_lock(&r->lock);
+	job->id = r->next_id++;
+	// append, so jobs are rendered in submission order
+	DjvuRenderJob **last = &r->jobs;
+	while (*last)
+		last = &(*last)->next;
+	*last = job;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	lua_pushinteger(L, job->id);
+	return 1;
+}
+
+/* doc:isRenderDone(job_id): true when the job is done (or failed), so
+ * that waitRender() won't block. Errors if there is no such job. */
+static int isRenderDone(lua_State *L) {
+	DjvuDocument *doc = (DjvuDocument*) luaL_checkudata(L, 1, "djvudocument");
+	int id = luaL_checkint(L, 2);
+	DjvuRenderer *r = doc->renderer;
+	DjvuRenderJob *job = NULL;
+	int done = 0;
+	if (r) {
+		pthread_mutex_lock(&r->lock);
+		job = findJob(r, id);
+		if (job)
+			done = job->status >= JOB_DONE;
+		pthread_mutex_unlock(&r->lock);
+	}
+	if (!job) {
+		return luaL_error(L, "no such DjVu render job: %d", id);
+	}
+	lua_pushboolean(L, done);
+	return 1;
+}
+
+/* doc:waitRender(job_id, bb)
+ * Wait for the job to be done, copy its result into bb and forget the job.
+ * Returns true, or false if the page could not be rendered. */
+static int waitRender(lua_State *L) {
+	DjvuDocument *doc = (DjvuDocument*) luaL_checkudata(L, 1, "djvudocument");
+	int id = luaL_checkint(L, 2);
+	BlitBuffer *bb = (BlitBuffer*) lua_topointer(L, 3);
+	if (!bb) {
+		return luaL_argerror(L, 3, "expected a BlitBuffer");
+	}
+	DjvuRenderer *r = doc->renderer;
+	DjvuRenderJob *job = NULL;
+	if (r) {
+		pthread_mutex_lock(&r->lock);
+		job = findJob(r, id);
+		while (job && job->status < JOB_DONE)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (job)
+			unlinkJob(r, job);
+		pthread_mutex_unlock(&r->lock);
+	}
+	if (!job) {
+		return luaL_error(L, "no such DjVu render job: %d", id);
+	}
+
+	int ok = job->status == JOB_DONE;
+	if (ok) {
+		int w = MIN(job->w, (int)bb->w);
+		int h = MIN(job->h, (int)bb->h);
+		size_t job_stride = (size_t)job->w * job->pixelsize;
+		size_t row_size = MIN((size_t)w * job->pixelsize, bb->stride);
+		for (int y = 0; y < h; y++) {
+			memcpy(bb->data + y * bb->stride, job->data + y * job_stride, row_size);
+		}
+		if (job->pixelsize == 3 && job->saturation != 1.0) {
+			BB_saturate_rect(bb, 0, 0, w, h, job->saturation);
+		}
+	}
+	freeJob(job);
+
+	lua_pushboolean(L, ok);
+	return 1;
+}
+
+/* doc:cancelRender(job_id): forget about a job (pending jobs won't be
+ * rendered, the result of a running one will be dropped). */
+static int cancelRender(lua_State *L) {
+	DjvuDocument *doc = (DjvuDocument*) luaL_checkudata(L, 1, "djvudocument");
+	int id = luaL_checkint(L, 2);
+	DjvuRenderer *r = doc->renderer;
+	if (!r)
+		return 0;
+	pthread_mutex_lock(&r->lock);
+	DjvuRenderJob *job = findJob(r, id);
+	if (job) {
+		unlinkJob(r, job);
+		if (job->status == JOB_RUNNING) {
+			job->cancelled = 1; // the render thread will free it
+		} else {
+			freeJob(job);
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+	return 0;
+}
+
 static int getCacheSize(lua_State *L) {
 	DjvuDocument *doc = (DjvuDocument*) luaL_checkudata(L, 1, "djvudocument");
 	unsigned long size = ddjvu_cache_get_size(doc->context);
@@ -698,12 +1474,20 @@ static const struct luaL_Reg djvudocument_meth[] = {
 	{"getPages", getNumberOfPages},
 	{"getToc", getTableOfContent},
 	{"getPageText", getPageText},
+	{"getPageWords", getPageWords},
+	{"getTextDump", getTextDump},
 	{"getOriginalPageSize", getOriginalPageSize},
 	{"getPageInfo", getPageInfo},
 	{"close", closeDocument},
 	{"setColorRendering", setColorRendering},
 	{"getCacheSize", getCacheSize},
 	{"cleanCache", cleanCache},
+	{"renderPageAsync", renderPageAsync},
+	{"isRenderDone", isRenderDone},
+	{"waitRender", waitRender},
+	{"cancelRender", cancelRender},
+	{"setTileCacheSize", setTileCacheSize},
+	{"clearTileCache", clearTileCache},
 	{"__gc", closeDocument},
 	{NULL, NULL}
 };
@@ -715,6 +1499,7 @@ static const struct luaL_Reg djvupage_meth[] = {
 	{"close", closePage},
 	{"__gc", closePage},
 	{"draw", drawPage},
+	{"drawTiled", drawPageTiled},
 	{NULL, NULL}
 };
 
@@ -37,6 +37,7 @@ cdecl_func(BB_blend_RGB32_over_rect)
 cdecl_func(BB_blend_RGB_multiply_rect)
 cdecl_func(BB_blend_RGB32_multiply_rect)
 cdecl_func(BB_saturate_rect)
+cdecl_func(BB_blit_indexed_RGB32)
 cdecl_func(BB_blit_to)
 cdecl_func(BB_color_blit_from)
 cdecl_func(BB_color_blit_from_RGB32)
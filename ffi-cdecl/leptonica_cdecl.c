@@ -31,6 +31,7 @@ cdecl_func(boxaClipToBox)
 cdecl_func(boxaCombineOverlaps)
 cdecl_func(boxaCreate)
 cdecl_func(boxaDestroy)
+cdecl_func(boxaExtractAsNuma)
 cdecl_func(boxaGetBox)
 cdecl_func(boxaGetBoxGeometry)
 cdecl_func(boxaGetCount)
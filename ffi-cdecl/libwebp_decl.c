@@ -2,13 +2,54 @@
 #include <webp/demux.h>
 #include <webp/types.h>
 
+cdecl_const(WEBP_DECODER_ABI_VERSION)
 cdecl_const(WEBP_DEMUX_ABI_VERSION)
 cdecl_enum(WEBP_CSP_MODE)
 cdecl_type(WEBP_CSP_MODE)
+cdecl_enum(VP8StatusCode)
+cdecl_type(VP8StatusCode)
+
+cdecl_struct(WebPBitstreamFeatures)
+cdecl_type(WebPBitstreamFeatures)
+cdecl_struct(WebPRGBABuffer)
+cdecl_type(WebPRGBABuffer)
+cdecl_struct(WebPYUVABuffer)
+cdecl_type(WebPYUVABuffer)
+cdecl_struct(WebPDecBuffer)
+cdecl_type(WebPDecBuffer)
+cdecl_struct(WebPDecoderOptions)
+cdecl_type(WebPDecoderOptions)
+cdecl_struct(WebPDecoderConfig)
+cdecl_type(WebPDecoderConfig)
+// cdecl_func(WebPInitDecoderConfig) // inline in decode.h
+cdecl_func(WebPInitDecoderConfigInternal)
+// cdecl_func(WebPGetFeatures)       // inline in decode.h
+cdecl_func(WebPGetFeaturesInternal)
+cdecl_func(WebPDecode)
+cdecl_func(WebPFreeDecBuffer)
 
 cdecl_struct(WebPData)
 cdecl_type(WebPData)
 
+cdecl_enum(WebPDemuxState)
+cdecl_type(WebPDemuxState)
+cdecl_enum(WebPFormatFeature)
+cdecl_type(WebPFormatFeature)
+cdecl_enum(WebPMuxAnimDispose)
+cdecl_type(WebPMuxAnimDispose)
+cdecl_enum(WebPMuxAnimBlend)
+cdecl_type(WebPMuxAnimBlend)
+
+cdecl_type(WebPDemuxer)
+cdecl_struct(WebPIterator)
+cdecl_type(WebPIterator)
+// cdecl_func(WebPDemux)      // inline in demux.h
+cdecl_func(WebPDemuxInternal) // we need to use this one
+cdecl_func(WebPDemuxGetI)
+cdecl_func(WebPDemuxGetFrame)
+cdecl_func(WebPDemuxReleaseIterator)
+cdecl_func(WebPDemuxDelete)
+
 cdecl_struct(WebPAnimInfo)
 cdecl_type(WebPAnimInfo)
 
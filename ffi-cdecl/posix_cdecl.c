@@ -609,6 +609,7 @@ cdecl_func(waitpid);
 cdecl_const(MAP_ANONYMOUS);
 cdecl_out(const_MAP_FAILED, static const int MAP_FAILED = -1;);
 cdecl_const(MAP_SHARED);
+cdecl_const(MAP_PRIVATE);
 cdecl_const(PROT_READ);
 cdecl_const(PROT_WRITE);
 
@@ -588,6 +588,8 @@ static const unsigned MAP_ANONYMOUS = 32;
 static const int MAP_FAILED = -1;
 // cdecl_const_MAP_SHARED
 static const unsigned MAP_SHARED = 1;
+// cdecl_const_MAP_PRIVATE
+static const unsigned MAP_PRIVATE = 2;
 // cdecl_const_PROT_READ
 static const unsigned PROT_READ = 1;
 // cdecl_const_PROT_WRITE
@@ -11,6 +11,7 @@ cdecl_enum(TJPF)
 cdecl_enum(TJPARAM)
 
 cdecl_type(tjhandle)
+cdecl_type(tjscalingfactor)
 
 cdecl_func(tj3Init)
 cdecl_func(tj3InitVersion)
@@ -20,6 +21,8 @@ cdecl_func(tj3GetErrorStr)
 cdecl_func(tj3Compress8)
 cdecl_func(tj3DecompressHeader)
 cdecl_func(tj3Decompress8)
+cdecl_func(tj3GetScalingFactors)
+cdecl_func(tj3SetScalingFactor)
 cdecl_func(tj3Destroy)
 cdecl_func(tj3SaveImage8)
 cdecl_func(tj3Free)
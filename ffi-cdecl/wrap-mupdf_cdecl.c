@@ -58,6 +58,7 @@ cdecl_type(fz_separations)
 cdecl_type(fz_page)
 cdecl_type(fz_document)
 cdecl_type(fz_device)
+cdecl_type(fz_display_list)
 
 cdecl_func(mupdf_open_document)
 cdecl_func(mupdf_open_document_with_stream_and_dir)
@@ -112,9 +113,21 @@ cdecl_struct(fz_stext_block)
 cdecl_type(fz_stext_options)
 cdecl_type(fz_stext_page)
 cdecl_func(mupdf_new_stext_page_from_page)
+cdecl_type(mupdf_stext_words)
+cdecl_func(mupdf_new_stext_words)
+cdecl_func(fz_free)
 cdecl_func(mupdf_search_stext_page);
 cdecl_func(fz_drop_stext_page)
 
+/* document search */
+cdecl_type(mupdf_searcher)
+cdecl_type(mupdf_search_hit)
+cdecl_func(mupdf_new_searcher)
+cdecl_func(mupdf_drop_searcher)
+cdecl_func(mupdf_searcher_start)
+cdecl_func(mupdf_searcher_cancel)
+cdecl_func(mupdf_searcher_poll)
+
 cdecl_type(fz_color_params)
 cdecl_type(fz_default_colorspaces)
 cdecl_var(fz_default_color_params)
@@ -124,6 +137,7 @@ cdecl_func(fz_new_pixmap) // compat
 cdecl_func(mupdf_new_pixmap_with_bbox)
 cdecl_func(mupdf_new_pixmap_with_data)
 cdecl_func(mupdf_new_pixmap_with_bbox_and_data)
+cdecl_func(mupdf_new_pixmap_with_bbox_and_data_stride)
 cdecl_func(mupdf_convert_pixmap)
 cdecl_func(fz_drop_pixmap)
 cdecl_func(fz_clear_pixmap_with_value)
@@ -144,6 +158,15 @@ cdecl_func(mupdf_new_bbox_device)
 cdecl_func(mupdf_new_transparency_mask_device)
 cdecl_func(mupdf_page_has_transparency_mask)
 cdecl_func(mupdf_run_page)
+cdecl_func(mupdf_new_display_list_from_page)
+cdecl_func(mupdf_run_display_list)
+cdecl_func(fz_drop_display_list)
+cdecl_func(mupdf_draw_display_list_banded)
+cdecl_func(mupdf_render_pool_shutdown)
+cdecl_func(mupdf_set_image_cache)
+cdecl_func(mupdf_get_image_cache_used)
+cdecl_func(mupdf_clear_image_cache)
+cdecl_func(mupdf_hook_image_cache)
 cdecl_func(mupdf_close_device)
 cdecl_func(fz_drop_device)
 
@@ -173,10 +196,19 @@ cdecl_func(mupdf_pdf_annot_quad_point)
 /* saving documents */
 cdecl_type(pdf_write_options)
 cdecl_func(mupdf_pdf_save_document)
+cdecl_func(pdf_specifics)
+cdecl_func(pdf_has_unsaved_changes)
+cdecl_func(pdf_can_be_saved_incrementally)
 
 /* the following is for our own wrapper lib: */
+cdecl_enum(mupdf_alloc_category)
+cdecl_type(mupdf_alloc_stats)
 cdecl_func(mupdf_get_my_alloc_context)
+cdecl_func(mupdf_get_my_locks_context)
 cdecl_func(mupdf_get_cache_size)
+cdecl_func(mupdf_set_alloc_category)
+cdecl_func(mupdf_get_alloc_stats)
+cdecl_func(mupdf_reset_alloc_peak)
 cdecl_func(mupdf_error_code)
 cdecl_func(mupdf_error_message)
 
@@ -147,6 +147,8 @@ void BB_color_blit_from(BlitBuffer * restrict dest, const BlitBuffer * restrict
                         unsigned int offs_x, unsigned int offs_y, unsigned int w, unsigned int h, const Color8A * restrict color);
 void BB_color_blit_from_RGB32(BlitBuffer * restrict dest, const BlitBuffer * restrict source, unsigned int dest_x, unsigned int dest_y,
                         unsigned int offs_x, unsigned int offs_y, unsigned int w, unsigned int h, const ColorRGB32 * restrict color);
+void BB_blit_indexed_RGB32(BlitBuffer * restrict bb, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+                        const uint8_t * restrict indices, unsigned int stride, const ColorRGB32 * restrict palette, int transparent);
 void BB_paint_rounded_corner(BlitBuffer * restrict bb, unsigned int off_x, unsigned int off_y, unsigned int w, unsigned int h,
                         unsigned int bw, unsigned int r, uint8_t c, int anti_alias);
 ]]
@@ -1922,6 +1924,34 @@ function BB_mt.__index:paintRectRGB32(x, y, w, h, color, setter)
     end
 end
 
+--[[
+paint a rectangle of palette indices (e.g., a GIF frame) onto this buffer
+
+@param x, y, w, h destination rectangle (clipped to the buffer)
+@param indices uint8_t pointer to the top-left index of the rectangle
+@param stride number of indices per row in the source
+@param palette ColorRGB32 array, indexed by the values in indices
+@param transparent index to leave untouched (optional)
+--]]
+function BB_mt.__index:paintIndexedRGB32(x, y, w, h, indices, stride, palette, transparent)
+    local bx, by, bw, bh = self:getBoundedRect(x, y, w, h)
+    if bw <= 0 or bh <= 0 then return end
+    indices = ffi.cast(uint8pt, indices) + (by - y) * stride + (bx - x)
+    if self:canUseCbb() and self:getType() == TYPE_BBRGB32 then
+        cblitbuffer.BB_blit_indexed_RGB32(ffi.cast(P_BlitBuffer, self),
+            bx, by, bw, bh, indices, stride, palette, transparent or -1)
+    else
+        for j = 0, bh-1 do
+            local p = indices + stride*j
+            for i = 0, bw-1 do
+                if p[i] ~= transparent then
+                    self:setPixel(bx+i, by+j, palette[p[i]])
+                end
+            end
+        end
+    end
+end
+
 -- BB4 version, identical if not for the lack of fast filling, because nibbles aren't addressable...
 -- Also, no cbb branch, as cbb doesn't handle 4bpp targets at all.
 function BB4_mt.__index:paintRectRGB32(x, y, w, h, color, setter)
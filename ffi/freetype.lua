@@ -127,6 +127,35 @@ function FTSize_mt.__index:renderGlyphByIndex(index, embolden_half_strength)
     }
 end
 
+local xtext -- lazily loaded by getGlyphFromAtlas()
+
+--[[--
+Get a glyph by index, rendered as with renderGlyphByIndex(), from the native glyph atlas.
+
+Glyphs are rendered once and packed into shared 8bpp pages, so this avoids
+rendering and allocating a new BlitBuffer for each glyph drawn.
+
+NOTE: the returned bb is a view into the atlas, not a copy: it must not be
+freed, and is only valid until the next call to this method (on any font),
+so it should be blitted right away rather than kept around.
+--]]
+function FTSize_mt.__index:getGlyphFromAtlas(index, embolden_half_strength)
+    if not xtext then
+        xtext = require("libs/libkoreader-xtext")
+    end
+    local data, pitch, w, h, l, t, r, ax, ay = xtext.getAtlasGlyph(self, index,
+        embolden_half_strength and tonumber(embolden_half_strength) or 0)
+    if not data then error("freetype error") end
+    return {
+        bb = Blitbuffer.new(w, h, Blitbuffer.TYPE_BB8, data, pitch),
+        l  = l,
+        t  = t,
+        r  = r,
+        ax = ax,
+        ay = ay
+    }
+end
+
 function FTSize_mt.__index:getEmboldenHalfStrength(factor)
     assert(ft2.FT_Activate_Size(self) == 0, "failed to activate font size")
     -- See crengine/src/lvfntman.cpp setEmbolden() for details
@@ -225,6 +254,23 @@ function FT.newFaceSize(filename, pxsize, faceindex)
     return size
 end
 
+--- Sets the byte budget of the glyph atlas used by getGlyphFromAtlas().
+-- Returns the previous budget, and the number of bytes currently used.
+function FT.setGlyphAtlasMaxBytes(max_bytes)
+    if not xtext then
+        xtext = require("libs/libkoreader-xtext")
+    end
+    return xtext.setGlyphAtlasMaxBytes(max_bytes)
+end
+
+--- Drops all glyphs from the glyph atlas used by getGlyphFromAtlas().
+function FT.clearGlyphAtlas()
+    if not xtext then
+        xtext = require("libs/libkoreader-xtext")
+    end
+    xtext.clearGlyphAtlas()
+end
+
 function FT.getFaceCount(filename, info)
     -- Probes number of faces available within the font file
     local success, face = pcall(new_face, filename, -1)
@@ -9,6 +9,7 @@ This is a LuaJIT FFI wrapper for turbojpeg.
 local ffi = require("ffi")
 local C = ffi.C
 local BB = require("ffi/blitbuffer")
+local posix = require("ffi/posix")
 
 require("ffi/posix_h")
 require("ffi/turbojpeg_h")
@@ -27,15 +28,45 @@ end
 local Jpeg = {}
 
 function Jpeg.openDocument(filename, color)
-    local fh = io.open(filename, "rb")
-    assert(fh, "couldn't open JPG file")
-    local data = fh:read("*a")
-    fh:close()
+    -- Decode straight from a mapping of the file, instead of a copy of it in a Lua string
+    local ok, data, size = pcall(posix.mmapFile, filename)
+    assert(ok, "couldn't open JPG file")
 
-    return Jpeg.openDocumentFromMem(data, color)
+    local image_bb, width, height, components
+    ok, image_bb, width, height, components = pcall(Jpeg.openDocumentFromMem, data, color, size)
+    posix.munmap(data, size)
+    if not ok then
+        error(image_bb, 0)
+    end
+    return image_bb, width, height, components
+end
+
+-- Smallest of the scaling factors the decoder supports that doesn't go below the given scale
+local function getScalingFactor(scale)
+    local count = ffi.new("int[1]")
+    local factors = turbojpeg.tj3GetScalingFactors(count)
+    local best
+    for i = 0, count[0]-1 do
+        local sf = factors[i]
+        local f = sf.num / sf.denom
+        if f >= scale and f <= 1 and (not best or f < best.num / best.denom) then
+            best = sf
+        end
+    end
+    return best
 end
 
-function Jpeg.openDocumentFromMem(data, color, size)
+--[[--
+Decodes a JPEG image from memory.
+
+If max_w and max_h are given, the image is downscaled while decoding
+(by the smallest factor in 1/8 steps supported by libjpeg-turbo) to no less
+than what is needed to fit it in max_w x max_h: the result may still need
+a final scaling to fit exactly.
+
+@return image_bb, width, height, components (the size of image_bb), and the original width and height
+--]]
+function Jpeg.openDocumentFromMem(data, color, size, max_w, max_h)
     local handle = tj3Init(turbojpeg.TJINIT_DECOMPRESS)
     assert(handle, "no TurboJPEG API decompressor handle")
 
@@ -46,6 +77,15 @@ function Jpeg.openDocumentFromMem(data, color, size)
 
     local width = turbojpeg.tj3Get(handle, turbojpeg.TJPARAM_JPEGWIDTH)
     local height = turbojpeg.tj3Get(handle, turbojpeg.TJPARAM_JPEGHEIGHT)
+    local orig_w, orig_h = width, height
+    if max_w and max_h then
+        local sf = getScalingFactor(math.min(max_w / width, max_h / height))
+        if sf and sf.num ~= sf.denom and turbojpeg.tj3SetScalingFactor(handle, sf) == 0 then
+            -- TJSCALED()
+            width = math.floor((width * sf.num + sf.denom - 1) / sf.denom)
+            height = math.floor((height * sf.num + sf.denom - 1) / sf.denom)
+        end
+    end
     --[[
     local inSubsamp = turbojpeg.tj3Get(handle, turbojpeg.TJPARAM_SUBSAMP)
     local inColorspace = turbojpeg.tj3Get(handle, turbojpeg.TJPARAM_COLORSPACE)
@@ -71,7 +111,7 @@ function Jpeg.openDocumentFromMem(data, color, size)
     end
 
     turbojpeg.tj3Destroy(handle)
-    return image_bb, width, height, components
+    return image_bb, width, height, components, orig_w, orig_h
 end
 
 function Jpeg.encodeToFile(filename, source_ptr, w, h, n, quality, stride, subsample)
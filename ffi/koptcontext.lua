@@ -66,11 +66,13 @@ Leptonica cheatsheet:
 @module ffi.koptcontext
 ]]
 
+local bit = require("bit")
 local ffi = require("ffi")
 local C = ffi.C
 
 require("ffi/koptcontext_h")
 require("ffi/leptonica_h")
+require("ffi/posix_h")
 local Blitbuffer = require("ffi/blitbuffer")
 local leptonica = ffi.loadlib("leptonica", "6")
 local k2pdfopt = ffi.loadlib("k2pdfopt", "2")
@@ -173,6 +175,72 @@ local function numa_from_string(s)
     return leptonica.numaCreateFromFArray(ffi.cast("l_float32*", s), #s / 4, leptonica.L_COPY)
 end
 
+-- Bitmaps handed over by totable(kc, true) go through files on this tmpfs,
+-- which fromtable maps instead of copying their data around.
+local SHM_DIR = "/dev/shm"
+local SHM_PREFIX = "koptcontext-"
+local shm_count = 0
+-- bitmaps adopted by fromtable, by context: they stay out of src/dst (which
+-- k2pdfopt may realloc or free) until ownBitmaps() is called
+local shm_views = setmetatable({}, {__mode = "k"})
+-- adopted dst bitmaps handed out by dstView, kept mapped until free()
+local shm_retired = setmetatable({}, {__mode = "k"})
+
+local function bmp_to_shm(bmp)
+    -- only the rows in use, bmp_alloc may have left a larger buffer
+    local size = k2pdfopt.bmp_bytewidth(bmp) * bmp.height
+    shm_count = shm_count + 1
+    local path = string.format("%s/%s%d-%d", SHM_DIR, SHM_PREFIX, C.getpid(), shm_count)
+    local fd = C.open(path, bit.bor(C.O_CREAT, C.O_TRUNC, C.O_RDWR, C.O_CLOEXEC), ffi.cast("int", 384)) -- 0600
+    if fd < 0 then return end
+    local map
+    if C.ftruncate(fd, size) == 0 then
+        map = C.mmap(nil, size, bit.bor(C.PROT_READ, C.PROT_WRITE), C.MAP_SHARED, fd, 0)
+    end
+    C.close(fd)
+    if not map or ffi.cast("intptr_t", map) == C.MAP_FAILED then
+        os.remove(path)
+        return
+    end
+    ffi.copy(map, bmp.data, size)
+    C.munmap(map, size)
+    return path, size
+end
+
+-- Maps (read-only) and unlinks a bitmap written by bmp_to_shm,
+-- the mapping is released on garbage collection.
+local function bmp_from_shm(path, size)
+    local fd = C.open(path, bit.bor(C.O_RDONLY, C.O_CLOEXEC))
+    -- the mapping keeps the data alive
+    os.remove(path)
+    if fd < 0 then error("cannot open shared bitmap " .. path) end
+    local map = C.mmap(nil, size, C.PROT_READ, C.MAP_SHARED, fd, 0)
+    C.close(fd)
+    if ffi.cast("intptr_t", map) == C.MAP_FAILED then error("cannot map shared bitmap " .. path) end
+    return { size = size, data = ffi.gc(ffi.cast("unsigned char *", map), function(p) C.munmap(p, size) end) }
+end
+
+local function shm_view_release(view)
+    C.munmap(ffi.gc(view.data, nil), view.size)
+    view.data = nil
+end
+
+-- Removes the shared bitmaps left behind by pid (e.g. a worker that died,
+-- or whose output was never read), or by any process that's gone.
+local function shm_cleanup(pid)
+    local lfs = require("libs/libkoreader-lfs")
+    local ok, iter, dir_obj = pcall(lfs.dir, SHM_DIR)
+    if not ok then return end
+    for name in iter, dir_obj do
+        local owner = name:sub(1, #SHM_PREFIX) == SHM_PREFIX and name:sub(#SHM_PREFIX + 1):match("^(%d+)%-%d+$")
+        owner = owner and tonumber(owner)
+        if owner and (owner == pid or (not pid and not lfs.attributes("/proc/" .. owner, "mode"))) then
+            os.remove(SHM_DIR .. "/" .. name)
+        end
+    end
+end
+local shm_swept = false
+
 function KOPTContext_mt.__index:setBBox(x0, y0, x1, y1)
     self.bbox.x0, self.bbox.y0, self.bbox.x1, self.bbox.y1 = x0, y0, x1, y1
 end
@@ -219,36 +287,124 @@ function KOPTContext_mt.__index:getLanguage() return ffi.string(self.language) e
 function KOPTContext_mt.__index:getPageDim() return self.page_width, self.page_height end
 function KOPTContext_mt.__index:getBBox(x0, y0, x1, y1) return self.bbox.x0, self.bbox.y0, self.bbox.x1, self.bbox.y1 end
 
+--[[--
+Moves the bitmaps adopted by fromtable (see totable) into malloc'd memory
+of their own.
+
+Until then, src and dst have no data, and only dstView/dstToBlitBuffer
+can see the pixels: call it before anything else uses or changes them.
+The methods handing the bitmaps to k2pdfopt or leptonica do it themselves.
+--]]
+function KOPTContext_mt.__index:ownBitmaps()
+    local views = shm_views[self]
+    if not views then return end
+    shm_views[self] = nil
+    for which, view in pairs(views) do
+        local bmp = self[which]
+        -- a bitmap set meanwhile (e.g. by getPagePix) wins over the adopted one
+        local data = bmp.data == nil and C.malloc(view.size) or nil
+        if data ~= nil then
+            ffi.copy(data, view.data, view.size)
+            bmp.data = data
+            bmp.size_allocated = view.size
+        end
+        if view.exposed then
+            shm_retired[self] = view
+        else
+            shm_view_release(view)
+        end
+        if data == nil and bmp.data == nil then
+            error("cannot allocate bitmap")
+        end
+    end
+end
+
 function KOPTContext_mt.__index:copyDestBMP(src)
+    self:ownBitmaps()
+    src:ownBitmaps()
+    self:invalidateWordBoxes()
     if src.dst.bpp == 8 or src.dst.bpp == 24 or src.dst.bpp == 32 then
         k2pdfopt.bmp_copy(self.dst, src.dst)
     end
 end
 
+-- the dst pixels, wherever they are (see fromtable)
+local function dst_data(kc)
+    local views = shm_views[kc]
+    return views and views.dst and views.dst.data or kc.dst.data
+end
+
 function KOPTContext_mt.__index:dstToBlitBuffer()
     local bb
+    local data = dst_data(self)
     if self.dst.bpp == 8 then
-        bb = Blitbuffer.new(self.dst.width, self.dst.height, Blitbuffer.TYPE_BB8, self.dst.data):copy()
+        bb = Blitbuffer.new(self.dst.width, self.dst.height, Blitbuffer.TYPE_BB8, data):copy()
     elseif self.dst.bpp == 24 then
-        bb = Blitbuffer.new(self.dst.width, self.dst.height, Blitbuffer.TYPE_BBRGB24, self.dst.data):copy()
+        bb = Blitbuffer.new(self.dst.width, self.dst.height, Blitbuffer.TYPE_BBRGB24, data):copy()
     elseif self.dst.bpp == 32 then
-        bb = Blitbuffer.new(self.dst.width, self.dst.height, Blitbuffer.TYPE_BBRGB32, self.dst.data):copy()
+        bb = Blitbuffer.new(self.dst.width, self.dst.height, Blitbuffer.TYPE_BBRGB32, data):copy()
     end
     return bb
 end
 
-function KOPTContext_mt.__index:getWordBoxes(bmp, x, y, w, h, box_type)
+-- Like dstToBlitBuffer, but the BlitBuffer is a view over the reflowed
+-- bitmap itself: it's only valid until the next reflow or free().
+function KOPTContext_mt.__index:dstView()
+    local bbtype
+    if self.dst.bpp == 8 then
+        bbtype = Blitbuffer.TYPE_BB8
+    elseif self.dst.bpp == 24 then
+        bbtype = Blitbuffer.TYPE_BBRGB24
+    elseif self.dst.bpp == 32 then
+        bbtype = Blitbuffer.TYPE_BBRGB32
+    else
+        return
+    end
+    local views = shm_views[self]
+    if views and views.dst then
+        -- must outlive ownBitmaps
+        views.dst.exposed = true
+    end
+    return Blitbuffer.new(self.dst.width, self.dst.height, bbtype, dst_data(self), k2pdfopt.bmp_bytewidth(self.dst))
+end
+
+-- results of getWordBoxesFlat, by context and arguments
+local word_boxes_caches = setmetatable({}, {__mode = "k"})
+-- rectmaps lookup grids (see get_rectmap_index), by context
+local rectmap_indexes = setmetatable({}, {__mode = "k"})
+
+--[[--
+Gets the word boxes of an area of the src or dst bitmap as flat arrays.
+
+Returns a table with n words, whose words int32_t array holds x0, y0, x1,
+y1 and the (0-based) line index of each word, and nlines lines, whose
+lines array holds the x0, y0, x1, y1 bounding box of each line.
+
+With cache, results are kept per bitmap and area, and shared between
+callers (don't modify them), until invalidateWordBoxes() is called:
+reflow() and the page getPagePix methods do, but anything else changing
+the bitmaps (e.g. calling k2pdfopt.k2pdfopt_reflow_bmp() directly) must.
+--]]
+function KOPTContext_mt.__index:getWordBoxesFlat(bmp, x, y, w, h, box_type, cache)
+    self:ownBitmaps()
+    local bitmap = bmp == "src" and self.src or self.dst
+    local key
+    if cache then
+        key = table.concat({bmp, x, y, w, h, box_type,
+            tostring(ffi.cast("void *", bitmap.data)), bitmap.width, bitmap.height}, ":")
+        cache = word_boxes_caches[self]
+        if cache and cache[key] then return cache[key] end
+    end
+
     local boxa
     local nai
 
     if box_type == 0 then
-        k2pdfopt.k2pdfopt_get_reflowed_word_boxes(self,
-            bmp == "src" and self.src or self.dst, x, y, w, h)
+        k2pdfopt.k2pdfopt_get_reflowed_word_boxes(self, bitmap, x, y, w, h)
         boxa = self.rboxa
         nai = self.rnai
     elseif box_type == 1 then
-        k2pdfopt.k2pdfopt_get_native_word_boxes(self,
-            bmp == "src" and self.src or self.dst, x, y, w, h)
+        k2pdfopt.k2pdfopt_get_native_word_boxes(self, bitmap, x, y, w, h)
         boxa = self.nboxa
         nai = self.nnai
     end
@@ -259,117 +415,256 @@ function KOPTContext_mt.__index:getWordBoxes(bmp, x, y, w, h, box_type)
     local nr_word = leptonica.boxaGetCount(boxa)
     assert(nr_word == leptonica.numaGetCount(nai))
 
-    local boxes = {}
-    local lbox, current_line
-    local counter_w = 0
-    local l_x0, l_y0, l_x1, l_y1
-    local counter_l = ffi.new("int[1]")
+    -- all the geometries at once, instead of a call per box
+    local nal, nat = ffi.new("NUMA *[1]"), ffi.new("NUMA *[1]")
+    local naw, nah = ffi.new("NUMA *[1]"), ffi.new("NUMA *[1]")
+    if leptonica.boxaExtractAsNuma(boxa, nal, nat, nil, nil, naw, nah, 1) ~= 0 then return end
+    nal, nat = _gc_ptr(nal[0], numaDestroy), _gc_ptr(nat[0], numaDestroy)
+    naw, nah = _gc_ptr(naw[0], numaDestroy), _gc_ptr(nah[0], numaDestroy)
+    local box_x = leptonica.numaGetFArray(nal, leptonica.L_NOCOPY)
+    local box_y = leptonica.numaGetFArray(nat, leptonica.L_NOCOPY)
+    local box_w = leptonica.numaGetFArray(naw, leptonica.L_NOCOPY)
+    local box_h = leptonica.numaGetFArray(nah, leptonica.L_NOCOPY)
+    local line_nr = leptonica.numaGetFArray(nai, leptonica.L_NOCOPY)
+
+    local words = ffi.new("int32_t[?]", nr_word * 5)
+    -- there can't be more lines than words
+    local lines = ffi.new("int32_t[?]", nr_word * 4)
+    local nlines = 0
+    local current_line
+    for i = 0, nr_word - 1 do
+        local x0, y0 = box_x[i], box_y[i]
+        local x1, y1 = x0 + box_w[i], y0 + box_h[i]
+        if current_line ~= line_nr[i] then
+            current_line = line_nr[i]
+            nlines = nlines + 1
+            local l = (nlines - 1) * 4
+            lines[l], lines[l+1], lines[l+2], lines[l+3] = 9999, 9999, 0, 0
+        end
+        local l = (nlines - 1) * 4
+        if x0 < lines[l] then lines[l] = x0 end
+        if y0 < lines[l+1] then lines[l+1] = y0 end
+        if x1 > lines[l+2] then lines[l+2] = x1 end
+        if y1 > lines[l+3] then lines[l+3] = y1 end
+        words[i*5], words[i*5+1], words[i*5+2], words[i*5+3], words[i*5+4] = x0, y0, x1, y1, nlines - 1
+    end
 
-    for box_x, box_y, box_w, box_h in boxaIterBoxGeometries(boxa) do
-        leptonica.numaGetIValue(nai, counter_w, counter_l)
-        if current_line ~= counter_l[0] then
-            if lbox then
-                -- box for the whole line
-                lbox.x0, lbox.y0, lbox.x1, lbox.y1 = l_x0, l_y0, l_x1, l_y1
-            end
-            l_x0, l_y0, l_x1, l_y1 = 9999, 9999, 0, 0
-            current_line = counter_l[0]
-            lbox = {}
-            table.insert(boxes, lbox)
+    local result = { n = nr_word, words = words, nlines = nlines, lines = lines }
+    if key then
+        if not cache then
+            cache = {}
+            word_boxes_caches[self] = cache
         end
-        l_x0 = box_x < l_x0 and box_x or l_x0
-        l_y0 = box_y < l_y0 and box_y or l_y0
-        l_x1 = box_x + box_w > l_x1 and box_x + box_w or l_x1
-        l_y1 = box_y + box_h > l_y1 and box_y + box_h or l_y1
-        -- box for a single word
-        table.insert(lbox, {
-            x0 = box_x, y0 = box_y,
-            x1 = box_x + box_w,
-            y1 = box_y + box_h,
-        })
-        counter_w = counter_w + 1
+        cache[key] = result
     end
+    return result
+end
+
+-- drops the cached word boxes and rectmaps index, to be called when the bitmaps change
+function KOPTContext_mt.__index:invalidateWordBoxes()
+    word_boxes_caches[self] = nil
+    rectmap_indexes[self] = nil
+end
+
+-- reflows src into dst
+function KOPTContext_mt.__index:reflow()
+    self:ownBitmaps()
+    self:invalidateWordBoxes()
+    k2pdfopt.k2pdfopt_reflow_bmp(self)
+end
+
+function KOPTContext_mt.__index:getWordBoxes(bmp, x, y, w, h, box_type, cache)
+    local flat = self:getWordBoxesFlat(bmp, x, y, w, h, box_type, cache)
+    if not flat then return end
 
-    if lbox then
+    local boxes = {}
+    local words, lines = flat.words, flat.lines
+    for l = 0, flat.nlines - 1 do
         -- box for the whole line
-        lbox.x0, lbox.y0, lbox.x1, lbox.y1 = l_x0, l_y0, l_x1, l_y1
+        boxes[l+1] = {
+            x0 = lines[l*4], y0 = lines[l*4+1],
+            x1 = lines[l*4+2], y1 = lines[l*4+3],
+        }
+    end
+    for i = 0, flat.n - 1 do
+        -- box for a single word
+        table.insert(boxes[words[i*5+4] + 1], {
+            x0 = words[i*5], y0 = words[i*5+1],
+            x1 = words[i*5+2], y1 = words[i*5+3],
+        })
     end
 
-    return boxes, nr_word
+    return boxes, flat.n
 end
 
-function KOPTContext_mt.__index:getReflowedWordBoxes(bmp, x, y, w, h)
-    return self:getWordBoxes(bmp, x, y, w, h, 0)
+function KOPTContext_mt.__index:getReflowedWordBoxes(bmp, x, y, w, h, cache)
+    return self:getWordBoxes(bmp, x, y, w, h, 0, cache)
 end
 
-function KOPTContext_mt.__index:getNativeWordBoxes(bmp, x, y, w, h)
-    return self:getWordBoxes(bmp, x, y, w, h, 1)
+function KOPTContext_mt.__index:getNativeWordBoxes(bmp, x, y, w, h, cache)
+    return self:getWordBoxes(bmp, x, y, w, h, 1, cache)
 end
 
-function KOPTContext_mt.__index:reflowToNativePosTransform(xc, yc, wr, hr)
-    local function wrectmap_reflow_distance(wrmap, x, y)
-        local function wrectmap_reflow_inside(wrmap_inside, x_inside, y_inside)
-            return k2pdfopt.wrectmap_inside(wrmap_inside, x_inside, y_inside) ~= 0
-        end
-        if wrectmap_reflow_inside(wrmap, x, y) then
-            return 0
-        else
-            local x0, y0 = x, y
-            local x1 = wrmap.coords[1].x + wrmap.coords[2].x / 2
-            local y1 = wrmap.coords[1].y + wrmap.coords[2].y / 2
-            return (x0 - x1)*(x0 - x1) + (y0 - y1)*(y0 - y1)
+--[[
+Rectmaps lookups go through a uniform grid over the rectangles of either
+side (reflowed and native), built once per reflowed page: each cell lists
+the rectangles overlapping it, and the ones whose center falls in it,
+in rectmap order, so queries give the same answers as a linear scan
+(first rectangle containing the point, else the one with the closest
+center).
+--]]
+local function grid_new(n, x0s, y0s, x1s, y1s, cxs, cys)
+    local gx0, gy0, gx1, gy1 = math.huge, math.huge, -math.huge, -math.huge
+    for i = 1, n do
+        gx0, gy0 = math.min(gx0, x0s[i]), math.min(gy0, y0s[i])
+        gx1, gy1 = math.max(gx1, x1s[i]), math.max(gy1, y1s[i])
+    end
+    local size = math.max(1, math.ceil(math.sqrt(n)))
+    local grid = {
+        x0 = gx0, y0 = gy0,
+        cols = size, rows = size,
+        cw = math.max((gx1 - gx0) / size, 1), ch = math.max((gy1 - gy0) / size, 1),
+        rects = {}, centers = {},
+        cxs = cxs, cys = cys,
+    }
+    for cell = 1, size * size do
+        grid.rects[cell] = {}
+        grid.centers[cell] = {}
+    end
+    local function col(x) return math.min(math.max(math.floor((x - grid.x0) / grid.cw), 0), grid.cols - 1) end
+    local function row(y) return math.min(math.max(math.floor((y - grid.y0) / grid.ch), 0), grid.rows - 1) end
+    grid.col, grid.row = col, row
+    for i = 1, n do
+        for r = row(y0s[i]), row(y1s[i]) do
+            for c = col(x0s[i]), col(x1s[i]) do
+                table.insert(grid.rects[r * size + c + 1], i)
+            end
         end
+        table.insert(grid.centers[row(cys[i]) * size + col(cxs[i]) + 1], i)
     end
+    return grid
+end
 
-    local m = 0
-    for i = 0, self.rectmaps.n - 1 do
-        if wrectmap_reflow_distance(self.rectmaps.wrectmap + m, xc, yc) >
-            wrectmap_reflow_distance(self.rectmaps.wrectmap + i, xc, yc) then
-            m = i
+-- 1-based index of the first rectangle containing x, y, or of the one
+-- with the closest center (the first one on ties); inside may only look
+-- at the point as cell_x, cell_y
+local function grid_lookup(grid, x, y, inside, cell_x, cell_y)
+    local cell = grid.row(cell_y or y) * grid.cols + grid.col(cell_x or x) + 1
+    for _, i in ipairs(grid.rects[cell]) do
+        if inside(i, x, y) then return i end
+    end
+    local c0, r0 = grid.col(x), grid.row(y)
+    local best, best_d2 = nil, math.huge
+    local cxs, cys = grid.cxs, grid.cys
+    local radius = 0
+    while true do
+        for r = r0 - radius, r0 + radius do
+            if r >= 0 and r < grid.rows then
+                -- only the ring of cells at this radius
+                local step = (r == r0 - radius or r == r0 + radius) and 1 or 2 * radius
+                for c = c0 - radius, c0 + radius, math.max(step, 1) do
+                    if c >= 0 and c < grid.cols then
+                        for _, i in ipairs(grid.centers[r * grid.cols + c + 1]) do
+                            local d2 = (x - cxs[i])*(x - cxs[i]) + (y - cys[i])*(y - cys[i])
+                            if d2 < best_d2 or (d2 == best_d2 and i < best) then
+                                best, best_d2 = i, d2
+                            end
+                        end
+                    end
+                end
+            end
         end
+        -- centers in cells further away are at least that far
+        local reach = radius * math.min(grid.cw, grid.ch)
+        if best and best_d2 < reach * reach then break end
+        if radius > grid.cols and radius > grid.rows then break end
+        radius = radius + 1
     end
-    if self.rectmaps.n > m then
-        local rectmap = self.rectmaps.wrectmap + m
-        local x = rectmap.coords[0].x*self.dev_dpi*self.quality/rectmap.srcdpiw
-        local y = rectmap.coords[0].y*self.dev_dpi*self.quality/rectmap.srcdpih
-        local w = rectmap.coords[2].x*self.dev_dpi*self.quality/rectmap.srcdpiw
-        local h = rectmap.coords[2].y*self.dev_dpi*self.quality/rectmap.srcdpih
-        return (x+w*wr)/self.zoom+self.bbox.x0, (y+h*hr)/self.zoom+self.bbox.y0
+    return best
+end
+
+local function get_rectmap_index(kc)
+    local n = kc.rectmaps.n
+    if n == 0 then return end
+    local index = rectmap_indexes[kc]
+    local scale = kc.dev_dpi * kc.quality
+    if index and index.n == n and index.wrectmap == kc.rectmaps.wrectmap and index.scale == scale then
+        return index
     end
+
+    local rx0, ry0, rx1, ry1, rcx, rcy = {}, {}, {}, {}, {}, {}
+    local nx0, ny0, nx1, ny1, ncx, ncy = {}, {}, {}, {}, {}, {}
+    local nw, nh = {}, {}
+    for i = 1, n do
+        local rectmap = kc.rectmaps.wrectmap + (i - 1)
+        rx0[i], ry0[i] = rectmap.coords[1].x, rectmap.coords[1].y
+        rx1[i], ry1[i] = rx0[i] + rectmap.coords[2].x, ry0[i] + rectmap.coords[2].y
+        rcx[i], rcy[i] = rx0[i] + rectmap.coords[2].x / 2, ry0[i] + rectmap.coords[2].y / 2
+        nx0[i] = rectmap.coords[0].x*kc.dev_dpi*kc.quality/rectmap.srcdpiw
+        ny0[i] = rectmap.coords[0].y*kc.dev_dpi*kc.quality/rectmap.srcdpih
+        nw[i] = rectmap.coords[2].x*kc.dev_dpi*kc.quality/rectmap.srcdpiw
+        nh[i] = rectmap.coords[2].y*kc.dev_dpi*kc.quality/rectmap.srcdpih
+        nx1[i], ny1[i] = nx0[i] + nw[i], ny0[i] + nh[i]
+        ncx[i], ncy[i] = nx0[i] + nw[i]/2, ny0[i] + nh[i]/2
+    end
+    index = {
+        n = n,
+        wrectmap = kc.rectmaps.wrectmap,
+        scale = scale,
+        reflow = grid_new(n, rx0, ry0, rx1, ry1, rcx, rcy),
+        native = grid_new(n, nx0, ny0, nx1, ny1, ncx, ncy),
+        nx0 = nx0, ny0 = ny0, nx1 = nx1, ny1 = ny1, nw = nw, nh = nh,
+        rcx = rcx, rcy = rcy,
+        reflow_inside = function(i, x, y)
+            return k2pdfopt.wrectmap_inside(kc.rectmaps.wrectmap + (i - 1), x, y) ~= 0
+        end,
+        native_inside = function(i, x, y)
+            return nx0[i] <= x and ny0[i] <= y and nx1[i] >= x and ny1[i] >= y
+        end,
+    }
+    rectmap_indexes[kc] = index
+    return index
+end
+
+function KOPTContext_mt.__index:reflowToNativePosTransform(xc, yc, wr, hr)
+    local index = get_rectmap_index(self)
+    if not index then return end
+    -- wrectmap_inside takes integer coordinates
+    local i = grid_lookup(index.reflow, xc, yc, index.reflow_inside,
+                          xc >= 0 and math.floor(xc) or math.ceil(xc), yc >= 0 and math.floor(yc) or math.ceil(yc))
+    return (index.nx0[i]+index.nw[i]*wr)/self.zoom+self.bbox.x0, (index.ny0[i]+index.nh[i]*hr)/self.zoom+self.bbox.y0
 end
 
 function KOPTContext_mt.__index:nativeToReflowPosTransform(xc, yc)
-    local function wrectmap_native_distance(wrmap, x0, y0)
-        local x = wrmap.coords[0].x*self.dev_dpi*self.quality/wrmap.srcdpiw
-        local y = wrmap.coords[0].y*self.dev_dpi*self.quality/wrmap.srcdpih
-        local w = wrmap.coords[2].x*self.dev_dpi*self.quality/wrmap.srcdpiw
-        local h = wrmap.coords[2].y*self.dev_dpi*self.quality/wrmap.srcdpih
-        local function wrectmap_native_inside(wrmap_inside, x0_inside, y0_inside)
-            return x <= x0_inside and y <= y0_inside
-                    and x + w >= x0_inside
-                    and y + h >= y0_inside
-        end
-        if wrectmap_native_inside(wrmap, x0, y0) then
-            return 0
-        else
-            local x1, y1 = x + w/2, y + h/2
-            return (x0 - x1)*(x0 - x1) + (y0 - y1)*(y0 - y1)
-        end
+    local index = get_rectmap_index(self)
+    if not index then return end
+    local x0, y0 = (xc - self.bbox.x0) * self.zoom, (yc - self.bbox.y0) * self.zoom
+    local i = grid_lookup(index.native, x0, y0, index.native_inside)
+    return index.rcx[i], index.rcy[i]
+end
+
+--[[--
+Batch versions of the above, taking and returning flat arrays of x and
+y coordinates, for transforming all the boxes of a highlight at once.
+--]]
+function KOPTContext_mt.__index:reflowToNativePosTransforms(xs, ys, wr, hr)
+    local nxs, nys = {}, {}
+    for i = 1, #xs do
+        nxs[i], nys[i] = self:reflowToNativePosTransform(xs[i], ys[i], wr, hr)
     end
+    return nxs, nys
+end
 
-    local m = 0
-    local x0, y0 = (xc - self.bbox.x0) * self.zoom, (yc - self.bbox.y0) * self.zoom
-    for i = 0, self.rectmaps.n - 1 do
-        if wrectmap_native_distance(self.rectmaps.wrectmap + m, x0, y0) >
-            wrectmap_native_distance(self.rectmaps.wrectmap + i, x0, y0) then
-            m = i
-        end
+function KOPTContext_mt.__index:nativeToReflowPosTransforms(xs, ys)
+    local rxs, rys = {}, {}
+    for i = 1, #xs do
+        rxs[i], rys[i] = self:nativeToReflowPosTransform(xs[i], ys[i])
     end
-    local rectmap = self.rectmaps.wrectmap + m
-    return rectmap.coords[1].x + rectmap.coords[2].x/2, rectmap.coords[1].y + rectmap.coords[2].y/2
+    return rxs, rys
 end
 
 function KOPTContext_mt.__index:getTOCRWord(bmp, x, y, w, h, datadir, lang, ocr_type, allow_spaces, std_proc, dpi)
+    self:ownBitmaps()
     local word = ffi.new("char[256]")
     local err = k2pdfopt.k2pdfopt_tocr_single_word(bmp == "src" and self.src or self.dst,
         x, y, w, h, dpi or self.dev_dpi, word, 256, ffi.cast("char*", datadir), ffi.cast("char*", lang),
@@ -377,10 +672,203 @@ function KOPTContext_mt.__index:getTOCRWord(bmp, x, y, w, h, datadir, lang, ocr_
     return err == 0 and ffi.string(word) or nil
 end
 
-function KOPTContext_mt.__index:getAutoBBox()
+-- Writes a cache file through a temporary one of our own, so that readers
+-- (and other writers) never see it partially written.
+local function cache_file_write(path, data)
+    local tmp = string.format("%s.%d.tmp", path, C.getpid())
+    local file = io.open(tmp, "wb")
+    if not file then return end
+    local ok = file:write(data)
+    file:close()
+    if not ok or not os.rename(tmp, path) then
+        os.remove(tmp)
+    end
+end
+
+-- path of the getPageOCR cache file for this bitmap area and OCR settings
+local function page_ocr_cache_path(bitmap, x, y, w, h, datadir, lang, ocr_type, dpi, cache_dir)
+    local hashoir = require("ffi/hashoir"):new()
+    local header = ffi.new("int32_t[8]", bitmap.width, bitmap.height, bitmap.bpp, x, y, w, h, dpi)
+    hashoir:update(header, ffi.sizeof(header))
+    -- different traineddata, different results
+    datadir = datadir or ""
+    hashoir:update(datadir, #datadir + 1)
+    -- not size_allocated: bmp_alloc may keep a larger buffer, with stale bytes past the rows in use
+    hashoir:update(bitmap.data, k2pdfopt.bmp_bytewidth(bitmap) * bitmap.height)
+    local path = string.format("%s/%s-%s-%d.ocr", cache_dir, hashoir:hexdigest(), lang, ocr_type)
+    hashoir:free()
+    return path
+end
+
+--[[--
+OCRs all the words of an area of the src or dst bitmap at once.
+
+Words are found as by getWordBoxesFlat (reflowed boxes for dst, native
+ones for src), then each one goes through tesseract, which k2pdfopt keeps
+initialized between words. Returns a table like getWordBoxesFlat's, with
+an added texts array holding the text of each word (false when nothing
+was recognized), and arrays of its own. With cache_dir, results are also
+kept there in files named after a hash of the bitmap and the OCR settings
+(datadir included), and read back from them instead of running tesseract
+again.
+--]]
+function KOPTContext_mt.__index:getPageOCR(bmp, x, y, w, h, datadir, lang, ocr_type, dpi, cache_dir)
+    self:ownBitmaps()
+    local bitmap = bmp == "src" and self.src or self.dst
+    if bitmap.data == nil then return end
+    dpi = dpi or self.dev_dpi
+
+    local bitser = require("ffi/bitser")
+    local cache_path = cache_dir and page_ocr_cache_path(bitmap, x, y, w, h, datadir, lang, ocr_type, dpi, cache_dir)
+    if cache_path then
+        local file = io.open(cache_path, "rb")
+        if file then
+            local ok, cached = pcall(bitser.loads, file:read("*all"))
+            file:close()
+            -- don't trust it further than it can be checked
+            if ok and type(cached) == "table"
+                    and type(cached.n) == "number" and type(cached.nlines) == "number"
+                    and type(cached.words) == "string" and #cached.words == cached.n * 5 * 4
+                    and type(cached.lines) == "string" and #cached.lines == cached.nlines * 4 * 4
+                    and type(cached.texts) == "table" and #cached.texts == cached.n then
+                local words = ffi.new("int32_t[?]", cached.n * 5)
+                ffi.copy(words, cached.words, #cached.words)
+                local lines = ffi.new("int32_t[?]", cached.nlines * 4)
+                ffi.copy(lines, cached.lines, #cached.lines)
+                return { n = cached.n, words = words, nlines = cached.nlines, lines = lines, texts = cached.texts }
+            end
+        end
+    end
+
+    -- not cached, so that the arrays handed out are the caller's own
+    local flat = self:getWordBoxesFlat(bmp, x, y, w, h, bmp == "src" and 1 or 0)
+    if not flat then return end
+    local word = ffi.new("char[256]")
+    local texts = {}
+    for i = 0, flat.n - 1 do
+        local x0, y0 = flat.words[i*5], flat.words[i*5+1]
+        local err = k2pdfopt.k2pdfopt_tocr_single_word(bitmap,
+            x0, y0, flat.words[i*5+2] - x0, flat.words[i*5+3] - y0, dpi, word, 256,
+            ffi.cast("char*", datadir), ffi.cast("char*", lang), ocr_type, 0, 0)
+        texts[i+1] = err == 0 and ffi.string(word) or false
+    end
+    local result = { n = flat.n, words = flat.words, nlines = flat.nlines, lines = flat.lines, texts = texts }
+
+    if cache_path then
+        cache_file_write(cache_path, bitser.dumps({
+            n = flat.n, words = ffi.string(flat.words, flat.n * 5 * 4),
+            nlines = flat.nlines, lines = ffi.string(flat.lines, flat.nlines * 4 * 4),
+            texts = texts,
+        }))
+    end
+    return result
+end
+
+--[[
+Page layout cache: auto bboxes and page blocks of a document's pages,
+kept in a directory per document, one small binary file per page, kind
+and set of context parameters (the ones the result depends on). Files
+start with LAYOUT_CACHE_MAGIC, to be bumped whenever their format changes.
+--]]
+local LAYOUT_CACHE_MAGIC = "KOLAYOU1"
+
+-- hash of the context parameters affecting what's cached
+local function layout_params_hash(kc)
+    local hashoir = require("ffi/hashoir"):new()
+    local params = string.format("%.4f:%.4f:%.4f:%.4f:%.4f:%d:%d:%.4f:%.4f",
+        kc.bbox.x0, kc.bbox.y0, kc.bbox.x1, kc.bbox.y1, kc.zoom,
+        kc.white_threshold, kc.straighten, kc.defect_size, kc.contrast)
+    hashoir:update(params, #params)
+    local hash = hashoir:hexdigest()
+    hashoir:free()
+    return hash
+end
+
+local function layout_cache_path(cache, kc, pageno, kind)
+    return string.format("%s/%d-%s.%s", cache.dir, pageno, layout_params_hash(kc), kind)
+end
+
+-- returns the data past the magic, or nil for missing or foreign files
+local function layout_cache_read(path)
+    local file = io.open(path, "rb")
+    if not file then return end
+    local data = file:read("*all")
+    file:close()
+    if not data or data:sub(1, #LAYOUT_CACHE_MAGIC) ~= LAYOUT_CACHE_MAGIC then return end
+    return data:sub(#LAYOUT_CACHE_MAGIC + 1)
+end
+
+local function layout_cache_write(path, data)
+    -- the background pass may write the same file
+    cache_file_write(path, LAYOUT_CACHE_MAGIC .. data)
+end
+
+local function boxa_to_binary(boxa)
+    local count = boxa ~= nil and leptonica.boxaGetCount(boxa) or 0
+    local boxes = ffi.new("int32_t[?]", count * 4 + 1)
+    boxes[0] = count
+    local i = 1
+    if count > 0 then
+        for x, y, w, h in boxaIterBoxGeometries(boxa) do
+            boxes[i], boxes[i+1], boxes[i+2], boxes[i+3] = x, y, w, h
+            i = i + 4
+        end
+    end
+    return ffi.string(boxes, (count * 4 + 1) * 4)
+end
+
+-- returns the boxa and the offset past it, or nil if data is too short for it
+local function boxa_from_binary(data, offset)
+    if offset + 4 > #data then return end
+    local boxes = ffi.cast("const int32_t *", ffi.cast("const char *", data) + offset)
+    local count = boxes[0]
+    if count < 0 or offset + (count * 4 + 1) * 4 > #data then return end
+    local boxa = leptonica.boxaCreate(count)
+    for i = 0, count - 1 do
+        leptonica.boxaAddBox(boxa, leptonica.boxCreate(boxes[i*4+1], boxes[i*4+2], boxes[i*4+3], boxes[i*4+4]), leptonica.L_NOCOPY)
+    end
+    return boxa, offset + (count * 4 + 1) * 4
+end
+
+--[[--
+Opens the layout cache of a document, under dir, for the document
+identified by doc_hash (e.g. its partial MD5). Pass it to getAutoBBox and
+findPageBlocks along with the page number.
+--]]
+function KOPTContext.openLayoutCache(dir, doc_hash)
+    local lfs = require("libs/libkoreader-lfs")
+    local cache = { dir = dir .. "/" .. doc_hash }
+    if lfs.attributes(cache.dir, "mode") ~= "directory" then
+        lfs.mkdir(dir)
+        local ok, err = lfs.mkdir(cache.dir)
+        if not ok then error("cannot create layout cache: " .. tostring(err)) end
+    end
+    return cache
+end
+
+-- whether the page's kind ("bbox" or "blocks") of layout is cached for the
+-- context's parameters: if so, the page doesn't need to be rendered for it
+function KOPTContext_mt.__index:hasCachedLayout(cache, pageno, kind)
+    return layout_cache_read(layout_cache_path(cache, self, pageno, kind)) ~= nil
+end
+
+function KOPTContext_mt.__index:getAutoBBox(cache, pageno)
+    self:ownBitmaps()
     -- fall back to default writing direction when detecting bbox
+    -- (cached or not, so that the context ends up the same either way)
     self:setWritingDirection(0)
-    k2pdfopt.k2pdfopt_crop_bmp(self)
+    local path = cache and layout_cache_path(cache, self, pageno, "bbox")
+    local data = path and layout_cache_read(path)
+    if data and #data == ffi.sizeof("float[4]") then
+        local bbox = ffi.cast("const float *", data)
+        self.bbox.x0, self.bbox.y0, self.bbox.x1, self.bbox.y1 = bbox[0], bbox[1], bbox[2], bbox[3]
+    else
+        k2pdfopt.k2pdfopt_crop_bmp(self)
+        if path then
+            layout_cache_write(path, ffi.string(ffi.new("float[4]", self.bbox.x0, self.bbox.y0, self.bbox.x1, self.bbox.y1),
+                                                ffi.sizeof("float[4]")))
+        end
+    end
     local x0 = self.bbox.x0/self.zoom
     local y0 = self.bbox.y0/self.zoom
     local x1 = self.bbox.x1/self.zoom
@@ -388,7 +876,28 @@ function KOPTContext_mt.__index:getAutoBBox()
     return x0, y0, x1, y1
 end
 
-function KOPTContext_mt.__index:findPageBlocks()
+function KOPTContext_mt.__index:findPageBlocks(cache, pageno)
+    self:ownBitmaps()
+    -- the key is computed before anything changes the context
+    local path = cache and layout_cache_path(cache, self, pageno, "blocks")
+    local data = path and layout_cache_read(path)
+    if data and #data >= 16 then
+        local nboxa, offset = boxa_from_binary(data, 8)
+        local rboxa, size
+        if nboxa then
+            rboxa, size = boxa_from_binary(data, offset)
+        end
+        if rboxa and size == #data then
+            local header = ffi.cast("const int32_t *", data)
+            assert(self.nboxa == nil and self.rboxa == nil)
+            self.page_width, self.page_height = header[0], header[1]
+            self.nboxa, self.rboxa = nboxa, rboxa
+            return
+        end
+        -- truncated or corrupt, redo it
+        if nboxa then boxaDestroy(nboxa) end
+        if rboxa then boxaDestroy(rboxa) end
+    end
     if self.src.data then
         local pixs = bitmap2pix(self.src, 0, 0, self.src.width, self.src.height)
         local pixr = _gc_ptr(leptonica.pixThresholdToBinary(pixs, 128), pixDestroy)
@@ -406,11 +915,40 @@ function KOPTContext_mt.__index:findPageBlocks()
             self.page_height = leptonica.pixGetHeight(pixr)
             -- uncomment this to show text blocks in situ
             --leptonica.pixWritePng("textblock-mask.png", pixtb, 0.0)
+            if path then
+                local header = ffi.new("int32_t[2]", self.page_width, self.page_height)
+                layout_cache_write(path, ffi.string(header, 8) .. boxa_to_binary(self.nboxa) .. boxa_to_binary(self.rboxa))
+            end
         end
     end
 end
 
+--[[--
+Fills the layout cache for pages of doc (a mupdf or djvu document) in a
+background process, rendering each page once for both its auto bbox and
+page blocks, with the parameters of kc. Pages already cached are skipped.
+Returns the (already reaped) pid of the background process.
+--]]
+function KOPTContext.precacheLayouts(doc, cache, pagenos, kc)
+    local util = require("ffi/util")
+    return util.runInSubProcess(function()
+        local x0, y0, x1, y1 = kc:getBBox()
+        for _, pageno in ipairs(pagenos) do
+            kc:setBBox(x0, y0, x1, y1)
+            if not kc:hasCachedLayout(cache, pageno, "bbox") or not kc:hasCachedLayout(cache, pageno, "blocks") then
+                kc:free()
+                local page = doc:openPage(pageno)
+                page:getPagePix(kc)
+                page:close()
+                kc:findPageBlocks(cache, pageno)
+                kc:getAutoBBox(cache, pageno)
+            end
+        end
+    end, false, true)
+end
+
 function KOPTContext_mt.__index:getPanelFromPage(pos)
+    self:ownBitmaps()
     local function isInRect(x, y, w, h, pos_x, pos_y)
         return x < pos_x and y < pos_y and x + w > pos_x and y + h > pos_y
     end
@@ -466,8 +1004,9 @@ end
 -- width and height respectively
 --]]
 function KOPTContext_mt.__index:getPageBlock(x_rel, y_rel)
+    self:ownBitmaps()
     local block = nil
-    if self.src.data and self.nboxa ~= nil and self.rboxa ~= nil then
+    if self.nboxa ~= nil and self.rboxa ~= nil then
         local w, h = self:getPageDim()
         local tbox = boxCreate(0, y_rel * h, w, 2)
         local boxa = _gc_ptr(leptonica.boxaClipToBox(self.nboxa, tbox), boxaDestroy)
@@ -524,6 +1063,7 @@ end
 -- draw highlights into pix and return leptonica pixmap
 --]]
 function KOPTContext_mt.__index:getSrcPix(pboxes, drawer)
+    self:ownBitmaps()
     if self.src.data ~= nil then
         local pix1 = bitmap2pix(self.src, 0, 0, self.src.width, self.src.height)
         if pboxes and drawer == "lighten" then
@@ -563,6 +1103,8 @@ function KOPTContext_mt.__index:exportSrcPNGString(pboxes, drawer)
 end
 
 function KOPTContext_mt.__index:optimizePage()
+    self:ownBitmaps()
+    self:invalidateWordBoxes()
     k2pdfopt.k2pdfopt_optimize_bmp(self)
 end
 
@@ -576,6 +1118,15 @@ function KOPTContext_mt.__index:free()
     self.rboxa = boxaDestroy(self.rboxa)
     self.nboxa = boxaDestroy(self.nboxa)
     self:setLanguage(nil)
+    local views = shm_views[self]
+    if views then
+        shm_views[self] = nil
+        for _, view in pairs(views) do shm_view_release(view) end
+    end
+    if shm_retired[self] then
+        shm_view_release(shm_retired[self])
+        shm_retired[self] = nil
+    end
     -- Already guards against NULL data pointers
     k2pdfopt.bmp_free(self.src)
     -- Already guards against NULL data pointers
@@ -583,6 +1134,8 @@ function KOPTContext_mt.__index:free()
     if self.rectmaps.n ~= 0 then
         k2pdfopt.wrectmaps_free(self.rectmaps)
     end
+    rectmap_indexes[self] = nil
+    word_boxes_caches[self] = nil
 end
 
 function KOPTContext_mt:__gc()
@@ -663,7 +1216,17 @@ function KOPTContext.new()
     return kc
 end
 
-function KOPTContext.totable(kc)
+--[[--
+Serializes a KOPTContext, e.g. to hand it over to another process.
+
+With shared, the bitmaps are written to shared memory files, and only
+their names end up in the table: fromtable then maps them (read-only)
+instead of copying them, and they're only copied by ownBitmaps(). It
+falls back to copying when there's no shared memory. The files are removed
+by fromtable, or by reflowPages if the table never makes it there.
+--]]
+function KOPTContext.totable(kc, shared)
+    kc:ownBitmaps()
     local context = {}
     -- version
     context.__version__ = __VERSION__
@@ -710,13 +1273,19 @@ function KOPTContext.totable(kc)
     context.language = kc.language and ffi.string(kc.language)
     -- bmp structs
     context.src = ffi.string(kc.src, ffi.sizeof(kc.src))
-    if kc.src.size_allocated > 0 then
+    if shared and kc.src.size_allocated > 0 then
+        context.src_shm, context.src_shm_size = bmp_to_shm(kc.src)
+    end
+    if kc.src.size_allocated > 0 and not context.src_shm then
         context.src_data = ffi.string(kc.src.data, kc.src.size_allocated)
     else
         context.src_data = ""
     end
     context.dst = ffi.string(kc.dst, ffi.sizeof(kc.dst))
-    if kc.dst.size_allocated > 0 then
+    if shared and kc.dst.size_allocated > 0 then
+        context.dst_shm, context.dst_shm_size = bmp_to_shm(kc.dst)
+    end
+    if kc.dst.size_allocated > 0 and not context.dst_shm then
         context.dst_data = ffi.string(kc.dst.data, kc.dst.size_allocated)
     else
         context.dst_data = ""
@@ -733,8 +1302,23 @@ function KOPTContext.totable(kc)
 end
 
 function KOPTContext.fromtable(context)
+    -- take the shared bitmaps first, so that their files are gone whatever happens next
+    local views = {}
+    for _, which in ipairs{"src", "dst"} do
+        local path = context[which .. "_shm"]
+        if path then
+            local ok, view = pcall(bmp_from_shm, path, context[which .. "_shm_size"])
+            if not ok then
+                for _, v in pairs(views) do shm_view_release(v) end
+                if context.dst_shm then os.remove(context.dst_shm) end
+                error(view)
+            end
+            views[which] = view
+        end
+    end
     -- check version first
     if __VERSION__ ~= context.__version__ then
+        for _, v in pairs(views) do shm_view_release(v) end
         error("mismatched versions")
     end
     local kc = kctype()
@@ -784,7 +1368,11 @@ function KOPTContext.fromtable(context)
 
     k2pdfopt.bmp_init(kc.src)
     ffi.copy(kc.src, context.src, ffi.sizeof(kc.src))
-    if context.src_data ~= "" then
+    if views.src then
+        -- see ownBitmaps
+        kc.src.data = nil
+        kc.src.size_allocated = 0
+    elseif context.src_data ~= "" then
         kc.src.data = C.malloc(#context.src_data)
         ffi.copy(kc.src.data, context.src_data, #context.src_data)
     else
@@ -792,7 +1380,11 @@ function KOPTContext.fromtable(context)
     end
     k2pdfopt.bmp_init(kc.dst)
     ffi.copy(kc.dst, context.dst, ffi.sizeof(kc.dst))
-    if context.dst_data ~= "" then
+    if views.dst then
+        -- see ownBitmaps
+        kc.dst.data = nil
+        kc.dst.size_allocated = 0
+    elseif context.dst_data ~= "" then
         kc.dst.data = C.malloc(#context.dst_data)
         ffi.copy(kc.dst.data, context.dst_data, #context.dst_data)
     else
@@ -808,8 +1400,94 @@ function KOPTContext.fromtable(context)
     else
         kc.rectmaps.wrectmap = nil
     end
+    if next(views) then
+        shm_views[kc] = views
+    end
 
     return kc
 end
 
+--[[--
+Reflows the src bitmaps of several contexts at once, each in its own
+forked process, at most max_workers (2 by default) at a time: k2pdfopt
+keeps its settings in globals, so it can't be run from threads.
+
+The reflowed bitmaps come back through shared memory (see totable).
+Contexts that can't get a worker (e.g. fork() failing) are reflowed in
+this process instead. Returns the reflowed contexts, in order, with nil
+for the ones whose reflow failed. Their src bitmaps are moved over from
+the contexts passed, which are left without one, rather than copied.
+--]]
+function KOPTContext.reflowPages(contexts, max_workers)
+    local bitser = require("ffi/bitser")
+    local util = require("ffi/util")
+    max_workers = max_workers or 2
+
+    if not shm_swept then
+        -- leftovers of earlier runs
+        shm_cleanup()
+        shm_swept = true
+    end
+
+    local results = {}
+    local running = {}
+    local function collect(job)
+        local data = util.readAllFromFD(job.fd)
+        util.isSubProcessDone(job.pid, true)
+        local ok, kc = false, nil
+        if #data > 0 then
+            ok, kc = pcall(function() return KOPTContext.fromtable(bitser.loads(data)) end)
+        end
+        -- whatever fromtable didn't take (the worker died, the data was bad...)
+        shm_cleanup(job.pid)
+        if not ok then return end
+        local src = contexts[job.index].src
+        ffi.copy(kc.src, src, ffi.sizeof(src))
+        k2pdfopt.bmp_init(src)
+        results[job.index] = kc
+    end
+    -- when there's no worker to be had, reflows a copy of the context here
+    local function reflow_here(index)
+        local kc = contexts[index]
+        -- copy everything but the bitmaps
+        local src, dst = ffi.new("WILLUSBITMAP"), ffi.new("WILLUSBITMAP")
+        ffi.copy(src, kc.src, ffi.sizeof(src))
+        ffi.copy(dst, kc.dst, ffi.sizeof(dst))
+        k2pdfopt.bmp_init(kc.src)
+        k2pdfopt.bmp_init(kc.dst)
+        local ok, copy = pcall(function() return KOPTContext.fromtable(KOPTContext.totable(kc)) end)
+        ffi.copy(kc.src, src, ffi.sizeof(src))
+        ffi.copy(kc.dst, dst, ffi.sizeof(dst))
+        if not ok then return end
+        ffi.copy(copy.src, kc.src, ffi.sizeof(kc.src))
+        k2pdfopt.bmp_init(kc.src)
+        copy:reflow()
+        results[index] = copy
+    end
+
+    local next_index = 1
+    while next_index <= #contexts or #running > 0 do
+        if next_index <= #contexts and #running < max_workers then
+            local kc = contexts[next_index]
+            kc:ownBitmaps()
+            local pid, fd = util.runInSubProcess(function(_, write_fd)
+                kc:reflow()
+                -- the parent still has it, don't send it back
+                k2pdfopt.bmp_init(kc.src)
+                util.writeToFD(write_fd, bitser.dumps(KOPTContext.totable(kc, true)), true)
+            end, true)
+            if pid then
+                table.insert(running, { index = next_index, pid = pid, fd = fd })
+            else
+                reflow_here(next_index)
+            end
+            next_index = next_index + 1
+        else
+            -- oldest first, the pages ahead keep going meanwhile
+            collect(table.remove(running, 1))
+        end
+    end
+    return results
+end
+
 return KOPTContext
@@ -28,6 +28,7 @@ BOXA *boxaClipToBox(BOXA *, BOX *);
 BOXA *boxaCombineOverlaps(BOXA *, PIXA *);
 BOXA *boxaCreate(l_int32);
 void boxaDestroy(BOXA **);
+l_ok boxaExtractAsNuma(BOXA *, NUMA **, NUMA **, NUMA **, NUMA **, NUMA **, NUMA **, l_int32);
 BOX *boxaGetBox(BOXA *, l_int32, l_int32);
 l_ok boxaGetBoxGeometry(BOXA *, l_int32, l_int32 *, l_int32 *, l_int32 *, l_int32 *);
 l_int32 boxaGetCount(const BOXA *);
@@ -1,6 +1,7 @@
 -- Automatically generated with ffi-cdecl.
 
 require("ffi").cdef[[
+static const unsigned WEBP_DECODER_ABI_VERSION = 521;
 static const unsigned WEBP_DEMUX_ABI_VERSION = 263;
 enum WEBP_CSP_MODE {
   MODE_RGB = 0,
@@ -19,11 +20,142 @@ enum WEBP_CSP_MODE {
   MODE_LAST = 13,
 };
 typedef enum WEBP_CSP_MODE WEBP_CSP_MODE;
+enum VP8StatusCode {
+  VP8_STATUS_OK = 0,
+  VP8_STATUS_OUT_OF_MEMORY = 1,
+  VP8_STATUS_INVALID_PARAM = 2,
+  VP8_STATUS_BITSTREAM_ERROR = 3,
+  VP8_STATUS_UNSUPPORTED_FEATURE = 4,
+  VP8_STATUS_SUSPENDED = 5,
+  VP8_STATUS_USER_ABORT = 6,
+  VP8_STATUS_NOT_ENOUGH_DATA = 7,
+};
+typedef enum VP8StatusCode VP8StatusCode;
+struct WebPBitstreamFeatures {
+  int width;
+  int height;
+  int has_alpha;
+  int has_animation;
+  int format;
+  uint32_t pad[5];
+};
+typedef struct WebPBitstreamFeatures WebPBitstreamFeatures;
+struct WebPRGBABuffer {
+  uint8_t *rgba;
+  int stride;
+  size_t size;
+};
+typedef struct WebPRGBABuffer WebPRGBABuffer;
+struct WebPYUVABuffer {
+  uint8_t *y;
+  uint8_t *u;
+  uint8_t *v;
+  uint8_t *a;
+  int y_stride;
+  int u_stride;
+  int v_stride;
+  int a_stride;
+  size_t y_size;
+  size_t u_size;
+  size_t v_size;
+  size_t a_size;
+};
+typedef struct WebPYUVABuffer WebPYUVABuffer;
+struct WebPDecBuffer {
+  WEBP_CSP_MODE colorspace;
+  int width;
+  int height;
+  int is_external_memory;
+  union {
+    WebPRGBABuffer RGBA;
+    WebPYUVABuffer YUVA;
+  } u;
+  uint32_t pad[4];
+  uint8_t *private_memory;
+};
+typedef struct WebPDecBuffer WebPDecBuffer;
+struct WebPDecoderOptions {
+  int bypass_filtering;
+  int no_fancy_upsampling;
+  int use_cropping;
+  int crop_left;
+  int crop_top;
+  int crop_width;
+  int crop_height;
+  int use_scaling;
+  int scaled_width;
+  int scaled_height;
+  int use_threads;
+  int dithering_strength;
+  int flip;
+  int alpha_dithering_strength;
+  uint32_t pad[5];
+};
+typedef struct WebPDecoderOptions WebPDecoderOptions;
+struct WebPDecoderConfig {
+  WebPBitstreamFeatures input;
+  WebPDecBuffer output;
+  WebPDecoderOptions options;
+};
+typedef struct WebPDecoderConfig WebPDecoderConfig;
+int WebPInitDecoderConfigInternal(WebPDecoderConfig *, int);
+VP8StatusCode WebPGetFeaturesInternal(const uint8_t *, size_t, WebPBitstreamFeatures *, int);
+VP8StatusCode WebPDecode(const uint8_t *, size_t, WebPDecoderConfig *);
+void WebPFreeDecBuffer(WebPDecBuffer *);
 struct WebPData {
   const uint8_t *bytes;
   size_t size;
 };
 typedef struct WebPData WebPData;
+enum WebPDemuxState {
+  WEBP_DEMUX_PARSE_ERROR = -1,
+  WEBP_DEMUX_PARSING_HEADER = 0,
+  WEBP_DEMUX_PARSED_HEADER = 1,
+  WEBP_DEMUX_DONE = 2,
+};
+typedef enum WebPDemuxState WebPDemuxState;
+enum WebPFormatFeature {
+  WEBP_FF_FORMAT_FLAGS = 0,
+  WEBP_FF_CANVAS_WIDTH = 1,
+  WEBP_FF_CANVAS_HEIGHT = 2,
+  WEBP_FF_LOOP_COUNT = 3,
+  WEBP_FF_BACKGROUND_COLOR = 4,
+  WEBP_FF_FRAME_COUNT = 5,
+};
+typedef enum WebPFormatFeature WebPFormatFeature;
+enum WebPMuxAnimDispose {
+  WEBP_MUX_DISPOSE_NONE = 0,
+  WEBP_MUX_DISPOSE_BACKGROUND = 1,
+};
+typedef enum WebPMuxAnimDispose WebPMuxAnimDispose;
+enum WebPMuxAnimBlend {
+  WEBP_MUX_BLEND = 0,
+  WEBP_MUX_NO_BLEND = 1,
+};
+typedef enum WebPMuxAnimBlend WebPMuxAnimBlend;
+typedef struct WebPDemuxer WebPDemuxer;
+struct WebPIterator {
+  int frame_num;
+  int num_frames;
+  int x_offset;
+  int y_offset;
+  int width;
+  int height;
+  int duration;
+  WebPMuxAnimDispose dispose_method;
+  int complete;
+  WebPData fragment;
+  int has_alpha;
+  WebPMuxAnimBlend blend_method;
+  uint32_t pad[2];
+  void *private_;
+};
+typedef struct WebPIterator WebPIterator;
+WebPDemuxer *WebPDemuxInternal(const WebPData *, int, WebPDemuxState *, int);
+uint32_t WebPDemuxGetI(const WebPDemuxer *, WebPFormatFeature);
+int WebPDemuxGetFrame(const WebPDemuxer *, int, WebPIterator *);
+void WebPDemuxReleaseIterator(WebPIterator *);
+void WebPDemuxDelete(WebPDemuxer *);
 struct WebPAnimInfo {
   uint32_t canvas_width;
   uint32_t canvas_height;
@@ -15,6 +15,8 @@ require("ffi/mupdf_h")
 require("ffi/posix_h") -- for malloc
 
 local BlitBuffer = require("ffi/blitbuffer")
+local DrawContext = require("ffi/drawcontext")
+local lru = require("ffi/lru")
 
 local C = ffi.C
 local W = ffi.loadlib("wrap-mupdf")
@@ -29,8 +31,28 @@ local M = W
 --          NOTE: Revisit when we bump MµPDF by doing a few tests with the tracing memory allocators,
 --                as even 32MB is likely to be too conservative.
 local mupdf = {
+    -- use our accounting allocator (see getMemoryStats), debug_memory is an old alias
+    account_memory = true,
     debug_memory = false,
     cache_size = 32*1024*1024,
+    -- per document cache of page display lists, replayed instead of
+    -- re-interpreting page contents on each draw (0 to disable).
+    -- Lists are only accounted for in bytes with account_memory,
+    -- otherwise only the number of pages bounds the cache.
+    display_list_cache_pages = 8,
+    display_list_cache_size = 32*1024*1024,
+    -- number of threads rendering horizontal bands of a page in parallel
+    -- in draw_new() (0 for one per CPU, 1 to render on the calling thread only)
+    render_threads = 0,
+    -- structured text kept by the document search worker, in bytes
+    search_cache_size = 16*1024*1024,
+    -- resolution of the preview pass of drawProgressive()
+    preview_scale = 0.25,
+    -- decoded images kept at the size they are drawn at (downscaled by
+    -- 2, 4 or 8 on decode), in bytes (0 to leave images to the store),
+    -- and how many more halvings to apply past that (less sharp, faster)
+    image_cache_size = 16*1024*1024,
+    image_subsample_bias = 0,
 }
 -- this cannot get adapted by the cdecl file because it is a
 -- string constant. Must match the actual mupdf API:
@@ -38,6 +60,7 @@ local FZ_VERSION = "1.27.2"
 
 local document_mt = { __index = {} }
 local page_mt = { __index = {} }
+local display_list_mt = { __index = {} }
 
 mupdf.debug = function() --[[ no debugging by default ]] end
 
@@ -45,6 +68,7 @@ local function drop_context(ctx)
     local refcount = ffi.cast("int *", M.fz_user_context(ctx))
     refcount[0] = refcount[0] - 1
     if refcount[0] == 0 then
+        W.mupdf_render_pool_shutdown(ctx)
         M.fz_drop_context(ctx)
         C.free(refcount)
     end
@@ -57,15 +81,19 @@ local function keep_context(ctx)
 end
 
 local save_ctx = setmetatable({}, {__mode="kv"})
+-- whether the context was created with our accounting allocator
+local accounting = false
 
 -- provides an fz_context for mupdf
 local function context()
     local ctx = save_ctx[1]
     if ctx then return ctx end
 
+    accounting = mupdf.account_memory or mupdf.debug_memory
+    -- our locks context allows cloning it for banded rendering
     ctx = M.fz_new_context_imp(
-        mupdf.debug_memory and W.mupdf_get_my_alloc_context() or nil,
-        nil,
+        accounting and W.mupdf_get_my_alloc_context() or nil,
+        W.mupdf_get_my_locks_context(),
         mupdf.cache_size, FZ_VERSION)
 
     if ctx == nil then
@@ -79,6 +107,7 @@ local function context()
     -- ctx is a cdata<fz_context *>, attach a finalizer to it to release ressources on garbage collection
     ctx = ffi.gc(ctx, drop_context)
 
+    W.mupdf_set_image_cache(ctx, mupdf.image_cache_size, mupdf.image_subsample_bias)
     M.fz_install_external_font_funcs(ctx)
     M.fz_register_document_handlers(ctx)
 
@@ -88,6 +117,8 @@ end
 
 -- a wrapper for mupdf exception error messages
 local function merror(ctx, message)
+    -- whatever we were doing is aborted
+    W.mupdf_set_alloc_category(M.MUPDF_ALLOC_OTHER)
     error(string.format("%s: %s (%d)", message,
         ffi.string(W.mupdf_error_message(ctx)),
         W.mupdf_error_code(ctx)))
@@ -107,15 +138,90 @@ local function drop_page(ctx, page)
     drop_context(ctx)
 end
 
+local function drop_display_list(ctx, list)
+    -- Clear the cdata finalizer to avoid a double-free
+    ffi.gc(list, nil)
+    M.fz_drop_display_list(ctx, list)
+    drop_context(ctx)
+end
+
+-- called by the lru cache on eviction
+function display_list_mt.__index:onFree()
+    if self.list ~= nil then
+        drop_display_list(self.ctx, self.list)
+        self.list = nil
+        self.ctx = nil
+    end
+end
+
+local alloc_stats = ffi.new("mupdf_alloc_stats")
+
+-- current bytes allocated under category
+local function category_bytes(category)
+    W.mupdf_get_alloc_stats(alloc_stats)
+    return tonumber(alloc_stats.category[category])
+end
+
+--[[--
+Snapshot of the accounting allocator counters.
+
+Bytes are the ones currently allocated, except for peak, which is the highest
+total since the last resetMemoryPeak(). Returns nil when account_memory was
+off when the context got created.
+--]]
+function mupdf.getMemoryStats()
+    if not accounting then return end
+    W.mupdf_get_alloc_stats(alloc_stats)
+    return {
+        current = tonumber(alloc_stats.current),
+        peak = tonumber(alloc_stats.peak),
+        blocks = tonumber(alloc_stats.blocks),
+        allocs = tonumber(alloc_stats.allocs),
+        reallocs = tonumber(alloc_stats.reallocs),
+        reallocs_in_place = tonumber(alloc_stats.reallocs_in_place),
+        categories = {
+            other = tonumber(alloc_stats.category[M.MUPDF_ALLOC_OTHER]),
+            document = tonumber(alloc_stats.category[M.MUPDF_ALLOC_DOCUMENT]),
+            display_list = tonumber(alloc_stats.category[M.MUPDF_ALLOC_DISPLAY_LIST]),
+            render = tonumber(alloc_stats.category[M.MUPDF_ALLOC_RENDER]),
+            text = tonumber(alloc_stats.category[M.MUPDF_ALLOC_TEXT]),
+            image = tonumber(alloc_stats.category[M.MUPDF_ALLOC_IMAGE]),
+        },
+    }
+end
+
+function mupdf.resetMemoryPeak()
+    W.mupdf_reset_alloc_peak()
+end
+
+--[[--
+Resizes the decoded image cache and sets the subsampling bias, see
+mupdf.image_cache_size and mupdf.image_subsample_bias.
+
+Shrinking it evicts least recently drawn images right away.
+--]]
+function mupdf.setImageCache(size, subsample_bias)
+    mupdf.image_cache_size = size
+    mupdf.image_subsample_bias = subsample_bias or mupdf.image_subsample_bias
+    W.mupdf_set_image_cache(context(), mupdf.image_cache_size, mupdf.image_subsample_bias)
+end
+
+-- bytes held by the decoded image cache
+function mupdf.getImageCacheSize()
+    return tonumber(W.mupdf_get_image_cache_used())
+end
+
 --[[--
 Opens a document.
 --]]
 function mupdf.openDocument(filename)
     local ctx = context()
+    local category = W.mupdf_set_alloc_category(M.MUPDF_ALLOC_DOCUMENT)
     local mupdf_doc = {
         doc = W.mupdf_open_document(ctx, filename),
         filename = filename,
     }
+    W.mupdf_set_alloc_category(category)
 
     if mupdf_doc.doc == nil then
         merror(ctx, "MuPDF cannot open file.")
@@ -174,7 +280,11 @@ this is done automatically by the garbage collector but can be
 triggered explicitly
 --]]
 function document_mt.__index:close()
+    self:clearDisplayLists()
+    self:dropSearcher()
     if self.doc ~= nil then
+        -- its images would otherwise stay in the (shared) image cache
+        W.mupdf_clear_image_cache(self.ctx, self.doc)
         drop_document(self.ctx, self.doc)
         self.doc = nil
         self.ctx = nil
@@ -195,6 +305,8 @@ function document_mt.__index:authenticatePassword(password)
     if M.fz_authenticate_password(self.ctx, self.doc, password) == 0 then
         return false
     end
+    -- the search worker opens its own instance of the document
+    self.password = password
     return true
 end
 
@@ -224,6 +336,9 @@ end
 function document_mt.__index:layoutDocument(width, height, em)
     -- Reset the cache.
     self.number_of_pages = nil
+    self:clearDisplayLists()
+    self:dropSearcher()
+    self.layout = { width, height, em }
 
     W.mupdf_layout_document(self.ctx, self.doc, width, height, em)
 end
@@ -272,11 +387,13 @@ open a page, return page object
 --]]
 function document_mt.__index:openPage(number)
     local ctx = self.ctx
+    local category = W.mupdf_set_alloc_category(M.MUPDF_ALLOC_DOCUMENT)
     local mupdf_page = {
         page = W.mupdf_load_page(ctx, self.doc, number-1),
         number = number,
         doc = self,
     }
+    W.mupdf_set_alloc_category(category)
 
     if mupdf_page.page == nil then
         merror(ctx, "cannot open page #" .. number)
@@ -333,10 +450,10 @@ end
 --[[
 return currently claimed memory by MuPDF
 
-This will return sensible values only when the debug_memory flag is set
+This will return sensible values only when the account_memory flag is set
 --]]
 function document_mt.__index:getCacheSize()
-    if mupdf.debug_memory then
+    if accounting then
         return W.mupdf_get_cache_size()
     else
         return 0
@@ -344,7 +461,22 @@ function document_mt.__index:getCacheSize()
 end
 
 function document_mt.__index:cleanCache()
-    -- NOP, just for API compatibility
+    self:clearDisplayLists()
+    if self.doc ~= nil then
+        W.mupdf_clear_image_cache(self.ctx, self.doc)
+    end
+end
+
+--[[
+drop the cached display lists of all pages (or of a single page)
+--]]
+function document_mt.__index:clearDisplayLists(pageno)
+    if not self.display_lists then return end
+    if pageno then
+        self.display_lists:delete(pageno)
+    else
+        self.display_lists:clear()
+    end
 end
 
 --[[
@@ -360,6 +492,118 @@ function document_mt.__index:writeDocument(filename)
     if not ok then merror(self.ctx, "could not write document") end
 end
 
+--[[
+check if there are annotation changes not yet saved to the document file
+--]]
+function document_mt.__index:hasUnsavedChanges()
+    local pdf = M.pdf_specifics(self.ctx, self.doc)
+    return pdf ~= nil and M.pdf_has_unsaved_changes(self.ctx, pdf) ~= 0
+end
+
+--[[
+Save all the pending annotation changes to the document file at once
+
+They are appended as a single incremental update section, leaving the
+rest of the file untouched, so batching several edits before calling
+this costs one small write. Files that can't be updated that way (e.g.
+repaired on load) are rewritten to a temporary file replacing the
+original. Returns false when there was nothing to save.
+--]]
+function document_mt.__index:saveIncremental()
+    local pdf = M.pdf_specifics(self.ctx, self.doc)
+    if pdf == nil then error("only PDF documents can be saved incrementally") end
+    if not self.filename then error("cannot save a document not opened from a file") end
+    if M.pdf_has_unsaved_changes(self.ctx, pdf) == 0 then return false end
+
+    local opts = ffi.new("pdf_write_options[1]")
+    if M.pdf_can_be_saved_incrementally(self.ctx, pdf) ~= 0 then
+        opts[0].do_incremental = 1
+        local ok = W.mupdf_pdf_save_document(self.ctx, pdf, self.filename, opts)
+        if not ok then merror(self.ctx, "could not save document incrementally") end
+    else
+        -- we're reading from the original, don't write over it
+        local tmp = self.filename .. ".tmp"
+        local ok = W.mupdf_pdf_save_document(self.ctx, pdf, tmp, opts)
+        if not ok then
+            os.remove(tmp)
+            merror(self.ctx, "could not save document")
+        end
+        local renamed, err = os.rename(tmp, self.filename)
+        if not renamed then
+            os.remove(tmp)
+            error("could not replace document: " .. err)
+        end
+    end
+    return true
+end
+
+--[[
+Search the whole document (or pages from..to) for needle, on a worker thread
+
+Replaces any search in progress. Hits are collected with pollSearch(), and
+the search can be stopped with cancelSearch(). Only works for documents
+opened from a file.
+--]]
+function document_mt.__index:searchDocument(needle, from, to, hit_max)
+    if not self.searcher then
+        if not self.filename then
+            error("document search needs a document opened from a file")
+        end
+        local layout = self.layout or { 0, 0, 0 }
+        local searcher = W.mupdf_new_searcher(self.ctx, self.filename, self.password,
+            layout[1], layout[2], layout[3], mupdf.search_cache_size)
+        if searcher == nil then error("cannot start document search") end
+        -- searcher is a cdata<mupdf_searcher *>, attach a finalizer to it to release ressources on garbage collection
+        self.searcher = ffi.gc(searcher, W.mupdf_drop_searcher)
+    end
+    W.mupdf_searcher_start(self.searcher, needle, (from or 1) - 1, (to or self:getPages()) - 1, hit_max or 256)
+end
+
+local search_hits = ffi.new("mupdf_search_hit[?]", 256)
+local search_state = ffi.new("int[2]")
+
+--[[
+Get the hits found since the last call, as returned by searchPageText, with
+their page number (and new_match set on the first quad of each match).
+Also returns whether the search is still running, and the page it's at.
+--]]
+function document_mt.__index:pollSearch()
+    local results = {}
+    if not self.searcher then return results, false end
+    local running, page
+    repeat
+        local count = W.mupdf_searcher_poll(self.searcher, search_hits, 256, search_state, search_state + 1)
+        running, page = search_state[0] ~= 0, search_state[1] + 1
+        for i = 0, count - 1 do
+            local hit = search_hits[i].quad
+            table.insert(results, {
+                page = search_hits[i].page + 1,
+                new_match = search_hits[i].mark ~= 0,
+                ul_x = hit.ul.x, ul_y = hit.ul.y,
+                ur_x = hit.ur.x, ur_y = hit.ur.y,
+                ll_x = hit.ll.x, ll_y = hit.ll.y,
+                lr_x = hit.lr.x, lr_y = hit.lr.y,
+            })
+        end
+    until count < 256
+    return results, running, page
+end
+
+function document_mt.__index:cancelSearch()
+    if self.searcher then
+        W.mupdf_searcher_cancel(self.searcher)
+    end
+end
+
+function document_mt.__index:dropSearcher()
+    if self.searcher then
+        -- Clear the cdata finalizer to avoid a double-free
+        local searcher = ffi.gc(self.searcher, nil)
+        self.searcher = nil
+        W.mupdf_drop_searcher(searcher)
+    end
+end
+
 
 -- Page functions:
 
@@ -420,68 +664,18 @@ function page_mt.__index:getUsedBBox()
     return result.x0, result.y0, result.x1, result.y1
 end
 
-local B = string.byte
-local function is_unicode_wspace(c)
-    return c == 9 or --  TAB
-        c == 0x0a or --  HT
-        c == 0x0b or --  LF
-        c == 0x0c or --  VT
-        c == 0x0d or --  FF
-        c == 0x20 or --  CR
-        c == 0x85 or --  NEL
-        c == 0xA0 or --  No break space
-        c == 0x1680 or --  Ogham space mark
-        c == 0x180E or --  Mongolian Vowel Separator
-        c == 0x2000 or --  En quad
-        c == 0x2001 or --  Em quad
-        c == 0x2002 or --  En space
-        c == 0x2003 or --  Em space
-        c == 0x2004 or --  Three-per-Em space
-        c == 0x2005 or --  Four-per-Em space
-        c == 0x2006 or --  Five-per-Em space
-        c == 0x2007 or --  Figure space
-        c == 0x2008 or --  Punctuation space
-        c == 0x2009 or --  Thin space
-        c == 0x200A or --  Hair space
-        c == 0x2028 or --  Line separator
-        c == 0x2029 or --  Paragraph separator
-        c == 0x202F or --  Narrow no-break space
-        c == 0x205F or --  Medium mathematical space
-        c == 0x3000 --  Ideographic space
-end
-local function is_unicode_bullet(c)
-    -- Not all of them are strictly bullets, but will do for our usage here
-    return c == 0x2022 or --  Bullet
-        c == 0x2023 or --  Triangular bullet
-        c == 0x25a0 or --  Black square
-        c == 0x25cb or --  White circle
-        c == 0x25cf or --  Black circle
-        c == 0x25e6 or --  White bullet
-        c == 0x2043 or --  Hyphen bullet
-        c == 0x2219 or --  Bullet operator
-        c == 149 or --  Ascii bullet
-        c == B'*'
-end
-
-local function skip_starting_bullet(line)
-    local ch = line.first_char
-    local found_bullet = false
-
-    while ch ~= nil do
-        if is_unicode_bullet(ch.c) then
-            found_bullet = true
-        elseif not is_unicode_wspace(ch.c) then
-            break
-        end
-
-        ch = ch.next
-    end
-
-    if found_bullet then
-        return ch
-    else
-        return line.first_char
-    end
+-- run the page through a special device, the text_device, and split
+-- its lines into words (natively, see stext_words_from_page)
+local function get_stext_words(page)
+    local ctx = page.ctx
+    local category = W.mupdf_set_alloc_category(M.MUPDF_ALLOC_TEXT)
+    local text_page = W.mupdf_new_stext_page_from_page(ctx, page.page, nil)
+    if text_page == nil then merror(ctx, "cannot alloc text_page") end
+    local words = W.mupdf_new_stext_words(ctx, text_page)
+    M.fz_drop_stext_page(ctx, text_page)
+    if words == nil then merror(ctx, "cannot get page words") end
+    W.mupdf_set_alloc_category(category)
+    return words
 end
 
 --[[
@@ -501,104 +695,63 @@ for space characters.
 will return an empty table if we have no text
 --]]
 function page_mt.__index:getPageText()
-    -- first, we run the page through a special device, the text_device
-    local text_page = W.mupdf_new_stext_page_from_page(self.ctx, self.page, nil)
-    if text_page == nil then merror(self.ctx, "cannot alloc text_page") end
+    local words = get_stext_words(self)
 
-    -- now we analyze the data returned by the device and bring it
-    -- into the format we want to return
+    -- now we bring the words into the format we want to return
     local lines = {}
     local size = 0
 
-    local block = text_page.first_block
-    while block ~= nil do
-        if block.type == M.FZ_STEXT_BLOCK_TEXT then
-            -- a block contains lines, which is our primary return datum
-            local mupdf_line = block.u.t.first_line
-            while mupdf_line ~= nil do
-                local line = {}
-                local line_bbox = ffi.new("fz_rect", M.fz_empty_rect)
-
-                local first_char = skip_starting_bullet( mupdf_line )
-                local ch = first_char
-                local ch_len = 0
-                while ch ~= nil do
-                    ch = ch.next
-                    ch_len = ch_len + 1
-                end
-
-                if ch_len > 0 then
-                    -- here we will collect UTF-8 chars before making them
-                    -- a Lua string:
-                    local textbuf = ffi.new("char[?]", ch_len * 4)
-
-                    ch = first_char
-                    while ch ~= nil do
-                        local textlen = 0
-                        local word_bbox = ffi.new("fz_rect", M.fz_empty_rect)
-                        while ch ~= nil do
-                            if is_unicode_wspace(ch.c) then
-                                -- ignore and end word
-                                break
-                            end
-                            textlen = textlen + M.fz_runetochar(textbuf + textlen, ch.c)
-                            local char_bbox = ffi.new("fz_rect")
-                            W.mupdf_fz_rect_from_quad(char_bbox, ch.quad)
-                            W.mupdf_fz_union_rect(word_bbox, char_bbox)
-                            W.mupdf_fz_union_rect(line_bbox, char_bbox)
-                            if ch.c >= 0x4e00 and ch.c <= 0x9FFF or -- CJK Unified Ideographs
-                                ch.c >= 0x2000 and ch.c <= 0x206F or -- General Punctuation
-                                ch.c >= 0x3000 and ch.c <= 0x303F or -- CJK Symbols and Punctuation
-                                ch.c >= 0x3400 and ch.c <= 0x4DBF or -- CJK Unified Ideographs Extension A
-                                ch.c >= 0xF900 and ch.c <= 0xFAFF or -- CJK Compatibility Ideographs
-                                ch.c >= 0xFF01 and ch.c <= 0xFFEE or -- Halfwidth and Fullwidth Forms
-                                ch.c >= 0x20000 and ch.c <= 0x2A6DF  -- CJK Unified Ideographs Extension B
-                            then
-                                -- end word
-                                break
-                            end
-                            ch = ch.next
-                        end
-                        -- add word to line
-                        if word_bbox.x0 < word_bbox.x1 and word_bbox.y0 < word_bbox.y1 then
-                            table.insert(line, {
-                                word = ffi.string(textbuf, textlen),
-                                x0 = word_bbox.x0, y0 = word_bbox.y0,
-                                x1 = word_bbox.x1, y1 = word_bbox.y1,
-                            })
-                            size = size + 5 * 8 + textlen
-                        end
-
-                        if ch == nil then
-                            break
-                        end
-
-                        ch = ch.next
-                    end
-
-                    if line_bbox.x0 < line_bbox.x1 and line_bbox.y0 < line_bbox.y1 then
-                        line.x0, line.y0 = line_bbox.x0, line_bbox.y0
-                        line.x1, line.y1 = line_bbox.x1, line_bbox.y1
-                        size = size + 5 * 8
-                        table.insert(lines, line)
-                    end
-                end
-
-                mupdf_line = mupdf_line.next
-            end
-        end
+    local lbox = words.line_bboxes
+    for i = 0, words.n_lines - 1 do
+        lines[i+1] = {
+            x0 = lbox[i*4], y0 = lbox[i*4+1],
+            x1 = lbox[i*4+2], y1 = lbox[i*4+3],
+        }
+        size = size + 5 * 8
+    end
 
-        block = block.next
+    local text, offsets, wbox, wline = words.text, words.word_offsets, words.word_bboxes, words.word_lines
+    for i = 0, words.n_words - 1 do
+        local line = lines[wline[i] + 1]
+        local textlen = offsets[i+1] - offsets[i]
+        line[#line+1] = {
+            word = ffi.string(text + offsets[i], textlen),
+            x0 = wbox[i*4], y0 = wbox[i*4+1],
+            x1 = wbox[i*4+2], y1 = wbox[i*4+3],
+        }
+        size = size + 5 * 8 + textlen
     end
 
     -- Rough approximation of size for caching
     lines.size = size
 
-    M.fz_drop_stext_page(self.ctx, text_page)
+    M.fz_free(self.ctx, words)
 
     return lines
 end
 
+--[[
+get the words of the given page as flat arrays
+
+same words as getPageText, but as parallel arrays (like DjVu's getPageWords):
+{ word = {...}, x0 = {...}, y0 = {...}, x1 = {...}, y1 = {...}, line = {...} },
+with 1-based line indices
+--]]
+function page_mt.__index:getPageWords()
+    local words = get_stext_words(self)
+    local n = words.n_words
+    local word, x0, y0, x1, y1, line = {}, {}, {}, {}, {}, {}
+    local text, offsets, wbox, wline = words.text, words.word_offsets, words.word_bboxes, words.word_lines
+    for i = 0, n - 1 do
+        word[i+1] = ffi.string(text + offsets[i], offsets[i+1] - offsets[i])
+        x0[i+1], y0[i+1] = wbox[i*4], wbox[i*4+1]
+        x1[i+1], y1[i+1] = wbox[i*4+2], wbox[i*4+3]
+        line[i+1] = wline[i] + 1
+    end
+    M.fz_free(self.ctx, words)
+    return { word = word, x0 = x0, y0 = y0, x1 = x1, y1 = y1, line = line }
+end
+
 --[[
 Get a list of matches for the given text on the page, with their coordinates.
 Note: this searches only on the current page, not the whole document.
@@ -607,7 +760,9 @@ function page_mt.__index:searchPageText(needle, hit_max)
     if not hit_max then hit_max = 256 end
     local ctx = self.ctx
 
+    local category = W.mupdf_set_alloc_category(M.MUPDF_ALLOC_TEXT)
     local text_page = W.mupdf_new_stext_page_from_page(ctx, self.page, nil)
+    W.mupdf_set_alloc_category(category)
     if text_page == nil then return nil end
 
     -- Allocations
@@ -670,11 +825,53 @@ function page_mt.__index:getPageLinks()
     return links
 end
 
-local function run_page(page, pixmap, ctm, background_cleanup)
+--[[
+get the display list of the page, from the document cache when possible
+
+Building the list is what parses the page contents: replaying it afterwards
+is cheap, so re-rendering the page at another zoom, offset or gamma doesn't
+need to parse anything.
+--]]
+local function get_display_list(page)
+    local doc = page.doc
+    local cache = doc.display_lists
+    if cache then
+        local entry = cache:get(page.number)
+        if entry then return entry end
+    elseif mupdf.display_list_cache_pages > 0 then
+        cache = lru.new(mupdf.display_list_cache_pages, mupdf.display_list_cache_size, true)
+        doc.display_lists = cache
+    end
+
+    local ctx = page.ctx
+    local category = W.mupdf_set_alloc_category(M.MUPDF_ALLOC_DISPLAY_LIST)
+    local before = accounting and category_bytes(M.MUPDF_ALLOC_DISPLAY_LIST)
+    local list = W.mupdf_new_display_list_from_page(ctx, page.page)
+    if list == nil then merror(ctx, "cannot create display list") end
+    local after = accounting and category_bytes(M.MUPDF_ALLOC_DISPLAY_LIST)
+    W.mupdf_set_alloc_category(category)
+
+    local entry = setmetatable({
+        -- list is a cdata<fz_display_list *>, attach a finalizer to it to release ressources on garbage collection
+        list = ffi.gc(list, function(l) drop_display_list(ctx, l) end),
+        ctx = keep_context(ctx),
+    }, display_list_mt)
+
+    local bytes = before and math.max(after - before, 1) or 1
+    -- a list larger than the whole cache is used once, and left to the GC
+    if cache and bytes <= mupdf.display_list_cache_size then
+        cache:set(page.number, entry, bytes)
+    end
+    return entry
+end
+
+local function run_page(page, pixmap, ctm, background_cleanup, scissor)
+    local category = W.mupdf_set_alloc_category(M.MUPDF_ALLOC_RENDER)
     M.fz_clear_pixmap_with_value(page.ctx, pixmap, 0xff)
 
     local dev = W.mupdf_new_draw_device(page.ctx, nil, pixmap)
     if dev == nil then merror(page.ctx, "cannot create draw device") end
+    W.mupdf_hook_image_cache(dev, page.doc.doc)
 
     if background_cleanup and W.mupdf_page_has_transparency_mask(page.ctx, page.page) ~= 0 then
         local transparency_mask_dev = W.mupdf_new_transparency_mask_device(page.ctx, dev)
@@ -690,61 +887,144 @@ local function run_page(page, pixmap, ctm, background_cleanup)
         dev = transparency_mask_dev
     end
 
-    local ok = W.mupdf_run_page(page.ctx, page.page, dev, ctm, nil)
+    local entry = get_display_list(page)
+    local ok = W.mupdf_run_display_list(page.ctx, entry.list, dev, ctm, scissor, nil)
                and W.mupdf_close_device(page.ctx, dev)
 
     M.fz_drop_device(page.ctx, dev)
 
     if not ok then merror(page.ctx, "could not run page") end
+    W.mupdf_set_alloc_category(category)
 end
---[[
-render page to blitbuffer
-
-old interface: expects a blitbuffer to render to
---]]
-function page_mt.__index:draw(draw_context, blitbuffer, offset_x, offset_y)
-    local buffer = self:draw_new(draw_context, blitbuffer:getWidth(), blitbuffer:getHeight(), offset_x, offset_y)
-    blitbuffer:blitFrom(buffer)
-    buffer:free()
-end
---[[
-render page to blitbuffer
-
-new interface: creates the blitbuffer with the rendered data and returns that
-TODO: make this the used interface
---]]
-function page_mt.__index:draw_new(draw_context, width, height, offset_x, offset_y)
+-- render page into bb, which must be of the type matching doc.color
+local function render_page(page, draw_context, bb, offset_x, offset_y)
     local ctm = ffi.new("fz_matrix")
 
     W.mupdf_fz_scale(ctm, draw_context.zoom, draw_context.zoom)
     W.mupdf_fz_pre_rotate(ctm, draw_context.rotate)
     W.mupdf_fz_pre_translate(ctm, draw_context.offset_x, draw_context.offset_y)
 
-    local bbox = ffi.new("fz_irect", offset_x, offset_y, offset_x + width, offset_y + height)
+    local bbox = ffi.new("fz_irect", offset_x, offset_y, offset_x + bb.w, offset_y + bb.h)
 
-    local bb = BlitBuffer.new(width, height, self.doc.color and BlitBuffer.TYPE_BBRGB32 or BlitBuffer.TYPE_BB8)
-
-    local colorspace = self.doc.color and M.fz_device_rgb(self.ctx)
-        or M.fz_device_gray(self.ctx)
-    if mupdf.bgr and self.doc.color then
-        colorspace = M.fz_device_bgr(self.ctx)
+    local colorspace = page.doc.color and M.fz_device_rgb(page.ctx)
+        or M.fz_device_gray(page.ctx)
+    if mupdf.bgr and page.doc.color then
+        colorspace = M.fz_device_bgr(page.ctx)
+    end
+    local pix = W.mupdf_new_pixmap_with_bbox_and_data_stride(
+        page.ctx, colorspace, bbox, nil, page.doc.color and 1 or 0, bb.stride, ffi.cast("unsigned char*", bb.data))
+    if pix == nil then merror(page.ctx, "cannot allocate pixmap") end
+
+    if mupdf.render_threads ~= 1 then
+        local mask = draw_context.background_cleanup and W.mupdf_page_has_transparency_mask(page.ctx, page.page) ~= 0
+        local list = get_display_list(page).list
+        local category = W.mupdf_set_alloc_category(M.MUPDF_ALLOC_RENDER)
+        local ok = W.mupdf_draw_display_list_banded(page.ctx, page.doc.doc, list, pix, ctm,
+            mask and 1 or 0, mupdf.render_threads)
+        if not ok then merror(page.ctx, "could not run page") end
+        W.mupdf_set_alloc_category(category)
+    else
+        -- only replay what falls into the rendered area
+        local scissor = ffi.new("fz_rect", bbox.x0, bbox.y0, bbox.x1, bbox.y1)
+        run_page(page, pix, ctm, draw_context.background_cleanup, scissor)
     end
-    local pix = W.mupdf_new_pixmap_with_bbox_and_data(
-        self.ctx, colorspace, bbox, nil, self.doc.color and 1 or 0, ffi.cast("unsigned char*", bb.data))
-    if pix == nil then merror(self.ctx, "cannot allocate pixmap") end
-
-    run_page(self, pix, ctm, draw_context.background_cleanup)
 
     if draw_context.gamma >= 0.0 then
-        M.fz_gamma_pixmap(self.ctx, pix, draw_context.gamma)
+        M.fz_gamma_pixmap(page.ctx, pix, draw_context.gamma)
     end
 
     if draw_context.saturation ~= 1.0 then
         bb:adjustSaturation(draw_context.saturation)
     end
 
-    M.fz_drop_pixmap(self.ctx, pix)
+    M.fz_drop_pixmap(page.ctx, pix)
+end
+
+-- memory reused by draw() when it can't render straight into its target
+local scratch = { data = nil, size = 0 }
+
+local function get_scratch_bb(width, height, bbtype)
+    local stride = width * BlitBuffer.TYPE_TO_BPP[bbtype] / 8
+    local size = stride * height
+    if size > scratch.size then
+        C.free(scratch.data)
+        scratch.data = C.malloc(size)
+        if scratch.data == nil then
+            scratch.size = 0
+            error("cannot allocate scratch buffer")
+        end
+        scratch.size = size
+    end
+    return BlitBuffer.new(width, height, bbtype, scratch.data, stride)
+end
+
+--[[
+free the memory kept for rendering to incompatible blitbuffers
+--]]
+function mupdf.freeScratchBuffer()
+    C.free(scratch.data)
+    scratch.data = nil
+    scratch.size = 0
+end
+
+--[[
+render page to blitbuffer
+
+old interface: expects a blitbuffer to render to
+
+renders straight into it when it's of the type we render to (BB8, or
+BBRGB32 for color documents), and neither rotated nor inverted
+--]]
+function page_mt.__index:draw(draw_context, blitbuffer, offset_x, offset_y)
+    local bbtype = self.doc.color and BlitBuffer.TYPE_BBRGB32 or BlitBuffer.TYPE_BB8
+    if blitbuffer:getType() == bbtype and blitbuffer:getRotation() == 0 and blitbuffer:getInverse() == 0 then
+        render_page(self, draw_context, blitbuffer, offset_x, offset_y)
+        return
+    end
+    local buffer = get_scratch_bb(blitbuffer:getWidth(), blitbuffer:getHeight(), bbtype)
+    render_page(self, draw_context, buffer, offset_x, offset_y)
+    blitbuffer:blitFrom(buffer)
+end
+--[[
+render page to blitbuffer in two passes
+
+a quick preview at preview_scale (mupdf.preview_scale by default) of the
+resolution is rendered and upscaled into blitbuffer first, and on_preview
+is called with it, so that it can be shown (e.g., with a fast refresh)
+before the full quality render overwrites it. Both passes replay the same
+display list, and MuPDF decodes images at the reduced size for the preview.
+If on_preview returns false, the full quality render is skipped.
+--]]
+function page_mt.__index:drawProgressive(draw_context, blitbuffer, offset_x, offset_y, on_preview, preview_scale)
+    local scale = preview_scale or mupdf.preview_scale
+    local width, height = blitbuffer:getWidth(), blitbuffer:getHeight()
+    local preview_w, preview_h = math.ceil(width * scale), math.ceil(height * scale)
+    if scale < 1 and preview_w > 0 and preview_h > 0 then
+        -- offsets in the DrawContext are in page units, the other ones in pixels
+        local preview_dc = DrawContext.new(draw_context.rotate, draw_context.zoom * scale,
+            draw_context.offset_x, draw_context.offset_y, draw_context.gamma,
+            draw_context.background_cleanup, draw_context.saturation)
+        local preview = self:draw_new(preview_dc, preview_w, preview_h,
+            math.floor(offset_x * scale), math.floor(offset_y * scale))
+        local scaled = mupdf.scaleBlitBuffer(preview, width, height)
+        preview:free()
+        blitbuffer:blitFrom(scaled)
+        scaled:free()
+        if on_preview and on_preview(blitbuffer) == false then
+            return
+        end
+    end
+    self:draw(draw_context, blitbuffer, offset_x, offset_y)
+end
+--[[
+render page to blitbuffer
 
+new interface: creates the blitbuffer with the rendered data and returns that
+TODO: make this the used interface
+--]]
+function page_mt.__index:draw_new(draw_context, width, height, offset_x, offset_y)
+    local bb = BlitBuffer.new(width, height, self.doc.color and BlitBuffer.TYPE_BBRGB32 or BlitBuffer.TYPE_BB8)
+    render_page(self, draw_context, bb, offset_x, offset_y)
     return bb
 end
 
@@ -808,6 +1088,7 @@ function page_mt.__index:addMarkupAnnotation(points, n, type, bb_color)
     -- Synthesize /Rect and /AP appearance stream, needed for visibility in desktop PDF viewers
     ok = W.mupdf_pdf_update_annot(self.ctx, annot)
     if not ok then merror(self.ctx, "could not update markup annotation") end
+    self.doc:clearDisplayLists(self.number)
 
     -- Fetch back MuPDF's stored coordinates of all quadpoints, as they may have been modified/rounded
     -- (we need the exact ones that were saved if we want to be able to find them for deletion/update)
@@ -868,11 +1149,13 @@ function page_mt.__index:addInkAnnotation(strokes, bb_color, width, opacity)
     -- annotation is invisible in desktop PDF viewers (Preview, Acrobat, ...).
     ok = W.mupdf_pdf_update_annot(self.ctx, annot)
     if not ok then merror(self.ctx, "could not update ink annotation") end
+    self.doc:clearDisplayLists(self.number)
 end
 
 function page_mt.__index:deleteAnnotation(annot)
     local ok = W.mupdf_pdf_delete_annot(self.ctx, ffi.cast("pdf_page*", self.page), annot)
     if not ok then merror(self.ctx, "could not delete annotation") end
+    self.doc:clearDisplayLists(self.number)
 end
 
 function page_mt.__index:getMarkupAnnotation(points, n)
@@ -906,6 +1189,7 @@ end
 function page_mt.__index:updateMarkupAnnotation(annot, contents)
     local ok = W.mupdf_pdf_set_annot_contents(self.ctx, annot, contents)
     if not ok then merror(self.ctx, "could not update markup annot contents") end
+    self.doc:clearDisplayLists(self.number)
 end
 
 function page_mt.__index:getEmbeddedAnnotations()
@@ -1123,27 +1407,10 @@ local function get_k2pdfopt()
 end
 
 --[[
-the following function is a reimplementation of what can be found
-in libk2pdfopt/willuslib/bmpmupdf.c
-k2pdfopt supports only 8bit and 24bit "bitmaps" - and mupdf will give
-only 8bit+8bit alpha or 24bit+8bit alpha pixmaps. So we need to convert
-what we get from mupdf.
+render straight into the k2pdfopt bitmap: k2pdfopt supports only 8bit and
+24bit "bitmaps", which are what mupdf gives without alpha, so the pixmap
+is made over the bitmap's own (malloc'ed) samples, which it keeps owning.
 --]]
-local function bmpmupdf_pixmap_to_bmp(bmp, pixmap)
-    local k2pdfopt = get_k2pdfopt()
-    local ctx = context()
-
-    bmp.width = M.fz_pixmap_width(ctx, pixmap)
-    bmp.height = M.fz_pixmap_height(ctx, pixmap)
-    local ncomp = M.fz_pixmap_components(ctx, pixmap)
-    local p = M.fz_pixmap_samples(ctx, pixmap)
-    if ncomp == 2 or ncomp == 4 then
-        k2pdfopt.pixmap_to_bmp(bmp, p, ncomp)
-    else
-        error("unsupported pixmap format for conversion to bmp")
-    end
-end
-
 local function render_for_kopt(bmp, page, scale, bounds, background_cleanup)
     local k2pdfopt = get_k2pdfopt()
 
@@ -1158,14 +1425,25 @@ local function render_for_kopt(bmp, page, scale, bounds, background_cleanup)
     if mupdf.bgr and page.doc.color then
         colorspace = M.fz_device_bgr(page.ctx)
     end
-    local pix = W.mupdf_new_pixmap_with_bbox(page.ctx, colorspace, bbox, nil, 1)
-    if pix == nil then merror(page.ctx, "could not allocate pixmap") end
-
-    run_page(page, pix, ctm, background_cleanup)
 
+    k2pdfopt.bmp_free(bmp)
     k2pdfopt.bmp_init(bmp)
+    bmp.width = bbox.x1 - bbox.x0
+    bmp.height = bbox.y1 - bbox.y0
+    bmp.bpp = page.doc.color and 24 or 8
+    k2pdfopt.bmp_alloc(bmp)
+    if bmp.data == nil then error("could not allocate bitmap") end
+    if bmp.bpp == 8 then
+        for i = 0, 255 do
+            bmp.red[i], bmp.green[i], bmp.blue[i] = i, i, i
+        end
+    end
 
-    bmpmupdf_pixmap_to_bmp(bmp, pix)
+    local pix = W.mupdf_new_pixmap_with_bbox_and_data_stride(
+        page.ctx, colorspace, bbox, nil, 0, k2pdfopt.bmp_bytewidth(bmp), bmp.data)
+    if pix == nil then merror(page.ctx, "could not allocate pixmap") end
+
+    run_page(page, pix, ctm, background_cleanup)
 
     M.fz_drop_pixmap(page.ctx, pix)
 end
@@ -1173,6 +1451,7 @@ end
 function page_mt.__index:getPagePix(kopt_context, render_mode, background_cleanup)
     local bounds = ffi.new("fz_rect", kopt_context.bbox.x0, kopt_context.bbox.y0, kopt_context.bbox.x1, kopt_context.bbox.y1)
 
+    kopt_context:invalidateWordBoxes()
     render_for_kopt(kopt_context.src, self, kopt_context.zoom, bounds, background_cleanup ~= nil and background_cleanup ~= 0)
 
     kopt_context.page_width = kopt_context.src.width
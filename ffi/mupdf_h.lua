@@ -90,6 +90,7 @@ typedef struct fz_separations fz_separations;
 typedef struct fz_page fz_page;
 typedef struct fz_document fz_document;
 typedef struct fz_device fz_device;
+typedef struct fz_display_list fz_display_list;
 fz_document *mupdf_open_document(fz_context *, const char *);
 fz_document *mupdf_open_document_with_stream_and_dir(fz_context *, const char *, fz_stream *, fz_archive *);
 int fz_is_document_reflowable(fz_context *, fz_document *);
@@ -200,8 +201,30 @@ typedef struct {
   fz_pool_array *id_list;
 } fz_stext_page;
 fz_stext_page *mupdf_new_stext_page_from_page(fz_context *, fz_page *, const fz_stext_options *);
+typedef struct mupdf_stext_words {
+  int n_words;
+  int n_lines;
+  char *text;
+  int *word_offsets;
+  float *word_bboxes;
+  int *word_lines;
+  float *line_bboxes;
+} mupdf_stext_words;
+mupdf_stext_words *mupdf_new_stext_words(fz_context *, fz_stext_page *);
+void fz_free(fz_context *, void *);
 int mupdf_search_stext_page(fz_context *, fz_stext_page *, const char *, int *, fz_quad *, int);
 void fz_drop_stext_page(fz_context *, fz_stext_page *);
+typedef struct mupdf_searcher mupdf_searcher;
+typedef struct mupdf_search_hit {
+  int page;
+  int mark;
+  fz_quad quad;
+} mupdf_search_hit;
+mupdf_searcher *mupdf_new_searcher(fz_context *, const char *, const char *, float, float, float, size_t);
+void mupdf_drop_searcher(mupdf_searcher *);
+void mupdf_searcher_start(mupdf_searcher *, const char *, int, int, int);
+void mupdf_searcher_cancel(mupdf_searcher *);
+int mupdf_searcher_poll(mupdf_searcher *, mupdf_search_hit *, int, int *, int *);
 typedef struct {
   uint8_t ri;
   uint8_t bp;
@@ -220,6 +243,7 @@ fz_pixmap *fz_new_pixmap(fz_context *, fz_colorspace *, int, int, fz_separations
 fz_pixmap *mupdf_new_pixmap_with_bbox(fz_context *, fz_colorspace *, const fz_irect *, fz_separations *, int);
 fz_pixmap *mupdf_new_pixmap_with_data(fz_context *, fz_colorspace *, int, int, fz_separations *, int, int, unsigned char *);
 fz_pixmap *mupdf_new_pixmap_with_bbox_and_data(fz_context *, fz_colorspace *, const fz_irect *, fz_separations *, int, unsigned char *);
+fz_pixmap *mupdf_new_pixmap_with_bbox_and_data_stride(fz_context *, fz_colorspace *, const fz_irect *, fz_separations *, int, int, unsigned char *);
 fz_pixmap *mupdf_convert_pixmap(fz_context *, const fz_pixmap *, fz_colorspace *, fz_colorspace *, fz_default_colorspaces *, fz_color_params, int);
 void fz_drop_pixmap(fz_context *, fz_pixmap *);
 void fz_clear_pixmap_with_value(fz_context *, fz_pixmap *, int);
@@ -237,6 +261,15 @@ fz_device *mupdf_new_bbox_device(fz_context *, fz_rect *);
 fz_device *mupdf_new_transparency_mask_device(fz_context *, fz_device *);
 int mupdf_page_has_transparency_mask(fz_context *, fz_page *);
 bool mupdf_run_page(fz_context *, fz_page *, fz_device *, const fz_matrix *, fz_cookie *);
+fz_display_list *mupdf_new_display_list_from_page(fz_context *, fz_page *);
+bool mupdf_run_display_list(fz_context *, fz_display_list *, fz_device *, const fz_matrix *, const fz_rect *, fz_cookie *);
+void fz_drop_display_list(fz_context *, fz_display_list *);
+bool mupdf_draw_display_list_banded(fz_context *, fz_document *, fz_display_list *, fz_pixmap *, const fz_matrix *, int, int);
+void mupdf_render_pool_shutdown(fz_context *);
+void mupdf_set_image_cache(fz_context *, size_t, int);
+size_t mupdf_get_image_cache_used();
+void mupdf_clear_image_cache(fz_context *, fz_document *);
+void mupdf_hook_image_cache(fz_device *, fz_document *);
 bool mupdf_close_device(fz_context *, fz_device *);
 void fz_drop_device(fz_context *, fz_device *);
 enum pdf_annot_type {
@@ -313,8 +346,33 @@ typedef struct {
   int do_labels;
 } pdf_write_options;
 bool mupdf_pdf_save_document(fz_context *, pdf_document *, const char *, pdf_write_options *);
+pdf_document *pdf_specifics(fz_context *, fz_document *);
+int pdf_has_unsaved_changes(fz_context *, pdf_document *);
+int pdf_can_be_saved_incrementally(fz_context *, pdf_document *);
+enum mupdf_alloc_category {
+  MUPDF_ALLOC_OTHER,
+  MUPDF_ALLOC_DOCUMENT,
+  MUPDF_ALLOC_DISPLAY_LIST,
+  MUPDF_ALLOC_RENDER,
+  MUPDF_ALLOC_TEXT,
+  MUPDF_ALLOC_IMAGE,
+  MUPDF_ALLOC_CATEGORIES,
+};
+typedef struct mupdf_alloc_stats {
+  size_t current;
+  size_t peak;
+  size_t blocks;
+  size_t allocs;
+  size_t reallocs;
+  size_t reallocs_in_place;
+  size_t category[6];
+} mupdf_alloc_stats;
 fz_alloc_context *mupdf_get_my_alloc_context();
+fz_locks_context *mupdf_get_my_locks_context();
 int mupdf_get_cache_size();
+int mupdf_set_alloc_category(int);
+void mupdf_get_alloc_stats(mupdf_alloc_stats *);
+void mupdf_reset_alloc_peak();
 int mupdf_error_code(fz_context *);
 char *mupdf_error_message(fz_context *);
 fz_matrix *mupdf_fz_scale(fz_matrix *, float, float);
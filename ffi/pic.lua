@@ -1,7 +1,12 @@
 local ffi = require("ffi")
 local BB = require("ffi/blitbuffer")
 
-local Pic = {}
+local Pic = {
+    -- Animated GIFs: snapshot the composited canvas every that many frames...
+    gif_keyframe_interval = 16,
+    -- ...but spread the snapshots out further if they would take more than this
+    gif_keyframes_size = 32*1024*1024,
+}
 
 --[[
 start of pic page type
@@ -117,6 +122,13 @@ end
 
 local GifDocument = PicDocument:extend{
     giffile = nil,
+    -- composited frames, see GifDocument:composite()
+    canvas = nil,
+    canvas_frame = 0,
+    saved_canvas = nil,
+    keyframes = nil,
+    keyframe_interval = nil,
+    palettes = nil,
 }
 function GifDocument:getPages()
     return self.giffile.ImageCount
@@ -126,85 +138,174 @@ function GifDocument:getOriginalPageSize(number)
     local i = self.giffile.SavedImages[0]
     return i.ImageDesc.Width, i.ImageDesc.Height, 4 -- components
 end
-function GifDocument:openPage(number)
-    ensure_giflib_loaded()
-    -- If there are multiple frames (animated GIF), a standalone
-    -- frame may not be enough (it may be smaller than the first frame,
-    -- and have some transparency): we need to paste it (and all the
-    -- previous frames) over the first frame
-    -- Here, because requesting a random number is possible, we redo all the
-    -- pastes from first frame till requested frame number: it could be optimized
+
+-- Returns the transparent color index (or nil) and the disposal mode of a frame
+function GifDocument:getFrameControl(framenum)
+    local gcb = self.gcb
+    if not gcb then
+        gcb = ffi.new("GraphicsControlBlock")
+        self.gcb = gcb
+    end
+    local transparent_color = nil
+    local disposal_mode = giflib.DISPOSAL_UNSPECIFIED
+    if giflib.DGifSavedExtensionToGCB(self.giffile, framenum-1, gcb) == 1 then
+        if gcb.TransparentColor ~= giflib.NO_TRANSPARENT_COLOR then
+            transparent_color = gcb.TransparentColor
+        end
+        disposal_mode = gcb.DisposalMode
+    end
+    return transparent_color, disposal_mode
+end
+
+-- Palettes are shared by all the frames using the same color map
+function GifDocument:getPalette(cmap)
+    local key = tonumber(ffi.cast("intptr_t", cmap))
+    local palette = self.palettes[key]
+    if not palette then
+        palette = ffi.new("ColorRGB32[256]")
+        for c = 0, 255 do
+            palette[c].alpha = 0xFF
+        end
+        for c = 0, math.min(cmap.ColorCount, 256)-1 do
+            local color = cmap.Colors[c]
+            palette[c].r = color.Red
+            palette[c].g = color.Green
+            palette[c].b = color.Blue
+        end
+        self.palettes[key] = palette
+    end
+    return palette
+end
+
+--[[
+Brings self.canvas to the state shown by frame number.
+
+We keep the last composited canvas around, so that playing an animation
+only ever pastes one new frame per page, and we snapshot the canvas every
+keyframe_interval frames, so that seeking back only has to replay the frames
+since the nearest snapshot instead of starting over from the first one.
+--]]
+function GifDocument:composite(number)
     local i = self.giffile.SavedImages[0]
     local width = i.ImageDesc.Width
     local height = i.ImageDesc.Height
-    local bb = BB.new(width, height, BB.TYPE_BBRGB32)
-    bb:fill(BB.COLOR_WHITE) -- fill with white in case first frame has transparency
-
-    local gcb = ffi.new("GraphicsControlBlock") -- re-used with each frame
-    local framenum = 1
-    while framenum <= number and framenum <= self.giffile.ImageCount do
-        -- print("frame "..framenum)
-
-        -- get transparency (index into palette) and disposal_mode (how to draw
-        -- frame over previous ones) from Graphics Control Extension
-        local transparent_color = nil
-        local disposal_mode = nil
-        if giflib.DGifSavedExtensionToGCB(self.giffile, framenum-1, gcb) == 1 then
-            if gcb.TransparentColor ~= giflib.NO_TRANSPARENT_COLOR then
-                transparent_color = gcb.TransparentColor
-            end
-            if gcb.DisposalMode ~= giflib.DISPOSAL_UNSPECIFIED then
-                disposal_mode = gcb.DisposalMode
+    if not self.canvas then
+        self.canvas = BB.new(width, height, BB.TYPE_BBRGB32)
+        self.canvas_frame = 0
+        self.keyframes = {}
+        self.palettes = {}
+        -- Keep the snapshots within Pic.gif_keyframes_size
+        local frame_size = self.canvas.stride * height
+        self.keyframe_interval = math.max(Pic.gif_keyframe_interval,
+            math.ceil(self.giffile.ImageCount * frame_size / Pic.gif_keyframes_size))
+    end
+    local canvas = self.canvas
+
+    if self.canvas_frame > number then
+        -- Rewind to the nearest snapshot
+        local k = number - number % self.keyframe_interval
+        while k > 0 and not self.keyframes[k] do
+            k = k - self.keyframe_interval
+        end
+        local keyframe = self.keyframes[k]
+        if keyframe then
+            canvas:blitFrom(keyframe.canvas)
+            if keyframe.saved_canvas then
+                self.saved_canvas:blitFrom(keyframe.saved_canvas)
             end
         end
+        self.canvas_frame = keyframe and k or 0
+    end
+    if self.canvas_frame == 0 then
+        canvas:fill(BB.COLOR_WHITE) -- fill with white in case first frame has transparency
+    end
+
+    while self.canvas_frame < number do
+        local framenum = self.canvas_frame
         -- See http://webreference.com/content/studio/disposal.html
-        -- (not tested, all found animated gif have DISPOSE_DO_NOT
-        if disposal_mode == giflib.DISPOSE_BACKGROUND then
-            bb:fill(BB.COLOR_WHITE) -- fill with white
-        -- elseif disposal_mode == giflib.DISPOSE_PREVIOUS then
-            -- Rare (no sample to test with), and not supported for now: we should
-            -- keep a copy of the last bb drawn widh DISPOSE_DO_NOT
-        -- else: giflib.DISPOSE_DO_NOT or DISPOSAL_UNSPECIFIED: draw over previous frame
+        -- The disposal mode of a frame tells what to do with its area once it has been
+        -- displayed, i.e., before drawing the next one.
+        if framenum > 0 then
+            local _, disposal_mode = self:getFrameControl(framenum)
+            if disposal_mode == giflib.DISPOSE_BACKGROUND then
+                local d = self.giffile.SavedImages[framenum-1].ImageDesc
+                canvas:paintRectRGB32(d.Left, d.Top, d.Width, d.Height, BB.COLOR_WHITE)
+            elseif disposal_mode == giflib.DISPOSE_PREVIOUS then
+                canvas:blitFrom(self.saved_canvas)
+            end
+            -- else: giflib.DISPOSE_DO_NOT or DISPOSAL_UNSPECIFIED: draw over previous frame
         end
 
-        -- build palette from frame or global color map
-        local cmap = i.ImageDesc.ColorMap ~= nil and i.ImageDesc.ColorMap or self.giffile.SColorMap
-        local palette={}
-        for c=0, cmap.ColorCount-1 do
-            local color = cmap.Colors[c]
-            palette[c] = BB.ColorRGB32(color.Red, color.Green, color.Blue, 0xFF)
+        framenum = framenum + 1
+        i = self.giffile.SavedImages[framenum-1]
+        local transparent_color, disposal_mode = self:getFrameControl(framenum)
+        if disposal_mode == giflib.DISPOSE_PREVIOUS then
+            -- Keep what's below this frame, to restore it before drawing the next one
+            if not self.saved_canvas then
+                self.saved_canvas = BB.new(width, height, BB.TYPE_BBRGB32)
+            end
+            self.saved_canvas:blitFrom(canvas)
         end
 
-        -- Draw current frame on our bb
-        local f_w, f_h = i.ImageDesc.Width, i.ImageDesc.Height
-        local f_x, f_y = i.ImageDesc.Left, i.ImageDesc.Top
-        local p = i.RasterBits
-        for y = f_y, f_y+f_h-1 do
-            for x = f_x, f_x+f_w-1 do
-                if not transparent_color or p[0] ~= transparent_color then
-                    bb:setPixel(x, y, palette[p[0]])
-                end
-                p = p + 1
-            end
+        -- Draw current frame on our canvas, from frame or global color map
+        local cmap = i.ImageDesc.ColorMap ~= nil and i.ImageDesc.ColorMap or self.giffile.SColorMap
+        if cmap ~= nil then
+            local d = i.ImageDesc
+            canvas:paintIndexedRGB32(d.Left, d.Top, d.Width, d.Height, i.RasterBits, d.Width,
+                self:getPalette(cmap), transparent_color)
         end
+        self.canvas_frame = framenum
 
-        framenum = framenum + 1
-        if framenum <= self.giffile.ImageCount then
-            i = self.giffile.SavedImages[framenum-1]
+        if framenum % self.keyframe_interval == 0 and not self.keyframes[framenum] then
+            self.keyframes[framenum] = {
+                canvas = canvas:copy(),
+                saved_canvas = disposal_mode == giflib.DISPOSE_PREVIOUS and self.saved_canvas:copy() or nil,
+            }
         end
     end
+end
+
+function GifDocument:openPage(number)
+    ensure_giflib_loaded()
+    -- If there are multiple frames (animated GIF), a standalone
+    -- frame may not be enough (it may be smaller than the first frame,
+    -- and have some transparency): we need to paste it (and all the
+    -- previous frames) over the first frame
+    number = math.max(1, math.min(number or 1, self.giffile.ImageCount))
+    self:composite(number)
 
     local page = GifPage:new{
-        width = width,
-        height = height,
-        image_bb = bb,
+        width = self.canvas:getWidth(),
+        height = self.canvas:getHeight(),
+        image_bb = self.canvas:copy(),
         doc = self,
     }
 
     return page
 end
+function GifDocument:cleanCache()
+    if self.keyframes then
+        for _, keyframe in pairs(self.keyframes) do
+            keyframe.canvas:free()
+            if keyframe.saved_canvas then
+                keyframe.saved_canvas:free()
+            end
+        end
+        self.keyframes = {}
+    end
+end
 function GifDocument:close()
     ensure_giflib_loaded()
+    self:cleanCache()
+    if self.canvas then
+        self.canvas:free()
+        self.canvas = nil
+    end
+    if self.saved_canvas then
+        self.saved_canvas:free()
+        self.saved_canvas = nil
+    end
+    self.palettes = nil
     local err = ffi.new("int[1]")
     if giflib.DGifCloseFile(self.giffile, err) ~= giflib.GIF_OK then
         error(string.format("error closing/deallocating GIF: %s",
@@ -371,6 +472,91 @@ function Pic.openJPGDocumentFromData(data, size)
     return doc
 end
 
+--[[
+Decoding straight to a target size (e.g., thumbnails, or comic pages fitted to the screen)
+--]]
+local bbtype_ncomp = {
+    [BB.TYPE_BB8] = 1,
+    [BB.TYPE_BB8A] = 2,
+    [BB.TYPE_BBRGB24] = 3,
+    [BB.TYPE_BBRGB32] = 4,
+}
+local ncomp_bbtype = { BB.TYPE_BB8, BB.TYPE_BB8A, BB.TYPE_BBRGB24, BB.TYPE_BBRGB32 }
+
+-- Size of a width x height image fitted to max_w x max_h, never upscaled
+local function fitSize(width, height, max_w, max_h)
+    local scale = math.min(max_w / width, max_h / height, 1)
+    return math.max(1, math.floor(width * scale + 0.5)), math.max(1, math.floor(height * scale + 0.5))
+end
+
+-- Returns bb scaled to width x height and converted to bbtype, freeing it if it had to be replaced
+local function toSize(bb, width, height, bbtype)
+    if bb:getWidth() ~= width or bb:getHeight() ~= height then
+        local scaled_bb = bb:scale(width, height)
+        bb:free()
+        bb = scaled_bb
+    end
+    if bb:getType() ~= bbtype then
+        local converted_bb = BB.new(width, height, bbtype)
+        converted_bb:blitFrom(bb)
+        bb:free()
+        bb = converted_bb
+    end
+    return bb
+end
+
+--[[
+Decodes a JPEG, PNG, WebP or GIF image (first frame only for animations) from memory,
+fitted to max_w x max_h (keeping its aspect ratio, never upscaled), into a new blitbuffer
+of type bbtype (by default, RGB24 or BB8 depending on Pic.color).
+
+JPEG and still WebP images are downscaled while decoding (libjpeg-turbo's scaling
+factors, libwebp's scaler), so they're never converted or scaled at full size.
+PNG and GIF images are decoded at full size first (neither lodepng nor giflib can
+scale), then scaled by the blitbuffer scaler: this saves nothing on peak memory.
+
+Returns the blitbuffer, and the original width and height of the image.
+--]]
+function Pic.decodeToSize(data, max_w, max_h, bbtype, size)
+    size = size or #data
+    bbtype = bbtype or (Pic.color and BB.TYPE_BBRGB24 or BB.TYPE_BB8)
+    local bytes = ffi.cast("const uint8_t*", data)
+    local bb, width, height
+    if size >= 3 and bytes[0] == 0xFF and bytes[1] == 0xD8 and bytes[2] == 0xFF then
+        local Jpeg = require("ffi/jpeg")
+        local color = bbtype ~= BB.TYPE_BB8 and bbtype ~= BB.TYPE_BB8A
+        local image, _, _, _, orig_w, orig_h = Jpeg.openDocumentFromMem(bytes, color, size, max_w, max_h)
+        bb, width, height = image, orig_w, orig_h
+    elseif size >= 8 and ffi.string(bytes, 8) == "\137PNG\r\n\26\n" then
+        local Png = require("ffi/png")
+        local ok, re = Png.decodeFromMem(bytes, size, bbtype_ncomp[bbtype] or 3)
+        if not ok then error(re) end
+        width, height = re.width, re.height
+        bb = BB.new(width, height, ncomp_bbtype[re.ncomp], re.data)
+        -- Mark buffer for freeing when Blitbuffer is freed:
+        bb:setAllocated(1)
+    elseif size >= 12 and ffi.string(bytes, 4) == "RIFF" and ffi.string(bytes + 8, 4) == "WEBP" then
+        local Webp = require("ffi/webp")
+        bb, width, height = Webp.decodeToSize(bytes, size, max_w, max_h)
+        if not bb then
+            local webp = Webp.fromData(bytes, size)
+            bb = webp:getFrameImage(1)
+            width, height = webp.width, webp.height
+            webp:close()
+        end
+    elseif size >= 4 and ffi.string(bytes, 4) == "GIF8" then
+        local doc = Pic.openGIFDocumentFromData(bytes, size)
+        local page = doc:openPage(1)
+        bb, width, height = page.image_bb, page.width, page.height
+        page.image_bb = nil
+        doc:close()
+    else
+        error("Unsupported image format")
+    end
+    local tw, th = fitSize(width, height, max_w, max_h)
+    return toSize(bb, tw, th, bbtype), width, height
+end
+
 --[[
 start of pic module API
 --]]
@@ -7,6 +7,7 @@ Currently, this is a LuaJIT FFI wrapper for lodepng lib.
 ]]
 
 local ffi = require("ffi")
+local posix = require("ffi/posix")
 require("ffi/lodepng_h")
 
 local lodepng = ffi.loadlib("lodepng")
@@ -41,14 +42,19 @@ function Png.encodeToFile(filename, mem, w, h, n)
 end
 
 function Png.decodeFromFile(filename, req_n)
-    -- Read the file
-    local fh = io.open(filename, "rb")
-    if not fh then
+    -- Map the file, instead of reading a copy of it into a Lua string
+    local ok, fdata, size = pcall(posix.mmapFile, filename)
+    if not ok then
         return false, "couldn't open PNG file"
     end
-    local fdata = fh:read("*a")
-    fh:close()
+    local re
+    ok, re = Png.decodeFromMem(fdata, size, req_n)
+    posix.munmap(fdata, size)
+    return ok, re
+end
 
+function Png.decodeFromMem(fdata, size, req_n)
+    size = size or #fdata
     local ptr = ffi.new("unsigned char*[1]")
     local width = ffi.new("int[1]")
     local height = ffi.new("int[1]")
@@ -61,7 +67,7 @@ function Png.decodeFromFile(filename, req_n)
     state[0].info_raw.bitdepth = 8
 
     -- Inspect the PNG data first, to see if we can avoid a color-type conversion
-    local err = lodepng.lodepng_inspect(width, height, state, ffi.cast("const unsigned char*", fdata), #fdata);
+    local err = lodepng.lodepng_inspect(width, height, state, ffi.cast("const unsigned char*", fdata), size);
     if err ~= 0 then
         return false, ffi.string(lodepng.lodepng_error_text(err))
     end
@@ -102,7 +108,7 @@ function Png.decodeFromFile(filename, req_n)
         return false, "requested an invalid number of color components"
     end
 
-    err = lodepng.lodepng_decode(ptr, width, height, state, ffi.cast("const unsigned char*", fdata), #fdata)
+    err = lodepng.lodepng_decode(ptr, width, height, state, ffi.cast("const unsigned char*", fdata), size)
     lodepng.lodepng_state_cleanup(state)
     if err ~= 0 then
         return false, ffi.string(lodepng.lodepng_error_text(err))
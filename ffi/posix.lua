@@ -22,6 +22,51 @@ function posix.lseek(fd, offset, whence)
     return ret
 end
 
+-- Files smaller than that are read by mmapFile, mapping them isn't worth it.
+posix.mmap_min_size = 256 * 1024
+
+-- Maps a whole file read-only: its pages are backed by the file itself, so
+-- unlike a Lua string holding a copy, they can be dropped and reloaded by the
+-- kernel under memory pressure. Returns the mapping, which is unmapped on
+-- garbage collection if munmap isn't called first, and its size.
+-- Small files are read into a Lua string instead. Mind that a mapped file
+-- truncated underneath us (e.g., removed storage) gets the process a SIGBUS.
+function posix.mmapFile(path)
+    local fd = posix.open(path, bit.bor(C.O_RDONLY, C.O_CLOEXEC))
+    local size = C.lseek(fd, 0, C.SEEK_END)
+    if size <= 0 then
+        local err = size < 0 and strerror() or "empty file"
+        C.close(fd)
+        error("mmap: "..err)
+    end
+    size = tonumber(size)
+    if size < posix.mmap_min_size then
+        local buf = ffi.new("uint8_t[?]", size)
+        local ok, count = pcall(function()
+            posix.lseek(fd, 0)
+            return posix.read(fd, buf, size, true)
+        end)
+        C.close(fd)
+        if not ok then
+            error(count, 0)
+        end
+        return ffi.string(buf, size), size
+    end
+    local map = C.mmap(nil, size, C.PROT_READ, C.MAP_PRIVATE, fd, 0)
+    local err = ffi.cast("intptr_t", map) == C.MAP_FAILED and strerror()
+    C.close(fd)
+    if err then
+        error("mmap: "..err)
+    end
+    return ffi.gc(ffi.cast("const unsigned char *", map), function(p) C.munmap(ffi.cast("void *", p), size) end), size
+end
+
+-- Releases what mmapFile returned (a no-op for the files it read)
+function posix.munmap(map, size)
+    if type(map) == "string" then return end
+    C.munmap(ffi.cast("void *", ffi.gc(map, nil)), size)
+end
+
 function posix.open(path, flags, mode)
     local fd = C.open(path, flags or C.O_RDONLY, mode and ffi.cast("mode_t", mode))
     if fd < 0 then
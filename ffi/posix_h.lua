@@ -1226,6 +1226,7 @@ end
 ffi.cdef[[
 static const int MAP_FAILED = -1;
 static const unsigned MAP_SHARED = 1;
+static const unsigned MAP_PRIVATE = 2;
 static const unsigned PROT_READ = 1;
 static const unsigned PROT_WRITE = 2;
 void *mmap(void *, size_t, int, int, int, off_t);
@@ -63,6 +63,10 @@ enum TJPARAM {
   TJPARAM_SAVEMARKERS,
 };
 typedef void *tjhandle;
+typedef struct {
+  int num;
+  int denom;
+} tjscalingfactor;
 tjhandle tj3Init(int);
 tjhandle tj3InitVersion(int, int);
 int tj3Set(tjhandle, int, int);
@@ -71,6 +75,8 @@ char *tj3GetErrorStr(tjhandle);
 int tj3Compress8(tjhandle, const unsigned char *, int, int, int, int, unsigned char **, size_t *);
 int tj3DecompressHeader(tjhandle, const unsigned char *, size_t);
 int tj3Decompress8(tjhandle, const unsigned char *, size_t, unsigned char *, int, int);
+tjscalingfactor *tj3GetScalingFactors(int *);
+int tj3SetScalingFactor(tjhandle, tjscalingfactor);
 void tj3Destroy(tjhandle);
 int tj3SaveImage8(tjhandle, const char *, const unsigned char *, int, int, int, int);
 void tj3Free(void *);
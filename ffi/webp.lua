@@ -8,23 +8,38 @@ This is a LuaJIT FFI wrapper for libwebp.
 
 local ffi = require("ffi")
 local BB = require("ffi/blitbuffer")
+local posix = require("ffi/posix")
+
+local P_ColorRGB32 = ffi.typeof("ColorRGB32*")
 
 require("ffi/libwebp_h")
 
--- local libwebp = ffi.loadlib("webp", "7")
--- We only need the stuff provided by libwebpdemux.so (which itself uses libwebp.so)
+-- Still images are decoded (and scaled) by libwebp.so, animations by libwebpdemux.so (which itself uses libwebp.so)
+local libwebp = ffi.loadlib("webp", "7")
 local libwebpdemux = ffi.loadlib("webpdemux", "2")
 
 local Webp = {
-    webp_decoder = nil,
-    webp_image = nil,
+    demuxer = nil,
     width = nil,
     height = nil,
     components = 4, -- always RGB32
     nb_frames = nil,
+    -- per frame (1-based): geometry, dispose & blend methods, and compressed data
+    frames = nil,
+    -- composited frame cur_frame, see Webp:getFrameImage()
+    canvas = nil,
     cur_frame = nil,
+    -- a few recently composited frames, by number, and their recency
+    frame_cache = nil,
+    frame_cache_order = nil,
 }
 
+-- How many composited frames (on top of the current one) we keep around,
+-- so that going back and forth between a few frames doesn't decode anything.
+-- Only frames that took more than one frame decode to get to are kept:
+-- playing forward never copies anything into it.
+Webp.frame_cache_size = 4
+
 function Webp:new(o)
     o = o or {}
     setmetatable(o, self)
@@ -33,106 +48,305 @@ function Webp:new(o)
 end
 
 function Webp.fromFile(filename)
-    local fh = io.open(filename, "rb")
-    assert(fh, "couldn't open WebP file")
-    local data = fh:read("*a")
-    fh:close()
-    return Webp.fromData(data)
+    -- The decoder reads from a mapping of the file (or a copy of a small one),
+    -- that we keep until close(), or until we're garbage collected
+    local ok, data, size = pcall(posix.mmapFile, filename)
+    assert(ok, "couldn't open WebP file")
+    local webp
+    ok, webp = pcall(Webp.fromData, data, size, true)
+    if not ok then
+        posix.munmap(data, size)
+        error(webp, 0)
+    end
+    return webp
 end
 
-function Webp.fromData(data, size)
+-- With mapped, data is a file mapping (see fromFile) that the returned object takes over.
+function Webp.fromData(data, size, mapped)
     local webp_data = ffi.new("WebPData[1]")
     webp_data[0].bytes = ffi.cast("const unsigned char*", data)
     webp_data[0].size = size or #data
 
-    -- Note: WebPAnimDecoderOptionsInit() and WebPAnimDecoderNew() are inline functions in demux.h.
-    -- We need to use their ...Internal() versions.
-    local dec_options = ffi.new("WebPAnimDecoderOptions[1]")
-    local ret = libwebpdemux.WebPAnimDecoderOptionsInitInternal(dec_options, libwebpdemux.WEBP_DEMUX_ABI_VERSION);
-    assert(ret ~= 0, "libwebp WebPAnimDecoderOptionsInit() failed.")
-    dec_options[0].color_mode = libwebpdemux.MODE_RGBA
-
-    local decoder = libwebpdemux.WebPAnimDecoderNewInternal(webp_data, dec_options, libwebpdemux.WEBP_DEMUX_ABI_VERSION)
+    -- Note: WebPDemux() is an inline function in demux.h.
+    -- We need to use its ...Internal() version.
+    local demuxer = libwebpdemux.WebPDemuxInternal(webp_data, 0, nil, libwebpdemux.WEBP_DEMUX_ABI_VERSION)
     -- check for nil for "NULL in case of parsing error, invalid option or memory error"
-    assert(decoder ~= nil, "libwebp WebPAnimDecoderNew() failed (parsing or memory error).")
-
-    local anim_info = ffi.new("WebPAnimInfo[1]")
-    ret = libwebpdemux.WebPAnimDecoderGetInfo(decoder, anim_info)
-    assert(ret ~= 0, "libwebp WebPAnimDecoderGetInfo() failed.")
+    assert(demuxer ~= nil, "libwebp WebPDemux() failed (parsing or memory error).")
 
-    if anim_info[0].frame_count > 1 and type(data) ~= "string" then
+    local nb_frames = libwebpdemux.WebPDemuxGetI(demuxer, libwebpdemux.WEBP_FF_FRAME_COUNT)
+    if nb_frames > 1 and type(data) ~= "string" and not mapped then
         -- When called from CreDocument:getImageFromPosition(), data is a "userdata" wrapping
         -- a buffer malloc()'ed by cre.cpp, which is freed as soon as getImageFromPosition()
         -- returns, as we usually don't need it after having rendered the image data to
         -- a blitbuffer.
-        -- With animated multiframes images, we keep the decoder object: GifLib is fine with
+        -- With animated multiframes images, we keep the demuxer object: GifLib is fine with
         -- data being gone, but libwebp is not.
         -- We could have renderImageData() return a flag to state that the data should not
         -- be free()d, but it would complexify the return values and their handling.
         -- So, keep it simple: make a copy of the external buffer into an interned Lua
         -- string, that we will keep alive.
-        libwebpdemux.WebPAnimDecoderDelete(decoder) -- give up with current decoder
+        libwebpdemux.WebPDemuxDelete(demuxer) -- give up with current demuxer
         data = ffi.string(data, size)
         -- And call again this same function, now with data a real Lua string.
         return Webp.fromData(data, size)
     end
 
+    local width = libwebpdemux.WebPDemuxGetI(demuxer, libwebpdemux.WEBP_FF_CANVAS_WIDTH)
+    local height = libwebpdemux.WebPDemuxGetI(demuxer, libwebpdemux.WEBP_FF_CANVAS_HEIGHT)
+
+    -- Index the frames, and flag the keyframes (the ones that don't depend on what was
+    -- drawn before them), with the same rules as libwebp's WebPAnimDecoder.
+    local frames = {}
+    local iter = ffi.new("WebPIterator")
+    for i = 1, nb_frames do
+        if libwebpdemux.WebPDemuxGetFrame(demuxer, i, iter) == 0 then
+            libwebpdemux.WebPDemuxDelete(demuxer)
+            error("libwebp WebPDemuxGetFrame() failed.")
+        end
+        local frame = {
+            x = iter.x_offset,
+            y = iter.y_offset,
+            w = iter.width,
+            h = iter.height,
+            dispose_background = iter.dispose_method == libwebpdemux.WEBP_MUX_DISPOSE_BACKGROUND,
+            blend = iter.has_alpha ~= 0 and iter.blend_method == libwebpdemux.WEBP_MUX_BLEND,
+            -- (points into data, that we keep alive)
+            bytes = iter.fragment.bytes,
+            size = iter.fragment.size,
+        }
+        frame.full = frame.w == width and frame.h == height
+        local prev = frames[i-1]
+        frame.keyframe = i == 1 or (not frame.blend and frame.full)
+            or (prev.dispose_background and (prev.full or prev.keyframe))
+        frames[i] = frame
+    end
+    libwebpdemux.WebPDemuxReleaseIterator(iter)
+
     return Webp:new{
-        webp_decoder = decoder,
-        -- (We don't need to keep webp_data and dec_options alive, which just got
-        -- their values read and used and are not stored in the above objects.)
-        nb_frames = anim_info[0].frame_count,
-        width = anim_info[0].canvas_width,
-        height = anim_info[0].canvas_height,
-        -- we need to keep this interned Lua string alive as long as decoder is alive.
+        demuxer = demuxer,
+        -- (We don't need to keep webp_data alive, which just got its values read
+        -- and used and is not stored in the above object.)
+        nb_frames = nb_frames,
+        width = width,
+        height = height,
+        frames = frames,
+        -- we need to keep this interned Lua string alive as long as demuxer is alive.
         -- (To not be bothered with large binary data when using logger(webp), we don't
         -- store the string itself, but a function referencing it as an upvalue, as
         -- functions are just dumped as their address by logger.)
         _input_data_holder = function() return data end,
+        _mapped_size = mapped and size or nil,
     }
 end
 
+--[[--
+Decodes a still WebP image from memory, scaled while decoding to fit in max_w x max_h.
+
+Returns nil for animations (use fromData), or the RGB32 blitbuffer and the
+original width and height of the image.
+--]]
+function Webp.decodeToSize(data, size, max_w, max_h)
+    local bytes = ffi.cast("const uint8_t*", data)
+    size = size or #data
+    local config = ffi.new("WebPDecoderConfig")
+    assert(libwebp.WebPInitDecoderConfigInternal(config, libwebp.WEBP_DECODER_ABI_VERSION) ~= 0,
+        "libwebp WebPInitDecoderConfig() failed.")
+    if libwebp.WebPGetFeaturesInternal(bytes, size, config.input, libwebp.WEBP_DECODER_ABI_VERSION) ~= libwebp.VP8_STATUS_OK then
+        error("libwebp WebPGetFeatures() failed (not a WebP image?).")
+    end
+    if config.input.has_animation ~= 0 then
+        return
+    end
+    local width, height = config.input.width, config.input.height
+    local scale = math.min(max_w / width, max_h / height, 1)
+    local scaled_w = math.max(1, math.floor(width * scale + 0.5))
+    local scaled_h = math.max(1, math.floor(height * scale + 0.5))
+    if scale < 1 then
+        config.options.use_scaling = 1
+        config.options.scaled_width = scaled_w
+        config.options.scaled_height = scaled_h
+    end
+    -- Decode straight into our blitbuffer
+    local bb = BB.new(scaled_w, scaled_h, BB.TYPE_BBRGB32)
+    config.output.colorspace = libwebp.MODE_RGBA
+    config.output.is_external_memory = 1
+    config.output.u.RGBA.rgba = ffi.cast("uint8_t*", bb.data)
+    config.output.u.RGBA.stride = bb.stride
+    config.output.u.RGBA.size = bb.stride * scaled_h
+    local ret = libwebp.WebPDecode(bytes, size, config)
+    libwebp.WebPFreeDecBuffer(config.output)
+    if ret ~= libwebp.VP8_STATUS_OK then
+        bb:free()
+        error(string.format("libwebp WebPDecode() failed (status %d).", tonumber(ret)))
+    end
+    return bb, width, height
+end
+
+-- Clears a rectangle of the canvas to transparent
+local function clearRect(canvas, x, y, w, h)
+    local data = ffi.cast("uint8_t*", canvas.data)
+    for j = y, y+h-1 do
+        ffi.fill(data + j * canvas.stride + x * 4, w * 4)
+    end
+end
+
+-- Blends src (RGBA, not premultiplied) over the canvas at x, y, as libwebp's WebPAnimDecoder does
+local function blendRect(canvas, src, x, y)
+    local floor = math.floor
+    for j = 0, src.h-1 do
+        local s = ffi.cast(P_ColorRGB32, ffi.cast("uint8_t*", src.data) + j * src.stride)
+        local d = ffi.cast(P_ColorRGB32, ffi.cast("uint8_t*", canvas.data) + (y + j) * canvas.stride) + x
+        for i = 0, src.w-1 do
+            local src_a = s[i].alpha
+            if src_a == 255 then
+                d[i] = s[i]
+            elseif src_a ~= 0 then
+                local dst_factor_a = floor(d[i].alpha * (256 - src_a) / 256)
+                local blend_a = src_a + dst_factor_a
+                local scale = floor(16777216 / blend_a)
+                d[i].r = floor((s[i].r * src_a + d[i].r * dst_factor_a) * scale / 16777216)
+                d[i].g = floor((s[i].g * src_a + d[i].g * dst_factor_a) * scale / 16777216)
+                d[i].b = floor((s[i].b * src_a + d[i].b * dst_factor_a) * scale / 16777216)
+                d[i].alpha = blend_a
+            end
+        end
+    end
+end
+
+-- Decodes a frame into buffer (whose top-left pixel is at ptr)
+local function decodeFrame(frame, ptr, stride)
+    local config = ffi.new("WebPDecoderConfig")
+    assert(libwebp.WebPInitDecoderConfigInternal(config, libwebp.WEBP_DECODER_ABI_VERSION) ~= 0,
+        "libwebp WebPInitDecoderConfig() failed.")
+    config.output.colorspace = libwebp.MODE_RGBA
+    config.output.is_external_memory = 1
+    config.output.u.RGBA.rgba = ptr
+    config.output.u.RGBA.stride = stride
+    config.output.u.RGBA.size = stride * (frame.h - 1) + frame.w * 4
+    local ret = libwebp.WebPDecode(frame.bytes, frame.size, config)
+    libwebp.WebPFreeDecBuffer(config.output)
+    assert(ret == libwebp.VP8_STATUS_OK, "libwebp WebPDecode() failed (parsing or decoding error).")
+end
+
+-- Draws frame number over the canvas holding frame number-1 (or anything, for a keyframe)
+function Webp:compositeFrame(number)
+    local canvas = self.canvas
+    local frame = self.frames[number]
+    if frame.keyframe then
+        ffi.fill(canvas.data, tonumber(canvas.stride * canvas.h))
+    else
+        local prev = self.frames[number-1]
+        if prev.dispose_background then
+            clearRect(canvas, prev.x, prev.y, prev.w, prev.h)
+        end
+    end
+    if frame.blend and not frame.keyframe then
+        local scratch = self.scratch
+        if not scratch or scratch.w < frame.w or scratch.h < frame.h then
+            if scratch then scratch:free() end
+            scratch = BB.new(frame.w, frame.h, BB.TYPE_BBRGB32)
+            self.scratch = scratch
+        end
+        local src = scratch:viewport(0, 0, frame.w, frame.h)
+        decodeFrame(frame, ffi.cast("uint8_t*", src.data), src.stride)
+        blendRect(canvas, src, frame.x, frame.y)
+    else
+        decodeFrame(frame, ffi.cast("uint8_t*", canvas.data) + frame.y * canvas.stride + frame.x * 4, canvas.stride)
+    end
+end
+
+--[[--
+Returns the canvas as it is once frame number is drawn.
+
+We keep the last composited frame, so that playing forward only decodes one new frame,
+and, when seeking elsewhere, restart from the nearest keyframe at or before the requested
+one (a frame that doesn't depend on what was drawn before it), instead of from the
+first frame. A few recent frames that were costly to get to (seeking backward, or far
+from their keyframe) are also kept in frame_cache.
+
+With no_copy, the returned blitbuffer is only valid until the next call.
+--]]
 function Webp:getFrameImage(number, no_copy)
     if number < 1 then number = 1 end
     if number > self.nb_frames then number = self.nb_frames end
 
-    if not self.webp_image then
-        self.webp_image = ffi.new("unsigned char*[1]")
-        -- WebPAnimDecoderGetNext() will update this pointer with the
-        -- address of one of its two internal bitmap data buffers.
-        -- As such, it is only valid until the next call.
-    end
-    if not self.cur_frame then
-        self.cur_frame = 0
-    end
-    if number < self.cur_frame then
-        libwebpdemux.WebPAnimDecoderReset(self.webp_decoder) -- Rewind to start
-        self.cur_frame = 0
-        -- Note: browsing frames forward is fast, but because of this, browsing
-        -- late frames backward can be noticeably slower.
-    end
-    -- Render all frames from cur_frame to the one requested (this is needed as
-    -- webp frames can be partial and need to be blended over the previous frame)
-    local timestamp = ffi.new("int[1]") -- not used by us
-    while self.cur_frame < number do
-        local ret = libwebpdemux.WebPAnimDecoderGetNext(self.webp_decoder, self.webp_image, timestamp)
-        assert(ret ~= 0, "libwebp WebPAnimDecoderGetNext() failed (parsing or decoding error, or no more frames).")
-        self.cur_frame = self.cur_frame + 1
-    end
-    local image_bb = BB.new(self.width, self.height, BB.TYPE_BBRGB32, self.webp_image[0])
+    local image_bb = self.frame_cache and self.frame_cache[number]
+    if image_bb then
+        -- Most recently used last
+        local order = self.frame_cache_order
+        for i = 1, #order do
+            if order[i] == number then
+                table.remove(order, i)
+                break
+            end
+        end
+        table.insert(order, number)
+    else
+        if not self.canvas then
+            self.canvas = BB.new(self.width, self.height, BB.TYPE_BBRGB32)
+            self.cur_frame = 0
+            self.frame_cache = {}
+            self.frame_cache_order = {}
+        end
+        local keyframe = number
+        while not self.frames[keyframe].keyframe do
+            keyframe = keyframe - 1
+        end
+        if self.cur_frame > number or self.cur_frame < keyframe - 1 then
+            -- Restart from the keyframe
+            self.cur_frame = keyframe - 1
+        end
+        -- Render all frames from cur_frame to the one requested (this is needed as
+        -- webp frames can be partial and need to be blended over the previous frame)
+        local composited = number - self.cur_frame
+        while self.cur_frame < number do
+            self.cur_frame = self.cur_frame + 1
+            self:compositeFrame(self.cur_frame)
+        end
+        image_bb = self.canvas
+        if composited > 1 and self.frame_cache_size > 0 then
+            local order = self.frame_cache_order
+            if #order >= self.frame_cache_size then
+                local oldest = table.remove(order, 1)
+                self.frame_cache[oldest]:free()
+                self.frame_cache[oldest] = nil
+            end
+            self.frame_cache[number] = image_bb:copy()
+            table.insert(order, number)
+        end
+    end
     if no_copy then
         -- If the caller doesn't need this bb to live after next frame image is called,
         -- or if it does some scaling or a copy itself, it can provide no_copy=true.
-        return image_bb
+        return BB.new(self.width, self.height, BB.TYPE_BBRGB32, image_bb.data, image_bb.stride)
     end
-    -- Otherwise, make a copy of the internal libwebp image buffer
+    -- Otherwise, make a copy of our buffer
     return image_bb:copy()
 end
 
 function Webp:close()
-    libwebpdemux.WebPAnimDecoderDelete(self.webp_decoder)
-    self.webp_image = nil
-    self.webp_decoder = nil
+    if self.frame_cache then
+        for _, bb in pairs(self.frame_cache) do
+            bb:free()
+        end
+        self.frame_cache = nil
+        self.frame_cache_order = nil
+    end
+    if self.canvas then
+        self.canvas:free()
+        self.canvas = nil
+    end
+    if self.scratch then
+        self.scratch:free()
+        self.scratch = nil
+    end
+    libwebpdemux.WebPDemuxDelete(self.demuxer)
+    if self._mapped_size then
+        posix.munmap(self._input_data_holder(), self._mapped_size)
+        self._mapped_size = nil
+    end
+    self.demuxer = nil
+    self.frames = nil
     self._input_data_holder = nil
 end
 
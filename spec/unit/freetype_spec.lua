@@ -8,4 +8,18 @@ describe("Freetype module", function()
             assert.are_not.equals(ftsize, nil)
         end)
     end)
+    it("should get glyphs from the glyph atlas", function()
+        local ftsize = Freetype.newFaceSize('./fonts/droid/DroidSansMono.ttf', 18)
+        local rendered = ftsize:renderGlyphByIndex(36)
+        local glyph = ftsize:getGlyphFromAtlas(36)
+        assert.are.equals(rendered.bb:getWidth(), glyph.bb:getWidth())
+        assert.are.equals(rendered.bb:getHeight(), glyph.bb:getHeight())
+        assert.are.equals(rendered.l, glyph.l)
+        assert.are.equals(rendered.t, glyph.t)
+        assert.are.equals(rendered.ax, glyph.ax)
+        -- Second lookup is served from the atlas, at the same place
+        assert.are.equals(glyph.bb.data, ftsize:getGlyphFromAtlas(36).bb.data)
+        rendered.bb:free()
+        Freetype.clearGlyphAtlas()
+    end)
 end)
@@ -79,6 +79,25 @@ describe("KOPTContext module", function()
         assert(kc.dst.size_allocated ~= 0)
         assert.are_not.same({kc.dst.width, kc.dst.height}, {0, 0})
     end)
+    it("should render the page straight into the source bitmap", function()
+        local kc = KOPTContext.new()
+        local page = sample_pdf_doc:openPage(2)
+        page:toBmp(kc.src, 150)
+        page:close()
+        assert.equals(kc.src.bpp, 8)
+        assert.are_not.same({kc.src.width, kc.src.height}, {0, 0})
+        k2pdfopt.k2pdfopt_reflow_bmp(kc)
+        local view = kc:dstView()
+        local copy = kc:dstToBlitBuffer()
+        assert.are.same({view:getWidth(), view:getHeight()}, {kc.dst.width, kc.dst.height})
+        assert.equals(ffi.cast("void *", view.data), ffi.cast("void *", kc.dst.data))
+        for y = 0, view:getHeight() - 1, 97 do
+            for x = 0, view:getWidth() - 1, 89 do
+                assert.equals(view:getPixel(x, y):getColor8().a, copy:getPixel(x, y):getColor8().a)
+            end
+        end
+        copy:free()
+    end)
     it("should get larger reflowed page with larger original page", function()
         local kc1 = KOPTContext.new()
         local kc2 = KOPTContext.new()
@@ -90,6 +109,55 @@ describe("KOPTContext module", function()
         k2pdfopt.k2pdfopt_reflow_bmp(kc2)
         assert(kc1.dst.height < kc2.dst.height)
     end)
+    it("should reflow several pages in parallel", function()
+        local contexts, expected = {}, {}
+        for pageno = 2, 4 do
+            local page = sample_pdf_doc:openPage(pageno)
+            local kc = KOPTContext.new()
+            page:toBmp(kc.src, 150)
+            table.insert(contexts, kc)
+            kc = KOPTContext.new()
+            page:toBmp(kc.src, 150)
+            k2pdfopt.k2pdfopt_reflow_bmp(kc)
+            table.insert(expected, kc)
+            page:close()
+        end
+        local reflowed = KOPTContext.reflowPages(contexts, 2)
+        for i = 1, #expected do
+            assert.are.same({reflowed[i].dst.width, reflowed[i].dst.height},
+                            {expected[i].dst.width, expected[i].dst.height})
+            local bb, expected_bb = reflowed[i]:dstView(), expected[i]:dstView()
+            assert.are.same(ffi.string(bb.data, bb.stride * bb.h),
+                            ffi.string(expected_bb.data, expected_bb.stride * expected_bb.h))
+            assert.are.same({reflowed[i].src.width, reflowed[i].src.height},
+                            {expected[i].src.width, expected[i].src.height})
+            assert(contexts[i].src.data == nil)
+            reflowed[i]:free()
+            expected[i]:free()
+        end
+    end)
+    it("should reflow pages in process when it can't fork", function()
+        local util = require("ffi/util")
+        local page = sample_pdf_doc:openPage(2)
+        local kc, expected = KOPTContext.new(), KOPTContext.new()
+        page:toBmp(kc.src, 150)
+        page:toBmp(expected.src, 150)
+        page:close()
+        k2pdfopt.k2pdfopt_reflow_bmp(expected)
+        local runInSubProcess = util.runInSubProcess
+        util.runInSubProcess = function() return false, "failed forking" end
+        local ok, reflowed = pcall(KOPTContext.reflowPages, {kc})
+        util.runInSubProcess = runInSubProcess
+        assert.True(ok)
+        local bb, expected_bb = reflowed[1]:dstView(), expected:dstView()
+        assert.are.same(ffi.string(bb.data, bb.stride * bb.h),
+                        ffi.string(expected_bb.data, expected_bb.stride * expected_bb.h))
+        assert(kc.src.data == nil)
+        assert(reflowed[1].src.data ~= nil)
+        reflowed[1]:free()
+        expected:free()
+        kc:free()
+    end)
     it("should get reflowed word boxes", function()
         local kc = KOPTContext.new()
         local page = sample_pdf_doc:openPage(3)
@@ -104,6 +172,34 @@ describe("KOPTContext module", function()
             end
         end
     end)
+    it("should get word boxes as flat arrays", function()
+        local kc = KOPTContext.new()
+        local page = sample_pdf_doc:openPage(3)
+        page:toBmp(kc.src, 150)
+        page:close()
+        k2pdfopt.k2pdfopt_reflow_bmp(kc)
+        local flat = kc:getWordBoxesFlat("dst", 0, 0, kc.dst.width, kc.dst.height, 0)
+        local boxes, nr_word = kc:getReflowedWordBoxes("dst", 0, 0, kc.dst.width, kc.dst.height)
+        assert.equals(flat.n, nr_word)
+        assert.equals(flat.nlines, #boxes)
+        assert.True(flat.n > 0)
+        for i = 0, flat.n - 1 do
+            local line = boxes[flat.words[i*5+4] + 1]
+            assert.True(flat.words[i*5] >= line.x0 and flat.words[i*5+2] <= line.x1)
+            assert.True(flat.words[i*5+1] >= line.y0 and flat.words[i*5+3] <= line.y1)
+        end
+        -- only cached when asked to
+        assert.are_not.equals(flat, kc:getWordBoxesFlat("dst", 0, 0, kc.dst.width, kc.dst.height, 0))
+        flat = kc:getWordBoxesFlat("dst", 0, 0, kc.dst.width, kc.dst.height, 0, true)
+        assert.equals(flat, kc:getWordBoxesFlat("dst", 0, 0, kc.dst.width, kc.dst.height, 0, true))
+        kc:invalidateWordBoxes()
+        assert.are_not.equals(flat, kc:getWordBoxesFlat("dst", 0, 0, kc.dst.width, kc.dst.height, 0, true))
+        flat = kc:getWordBoxesFlat("dst", 0, 0, kc.dst.width, kc.dst.height, 0, true)
+        -- reflowing again, even into the same buffer, drops them
+        kc:reflow()
+        assert.are_not.equals(flat, kc:getWordBoxesFlat("dst", 0, 0, kc.dst.width, kc.dst.height, 0, true))
+        kc:free()
+    end)
     it("should get native word boxes", function()
         local kc = KOPTContext.new()
         local page = sample_pdf_doc:openPage(4)
@@ -143,11 +239,112 @@ describe("KOPTContext module", function()
                 end
             end
         end)
+        it("transform positions like a linear scan of the rectmaps", function()
+            local function closest(distance)
+                local m = 0
+                for i = 0, kc.rectmaps.n - 1 do
+                    if distance(kc.rectmaps.wrectmap + m) > distance(kc.rectmaps.wrectmap + i) then
+                        m = i
+                    end
+                end
+                return kc.rectmaps.wrectmap + m
+            end
+            local xs, ys = {}, {}
+            for j = 0, 800, 37 do
+                for i = 0, 600, 41 do
+                    table.insert(xs, i)
+                    table.insert(ys, j)
+                end
+            end
+            local rxs, rys = kc:nativeToReflowPosTransforms(xs, ys)
+            local nxs, nys = kc:reflowToNativePosTransforms(xs, ys, 0.5, 0.5)
+            for k = 1, #xs do
+                local x0, y0 = (xs[k] - kc.bbox.x0) * kc.zoom, (ys[k] - kc.bbox.y0) * kc.zoom
+                local rectmap = closest(function(wrmap)
+                    local x = wrmap.coords[0].x*kc.dev_dpi*kc.quality/wrmap.srcdpiw
+                    local y = wrmap.coords[0].y*kc.dev_dpi*kc.quality/wrmap.srcdpih
+                    local w = wrmap.coords[2].x*kc.dev_dpi*kc.quality/wrmap.srcdpiw
+                    local h = wrmap.coords[2].y*kc.dev_dpi*kc.quality/wrmap.srcdpih
+                    if x <= x0 and y <= y0 and x + w >= x0 and y + h >= y0 then return 0 end
+                    local x1, y1 = x + w/2, y + h/2
+                    return (x0 - x1)*(x0 - x1) + (y0 - y1)*(y0 - y1)
+                end)
+                assert.are.same({rxs[k], rys[k]}, {rectmap.coords[1].x + rectmap.coords[2].x/2,
+                                                   rectmap.coords[1].y + rectmap.coords[2].y/2})
+                rectmap = closest(function(wrmap)
+                    if k2pdfopt.wrectmap_inside(wrmap, xs[k], ys[k]) ~= 0 then return 0 end
+                    local x1 = wrmap.coords[1].x + wrmap.coords[2].x / 2
+                    local y1 = wrmap.coords[1].y + wrmap.coords[2].y / 2
+                    return (xs[k] - x1)*(xs[k] - x1) + (ys[k] - y1)*(ys[k] - y1)
+                end)
+                assert.are.same({nxs[k], nys[k]}, {
+                    (rectmap.coords[0].x*kc.dev_dpi*kc.quality/rectmap.srcdpiw
+                        + rectmap.coords[2].x*kc.dev_dpi*kc.quality/rectmap.srcdpiw*0.5)/kc.zoom + kc.bbox.x0,
+                    (rectmap.coords[0].y*kc.dev_dpi*kc.quality/rectmap.srcdpih
+                        + rectmap.coords[2].y*kc.dev_dpi*kc.quality/rectmap.srcdpih*0.5)/kc.zoom + kc.bbox.y0,
+                })
+            end
+        end)
+        it("rebuild the rectmaps index when reflowing again", function()
+            local kc2 = KOPTContext.new()
+            local page5 = sample_pdf_doc:openPage(5)
+            page5:toBmp(kc2.src, 300)
+            page5:close()
+            kc2:reflow()
+            -- builds the index for page 5
+            kc2:nativeToReflowPosTransform(300, 400)
+            local page6 = sample_pdf_doc:openPage(6)
+            page6:toBmp(kc2.src, 300)
+            page6:close()
+            kc2:reflow()
+            local fresh = KOPTContext.new()
+            k2pdfopt.bmp_copy(fresh.src, kc2.src)
+            fresh:reflow()
+            assert.are.same({fresh:nativeToReflowPosTransform(300, 400)}, {kc2:nativeToReflowPosTransform(300, 400)})
+            fresh:free()
+            kc2:free()
+        end)
         it("get OCR word from tesseract OCR engine", function()
             local word = kc:getTOCRWord("dst", 280, 60, 100, 40, "data/tessdata", "eng", 3, 0, 0, 300)
             assert.are_same(word, "Alice")
             kc:freeOCR()
         end)
+        it("OCR a whole page with tesseract and cache the result", function()
+            local cache_dir = os.getenv("KO_HOME")
+            local ocr = kc:getPageOCR("dst", 0, 0, kc.dst.width, kc.dst.height, "data/tessdata", "eng", 3, 300, cache_dir)
+            assert.True(ocr.n > 0)
+            assert.equals(ocr.n, #ocr.texts)
+            local recognized = 0
+            for i = 1, ocr.n do
+                if ocr.texts[i] then recognized = recognized + 1 end
+            end
+            assert.True(recognized > 0)
+            kc:freeOCR()
+            local cached = kc:getPageOCR("dst", 0, 0, kc.dst.width, kc.dst.height, "data/tessdata", "eng", 3, 300, cache_dir)
+            assert.are.same(ocr.texts, cached.texts)
+            assert.equals(ffi.string(ocr.words, ocr.n * 5 * 4), ffi.string(cached.words, cached.n * 5 * 4))
+            -- a cache file that doesn't add up is ignored
+            for f in require("libs/libkoreader-lfs").dir(cache_dir) do
+                if f:match("%.ocr$") then
+                    local file = io.open(cache_dir .. "/" .. f, "wb")
+                    file:write(require("ffi/bitser").dumps({ n = 100000, words = "", nlines = 0, lines = "", texts = {} }))
+                    file:close()
+                end
+            end
+            cached = kc:getPageOCR("dst", 0, 0, kc.dst.width, kc.dst.height, "data/tessdata", "eng", 3, 300, cache_dir)
+            assert.are.same(ocr.texts, cached.texts)
+            -- another datadir gets a cache file of its own
+            kc:getPageOCR("dst", 0, 0, kc.dst.width, kc.dst.height, "data/tessdata/", "eng", 3, 300, cache_dir)
+            kc:freeOCR()
+            local nr_files = 0
+            for f in require("libs/libkoreader-lfs").dir(cache_dir) do
+                if f:match("%.ocr$") then
+                    nr_files = nr_files + 1
+                    os.remove(cache_dir .. "/" .. f)
+                end
+            end
+            assert.equals(2, nr_files)
+        end)
     end)
     describe("should", function()
         local kc, page
@@ -157,6 +354,50 @@ describe("KOPTContext module", function()
             page:toBmp(kc.src, 150)
             page:close()
         end)
+        it("cache auto bbox and page blocks", function()
+            local util = require("ffi/util")
+            local cache_dir = os.getenv("KO_HOME") .. "/layout"
+            local cache = KOPTContext.openLayoutCache(cache_dir, "paper")
+            local kc1 = KOPTContext.new()
+            local pdf_page = paper_pdf_doc:openPage(1)
+            pdf_page:getPagePix(kc1)
+            pdf_page:close()
+            assert.is_false(kc1:hasCachedLayout(cache, 1, "blocks"))
+            kc1:findPageBlocks(cache, 1)
+            local bbox = {kc1:getAutoBBox(cache, 1)}
+            -- nothing rendered, all from the cache
+            local kc2 = KOPTContext.new()
+            assert.is_true(kc2:hasCachedLayout(cache, 1, "bbox"))
+            assert.is_true(kc2:hasCachedLayout(cache, 1, "blocks"))
+            kc2:findPageBlocks(cache, 1)
+            kc2:setWritingDirection(1)
+            assert.are.same(bbox, {kc2:getAutoBBox(cache, 1)})
+            -- left as a detection would have
+            assert.are.same(kc1.writing_direction, kc2.writing_direction)
+            assert.are.same({kc1.page_width, kc1.page_height}, {kc2.page_width, kc2.page_height})
+            assert.are.same(kc1:getPageBlock(0.6, 0.5), kc2:getPageBlock(0.6, 0.5))
+            -- a truncated file is redone, not read past its end
+            for f in require("libs/libkoreader-lfs").dir(cache.dir) do
+                if f:match("%.blocks$") then
+                    local file = io.open(cache.dir .. "/" .. f, "rb")
+                    local data = file:read("*all")
+                    file:close()
+                    file = io.open(cache.dir .. "/" .. f, "wb")
+                    file:write(data:sub(1, #data - 4))
+                    file:close()
+                end
+            end
+            local kc3 = KOPTContext.new()
+            pdf_page = paper_pdf_doc:openPage(1)
+            pdf_page:getPagePix(kc3)
+            pdf_page:close()
+            kc3:findPageBlocks(cache, 1)
+            assert.are.same(kc1:getPageBlock(0.6, 0.5), kc3:getPageBlock(0.6, 0.5))
+            kc1:free()
+            kc2:free()
+            kc3:free()
+            util.purgeDir(cache_dir)
+        end)
         it("get page textblock at any relative location", function()
             kc.page_width, kc.page_height = kc.src.width, kc.src.height
             kc:findPageBlocks()
@@ -223,5 +464,38 @@ describe("KOPTContext module", function()
             kc:free()
             new_kc:free()
         end)
+        it("convert koptcontext to/from table through shared memory", function()
+            k2pdfopt.k2pdfopt_reflow_bmp(kc)
+            local kc_table = KOPTContext.totable(kc, true)
+            assert.truthy(kc_table.dst_shm)
+            assert.are.same(kc_table.dst_data, "")
+            local new_kc = KOPTContext.fromtable(kc_table)
+            assert.are.same({kc.dst.width, kc.dst.height}, {new_kc.dst.width, new_kc.dst.height})
+            -- adopted bitmaps stay out of k2pdfopt's reach until owned
+            assert(new_kc.dst.data == nil)
+            local bb, new_bb = kc:dstView(), new_kc:dstView()
+            assert.are.same(ffi.string(bb.data, bb.stride * bb.h),
+                            ffi.string(new_bb.data, new_bb.stride * new_bb.h))
+            new_kc:ownBitmaps()
+            assert(new_kc.dst.data ~= nil)
+            -- the view handed out earlier is still valid
+            assert.are.same(ffi.string(bb.data, bb.stride * bb.h),
+                            ffi.string(new_bb.data, new_bb.stride * new_bb.h))
+            local size = k2pdfopt.bmp_bytewidth(kc.src) * kc.src.height
+            assert.are.same(ffi.string(kc.src.data, size), ffi.string(new_kc.src.data, size))
+            kc:free()
+            new_kc:free()
+            assert(new_kc.dst.data == nil)
+        end)
+        it("should remove the shared memory files of a table never loaded", function()
+            local lfs = require("libs/libkoreader-lfs")
+            k2pdfopt.k2pdfopt_reflow_bmp(kc)
+            local kc_table = KOPTContext.totable(kc, true)
+            assert.truthy(lfs.attributes(kc_table.dst_shm, "mode"))
+            kc_table.__version__ = "0"
+            assert.has_error(function() KOPTContext.fromtable(kc_table) end)
+            assert.falsy(lfs.attributes(kc_table.dst_shm, "mode"))
+            kc:free()
+        end)
     end)
 end)
@@ -167,6 +167,36 @@ describe("mupdf module", function()
             )
             os.remove(out_pdf)
         end)
+        it("should append annotations to the document file", function()
+            local out_pdf = os.getenv("KO_HOME") .. "/simple-incremental.pdf"
+            local f = io.open(simple_pdf, "rb")
+            local original = f:read("*all")
+            f:close()
+            f = io.open(out_pdf, "wb")
+            f:write(original)
+            f:close()
+            local doc = M.openDocument(out_pdf)
+            assert.is_false(doc:saveIncremental())
+            local page = doc:openPage(1)
+            page:addMarkupAnnotation(annotation_quadpoints, 1, ffi.C.PDF_ANNOT_HIGHLIGHT)
+            page:addMarkupAnnotation(annotation_quadpoints, 1, ffi.C.PDF_ANNOT_UNDERLINE)
+            page:close()
+            assert.is_true(doc:hasUnsavedChanges())
+            assert.is_true(doc:saveIncremental())
+            assert.is_false(doc:hasUnsavedChanges())
+            doc:close()
+            f = io.open(out_pdf, "rb")
+            local saved = f:read("*all")
+            f:close()
+            assert.is_true(#saved > #original)
+            assert.are.equal(original, saved:sub(1, #original))
+            doc = M.openDocument(out_pdf)
+            page = doc:openPage(1)
+            assert.is_not_nil(page:getMarkupAnnotation(annotation_quadpoints, 1))
+            page:close()
+            doc:close()
+            os.remove(out_pdf)
+        end)
 
         describe("PDF page API", function()
             local page
@@ -201,6 +231,18 @@ describe("mupdf module", function()
                 assert.equals(math.floor(text[2][2].y0), 91)
                 assert.equals(math.floor(text[2][2].y1), 105)
             end)
+            it("should get page words as flat arrays", function()
+                local text = page:getPageText()
+                local words = page:getPageWords()
+                assert.equals(#words.word, #text[1] + #text[2])
+                local i = #words.word
+                assert.equals(words.word[i], "there!")
+                assert.equals(words.line[i], 2)
+                assert.equals(math.floor(words.x0[i]), 71)
+                assert.equals(math.floor(words.x1[i]), 99)
+                assert.equals(math.floor(words.y0[i]), 91)
+                assert.equals(math.floor(words.y1[i]), 105)
+            end)
             it("should get page hyperlinks", function()
                 local links = doc3:openPage(1):getPageLinks()
                 assert.equals(#links, 2)
@@ -249,6 +291,155 @@ describe("mupdf module", function()
         doc:close()
     end)
 
+    it("should render the same from a cached display list", function()
+        local ffi = require("ffi")
+        local BB = require("ffi/blitbuffer")
+        local doc = M.openDocument(sample_pdf)
+        local page = doc:openPage(1)
+        local dc = require("ffi/drawcontext").new()
+        dc:setZoom(0.5)
+        local bb = BB.new(300, 400, BB.TYPE_BB8)
+        page:draw(dc, bb, 0, 0)
+        assert.are.same(1, doc.display_lists:used_slots())
+        local first = ffi.string(bb.data, bb.stride * bb.h)
+        bb:fill(BB.COLOR_BLACK)
+        page:draw(dc, bb, 0, 0)
+        assert.are.same(1, doc.display_lists:used_slots())
+        assert.are.equal(first, ffi.string(bb.data, bb.stride * bb.h))
+        doc:cleanCache()
+        assert.are.same(0, doc.display_lists:used_slots())
+        doc:close()
+    end)
+
+    it("should render the same straight into the target blitbuffer", function()
+        local ffi = require("ffi")
+        local BB = require("ffi/blitbuffer")
+        local doc = M.openDocument(sample_pdf)
+        local page = doc:openPage(1)
+        local dc = require("ffi/drawcontext").new()
+        local expected = page:draw_new(dc, 300, 400, 0, 0)
+        -- same type: rendered in place
+        local bb = BB.new(300, 400, BB.TYPE_BB8)
+        page:draw(dc, bb, 0, 0)
+        assert.are.equal(ffi.string(expected.data, expected.stride * expected.h), ffi.string(bb.data, bb.stride * bb.h))
+        -- other type: rendered to scratch memory, then blitted
+        local bb24 = BB.new(300, 400, BB.TYPE_BBRGB24)
+        page:draw(dc, bb24, 0, 0)
+        assert.are.same(expected:getPixel(150, 200):getColor8().a, bb24:getPixel(150, 200):getColor8().a)
+        expected:free()
+        bb:free()
+        bb24:free()
+        doc:close()
+    end)
+
+    it("should render a preview before the full page", function()
+        local ffi = require("ffi")
+        local BB = require("ffi/blitbuffer")
+        local doc = M.openDocument(sample_pdf)
+        local page = doc:openPage(1)
+        local dc = require("ffi/drawcontext").new()
+        local expected = BB.new(300, 400, BB.TYPE_BB8)
+        page:draw(dc, expected, 0, 0)
+        local bb = BB.new(300, 400, BB.TYPE_BB8)
+        local previews = 0
+        page:drawProgressive(dc, bb, 0, 0, function(preview)
+            assert.are.equal(bb, preview)
+            previews = previews + 1
+        end)
+        assert.are.same(1, previews)
+        assert.are.equal(ffi.string(expected.data, expected.stride * expected.h), ffi.string(bb.data, bb.stride * bb.h))
+        -- stop after the preview
+        bb:fill(BB.COLOR_WHITE)
+        page:drawProgressive(dc, bb, 0, 0, function() return false end, 0.5)
+        assert.are_not.equal(ffi.string(expected.data, expected.stride * expected.h), ffi.string(bb.data, bb.stride * bb.h))
+        expected:free()
+        bb:free()
+        doc:close()
+    end)
+
+    it("should render the same in parallel bands", function()
+        local ffi = require("ffi")
+        local BB = require("ffi/blitbuffer")
+        local doc = M.openDocument(sample_pdf)
+        local page = doc:openPage(1)
+        local dc = require("ffi/drawcontext").new()
+        local render_threads = M.render_threads
+        M.render_threads = 1
+        local bb = page:draw_new(dc, 600, 800, 0, 0)
+        local single = ffi.string(bb.data, bb.stride * bb.h)
+        bb:free()
+        M.render_threads = 4
+        bb = page:draw_new(dc, 600, 800, 0, 0)
+        assert.are.equal(single, ffi.string(bb.data, bb.stride * bb.h))
+        bb:free()
+        M.render_threads = render_threads
+        doc:close()
+    end)
+
+    it("should cache downscaled images", function()
+        local ffi = require("ffi")
+        local doc = M.openDocument(jbig2_pdf)
+        local page = doc:openPage(1)
+        local dc = require("ffi/drawcontext").new()
+        local bb = page:draw_new(dc, 300, 400, 0, 0)
+        local decoded = ffi.string(bb.data, bb.stride * bb.h)
+        bb:free()
+        assert.True(M.getImageCacheSize() > 0)
+        bb = page:draw_new(dc, 300, 400, 0, 0)
+        assert.are.equal(decoded, ffi.string(bb.data, bb.stride * bb.h))
+        bb:free()
+        doc:cleanCache()
+        assert.are.equal(0, M.getImageCacheSize())
+        doc:close()
+    end)
+
+    it("should evict a closed document's cached images", function()
+        local doc = M.openDocument(jbig2_pdf)
+        local page = doc:openPage(1)
+        page:draw_new(require("ffi/drawcontext").new(), 300, 400, 0, 0):free()
+        page:close()
+        assert.True(M.getImageCacheSize() > 0)
+        doc:close()
+        assert.are.equal(0, M.getImageCacheSize())
+    end)
+
+    it("should account for memory", function()
+        local doc = M.openDocument(sample_pdf)
+        local page = doc:openPage(1)
+        local dc = require("ffi/drawcontext").new()
+        page:draw_new(dc, 300, 400, 0, 0):free()
+        local stats = M.getMemoryStats()
+        assert.is_not_nil(stats)
+        assert.True(stats.current > 0)
+        assert.True(stats.peak >= stats.current)
+        assert.True(stats.categories.document > 0)
+        assert.True(stats.categories.display_list > 0)
+        assert.True(doc:getCacheSize() > 0)
+        doc:close()
+    end)
+
+    it("should search the whole document", function()
+        local doc = M.openDocument(sample_pdf)
+        doc:searchDocument("Alice", 1, 10)
+        local hits = {}
+        local running
+        repeat
+            local results
+            results, running = doc:pollSearch()
+            for _, hit in ipairs(results) do
+                table.insert(hits, hit)
+            end
+        until not running
+        assert.True(#hits > 0)
+        assert.True(hits[1].new_match)
+        for _, hit in ipairs(hits) do
+            assert.True(hit.page >= 1 and hit.page <= 10)
+        end
+        local page_hits = doc:openPage(hits[1].page):searchPageText("Alice")
+        assert.are.same(page_hits[1].ul_x, hits[1].ul_x)
+        doc:close()
+    end)
+
     it("should open document from text", function()
         local doc = M.openDocumentFromText([[
         <html>
@@ -110,4 +110,168 @@ describe("Pic module", function()
             d:close()
         end)
     end)
+
+    describe("decodeToSize", function()
+        local function readfile(fname)
+            local fp = io.open(fname, "rb")
+            local data = fp:read("*a")
+            fp:close()
+            return data
+        end
+
+        it("should decode a JPEG fitted to the requested size", function()
+            local bb, w, h = Pic.decodeToSize(readfile("spec/base/unit/data/sample.jpg"), 100, 100, BB.TYPE_BBRGB24)
+            assert.are.same({313, 234}, {w, h})
+            assert.are.same({100, 75, BB.TYPE_BBRGB24}, {bb:getWidth(), bb:getHeight(), bb:getType()})
+            bb:free()
+        end)
+        it("should decode a PNG fitted to the requested size", function()
+            local bb, w, h = Pic.decodeToSize(readfile("spec/base/unit/data/transparency_various_bg.png"), 16, 64, BB.TYPE_BBRGB32)
+            assert.are.same({32, 32}, {w, h})
+            assert.are.same({16, 16, BB.TYPE_BBRGB32}, {bb:getWidth(), bb:getHeight(), bb:getType()})
+            bb:free()
+        end)
+        it("should decode a WebP fitted to the requested size", function()
+            -- 64x48, all (0x20, 0x80, 0xE0)
+            local data = readfile("spec/base/unit/data/solid.webp")
+            local bb, w, h = Pic.decodeToSize(data, 16, 16, BB.TYPE_BBRGB24)
+            assert.are.same({64, 48}, {w, h})
+            assert.are.same({16, 12, BB.TYPE_BBRGB24}, {bb:getWidth(), bb:getHeight(), bb:getType()})
+            local c = bb:getPixel(8, 6)
+            assert.are.same({0x20, 0x80, 0xE0}, {c.r, c.g, c.b})
+            bb:free()
+            -- scaled by libwebp itself
+            bb, w, h = require("ffi/webp").decodeToSize(data, #data, 16, 16)
+            assert.are.same({64, 48}, {w, h})
+            assert.are.same({16, 12, BB.TYPE_BBRGB32}, {bb:getWidth(), bb:getHeight(), bb:getType()})
+            bb:free()
+        end)
+        it("should not upscale", function()
+            local bb = Pic.decodeToSize(readfile("spec/base/unit/data/disposal.gif"), 100, 100, BB.TYPE_BB8)
+            assert.are.same({4, 4, BB.TYPE_BB8}, {bb:getWidth(), bb:getHeight(), bb:getType()})
+            bb:free()
+        end)
+    end)
+
+    describe("GIF support", function()
+        local d
+        local keyframe_interval
+        -- 4x4, frame 1 all red (kept), frame 2 green top-left 2x2 (restored to previous),
+        -- frame 3 blue bottom-right 2x2 with a transparent pixel (restored to background),
+        -- frame 4 a single green pixel top-right (kept)
+        local R, G, B, W = {0xFF, 0, 0}, {0, 0xFF, 0}, {0, 0, 0xFF}, {0xFF, 0xFF, 0xFF}
+        local expected = {
+            { R, R, R, R,  R, R, R, R,  R, R, R, R,  R, R, R, R },
+            { G, G, R, R,  G, G, R, R,  R, R, R, R,  R, R, R, R },
+            { R, R, R, R,  R, R, R, R,  R, R, B, B,  R, R, B, R },
+            { R, R, R, G,  R, R, R, R,  R, R, W, W,  R, R, W, W },
+        }
+        local function getFrame(number)
+            local page = d:openPage(number)
+            local pixels = {}
+            for y = 0, 3 do
+                for x = 0, 3 do
+                    local c = page.image_bb:getPixel(x, y)
+                    table.insert(pixels, {c.r, c.g, c.b})
+                end
+            end
+            page:close()
+            return pixels
+        end
+        setup(function()
+            -- Snapshot every other frame, to go through the keyframes when seeking back
+            keyframe_interval = Pic.gif_keyframe_interval
+            Pic.gif_keyframe_interval = 2
+            d = Pic.openDocument("spec/base/unit/data/disposal.gif")
+        end)
+
+        it("should return the number of frames as number of pages", function()
+            assert.are.same(4, d:getPages())
+        end)
+        it("should composite frames in order", function()
+            for i = 1, 4 do
+                assert.are.same(expected[i], getFrame(i))
+            end
+        end)
+        it("should composite frames in any order", function()
+            for _, i in ipairs({4, 2, 3, 1, 4, 3, 2}) do
+                assert.are.same(expected[i], getFrame(i))
+            end
+            d:cleanCache()
+            assert.are.same(expected[3], getFrame(3))
+            assert.are.same(expected[2], getFrame(2))
+        end)
+
+        teardown(function()
+            d:close()
+            Pic.gif_keyframe_interval = keyframe_interval
+        end)
+    end)
+
+    describe("animated WebP support", function()
+        local d
+        -- 4x4, frame 1 all red (keyframe), frame 2 top-left 2x2 green and half
+        -- transparent blue (blended), frame 3 blue bottom-right 2x2 (disposed to
+        -- background), frame 4 white top-right 2x2, frame 5 all blue (not blended,
+        -- keyframe), frame 6 red bottom-left 2x2
+        local R, G, B, W = {0xFF, 0, 0, 0xFF}, {0, 0xFF, 0, 0xFF}, {0, 0, 0xFF, 0xFF}, {0xFF, 0xFF, 0xFF, 0xFF}
+        local M, T = {0x7E, 0, 0x7F, 0xFF}, {0, 0, 0, 0}
+        local expected = {
+            { R, R, R, R,  R, R, R, R,  R, R, R, R,  R, R, R, R },
+            { G, M, R, R,  M, G, R, R,  R, R, R, R,  R, R, R, R },
+            { G, M, R, R,  M, G, R, R,  R, R, B, B,  R, R, B, B },
+            { G, M, W, W,  M, G, W, W,  R, R, T, T,  R, R, T, T },
+            { B, B, B, B,  B, B, B, B,  B, B, B, B,  B, B, B, B },
+            { B, B, B, B,  B, B, B, B,  R, R, B, B,  R, R, B, B },
+        }
+        local function getFrame(number)
+            local page = d:openPage(number)
+            local pixels = {}
+            for y = 0, 3 do
+                for x = 0, 3 do
+                    local c = page.image_bb:getPixel(x, y)
+                    table.insert(pixels, {c.r, c.g, c.b, c.alpha})
+                end
+            end
+            page:close()
+            return pixels
+        end
+        setup(function()
+            d = Pic.openDocument("spec/base/unit/data/animated.webp")
+        end)
+
+        it("should return the number of frames as number of pages", function()
+            assert.are.same(6, d:getPages())
+        end)
+        it("should flag the keyframes", function()
+            for i, frame in ipairs(d.webp.frames) do
+                assert.equals(i == 1 or i == 5, frame.keyframe)
+            end
+        end)
+        it("should composite frames in order", function()
+            for i = 1, 6 do
+                assert.are.same(expected[i], getFrame(i))
+            end
+            -- playing forward doesn't cache anything
+            assert.are.same({}, d.webp.frame_cache_order)
+        end)
+        it("should composite frames in any order", function()
+            -- from keyframe 1, then keyframe 5, then keyframe 1 again
+            for _, i in ipairs({3, 6, 4}) do
+                assert.are.same(expected[i], getFrame(i))
+            end
+            assert.are.same({3, 6, 4}, d.webp.frame_cache_order)
+            -- from the cache, the canvas is left alone
+            assert.are.same(expected[3], getFrame(3))
+            assert.equals(4, d.webp.cur_frame)
+            assert.are.same({6, 4, 3}, d.webp.frame_cache_order)
+            for _, i in ipairs({5, 2, 6, 1}) do
+                assert.are.same(expected[i], getFrame(i))
+            end
+        end)
+
+        teardown(function()
+            d:close()
+        end)
+    end)
 end)
@@ -37,6 +37,25 @@ describe("Png module", function()
             assert.are.equal(0, C.memcmp(re.data, readfile(sample), re.width * re.height * re.ncomp))
         end)
 
+        it("should load "..format.." bitmap from a mapped png file", function()
+            local posix = require("ffi/posix")
+            local mmap_min_size = posix.mmap_min_size
+            posix.mmap_min_size = 0
+            local ok, re = Png.decodeFromFile(sample..".png", n)
+            posix.mmap_min_size = mmap_min_size
+            assert.is_true(ok)
+            assert.are.same({ko_w, ko_h, n}, {re.width, re.height, re.ncomp})
+            assert.are.equal(0, C.memcmp(re.data, readfile(sample), re.width * re.height * re.ncomp))
+        end)
+
+        it("should load "..format.." bitmap from png data", function()
+            local data = readfile(sample..".png")
+            local ok, re = Png.decodeFromMem(data, #data, n)
+            assert.is_true(ok)
+            assert.are.same({ko_w, ko_h, n}, {re.width, re.height, re.ncomp})
+            assert.are.equal(0, C.memcmp(re.data, readfile(sample), re.width * re.height * re.ncomp))
+        end)
+
         it("should write "..format.." bitmap to png file", function()
             local data = readfile(sample)
             assert(#data == ko_w * ko_h * n)
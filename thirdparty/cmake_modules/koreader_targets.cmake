@@ -103,7 +103,7 @@ declare_koreader_target(
 # koreader-djvu
 declare_koreader_target(
     koreader-djvu TYPE monolibtic
-    DEPENDS blitbuffer djvulibre::djvulibre libk2pdfopt::k2pdfopt luajit::luajit
+    DEPENDS blitbuffer djvulibre::djvulibre libk2pdfopt::k2pdfopt luajit::luajit pthread
     SOURCES djvu.c
     SUFFIX .so
     VISIBILITY hidden
@@ -158,7 +158,7 @@ declare_koreader_target(
 # wrap-mupdf
 declare_koreader_target(
     wrap-mupdf TYPE monolibtic
-    DEPENDS mupdf::mupdf
+    DEPENDS mupdf::mupdf pthread
     SOURCES wrap-mupdf.c
     VISIBILITY hidden
 )
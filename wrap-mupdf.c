@@ -20,57 +20,55 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
 #include "wrap-mupdf.h"
 
-static double LOG_TRESHOLD_PERC = 0.05; // 5%
+/* accounting allocator
+ *
+ * Cheap enough to be always on: a small header before each block records
+ * its size and the category it was allocated under, counters are updated
+ * with atomics (cloned contexts allocate from several threads), and realloc
+ * is a plain realloc, in-place whenever libc can.
+ */
 
 enum {
     MAGIC = 0x3795d42b,
 };
 
-typedef struct header {
-    int magic;
-    size_t sz;
+/* keeps the payload aligned like malloc's on both 32 and 64 bits */
+typedef union header {
+    struct {
+        size_t sz;
+        uint32_t magic;
+        uint32_t category;
+    } h;
+    char pad[16];
 } header;
 
-static size_t msize = 0U;
-static size_t msize_prev;
-static size_t msize_max;
-static size_t msize_min;
-static bool is_realloc = false;
+static mupdf_alloc_stats my_stats;
 
-#if 0
-static size_t msize_iniz;
+/* category of the allocations made by the current thread */
+static __thread int my_category = MUPDF_ALLOC_OTHER;
 
-static void resetMsize() {
-    msize_iniz = msize;
-    msize_prev = 0;
-    msize_max = 0;
-    msize_min = (size_t) -1;
-}
-
-static void showMsize() {
-    char buf[15], buf2[15], buf3[15], buf4[15];
-    //printf("§§§ now: %s was: %s - min: %s - max: %s\n", readable_fs(msize, buf), readable_fs(msize_iniz, buf2), readable_fs(msize_min, buf3), readable_fs(msize_max, buf4));
-    resetMsize();
+static inline void account_add(int category, size_t size)
+{
+    size_t current = __atomic_add_fetch(&my_stats.current, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&my_stats.category[category], size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&my_stats.peak, __ATOMIC_RELAXED);
+    while (current > peak
+           && !__atomic_compare_exchange_n(&my_stats.peak, &peak, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 }
-#endif
 
-static void log_size(char *funcName) {
-    if (msize_max < msize) {
-        msize_max = msize;
-    }
-    if (msize_min > msize) {
-        msize_min = msize;
-    }
-    if (1==0 && abs(msize - msize_prev) > msize_prev * LOG_TRESHOLD_PERC) {
-        //char buf[15], buf2[15];
-        //printf("§§§ %s - total: %s (was %s)\n",funcName, readable_fs(msize,buf),readable_fs(msize_prev,buf2));
-        msize_prev = msize;
-    }
+static inline void account_sub(int category, size_t size)
+{
+    __atomic_sub_fetch(&my_stats.current, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&my_stats.category[category], size, __ATOMIC_RELAXED);
 }
 
 static void *
@@ -79,64 +77,69 @@ my_malloc_default(void *opaque, size_t size)
     if (size > SIZE_MAX - sizeof(header)) {
         return NULL;
     }
-    struct header * h = malloc(size + sizeof(header));
+    header *h = malloc(size + sizeof(header));
     if (h == NULL) {
         return NULL;
     }
 
-    h->magic = MAGIC;
-    h->sz = size;
-    msize += size + sizeof(struct header);
-    if (!is_realloc) {
-        log_size("alloc");
-    }
+    h->h.magic = MAGIC;
+    h->h.sz = size;
+    h->h.category = my_category;
+    account_add(h->h.category, size);
+    __atomic_add_fetch(&my_stats.blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&my_stats.allocs, 1, __ATOMIC_RELAXED);
     return (void *)(h + 1);
 }
 
 static void
 my_free_default(void *opaque, void *ptr)
 {
-    fprintf(stderr, "free %p (%zu)\n", ptr, msize);
-    if (ptr != NULL) {
-        struct header * h = ((struct header *)ptr) - 1;
-        if (h->magic != MAGIC) { /* Not allocated by us */
-            fprintf(stderr, "attempt to free something that doesn't belong to us!\n");
-        } else {
-            msize -= h->sz + sizeof(struct header);
-            free(h);
-        }
+    if (ptr == NULL) {
+        return;
     }
-    if (!is_realloc) {
-        log_size("free");
+    header *h = ((header *)ptr) - 1;
+    if (h->h.magic != MAGIC) { /* Not allocated by us */
+        fprintf(stderr, "attempt to free something that doesn't belong to us!\n");
+        return;
     }
+    account_sub(h->h.category, h->h.sz);
+    __atomic_sub_fetch(&my_stats.blocks, 1, __ATOMIC_RELAXED);
+    h->h.magic = 0;
+    free(h);
 }
 
 static void *
 my_realloc_default(void *opaque, void *old, size_t size)
 {
-    void * newp;
     if (old == NULL) { //practically, it's a malloc
-        newp = my_malloc_default(opaque, size);
+        return my_malloc_default(opaque, size);
+    }
+    header *h = ((header *)old) - 1;
+    if (h->h.magic != MAGIC) { // Not allocated by my_malloc_default
+        fprintf(stderr, "attempt to realloc something that doesn't belong to us!\n");
+        return NULL;
+    }
+    if (size > SIZE_MAX - sizeof(header)) {
+        return NULL;
+    }
+    size_t oldsize = h->h.sz;
+    header *newh = realloc(h, size + sizeof(header));
+    if (newh == NULL) {
+        // old block is left untouched
+        return NULL;
+    }
+    // stays accounted in its original category
+    newh->h.sz = size;
+    if (size > oldsize) {
+        account_add(newh->h.category, size - oldsize);
     } else {
-        struct header * h = ((struct header *)old) - 1;
-        if (h->magic != MAGIC) { // Not allocated by my_malloc_default
-            //printf("§§§ warn: not allocated by my_malloc_default, new size: %zu\n", size);
-            newp = realloc(old, size);
-        } else { // malloc + free
-            is_realloc = true;
-            size_t oldsize = h->sz;
-            //printf("realloc %zu -> %zu\n", oldsize, size);
-            newp = my_malloc_default(opaque, size);
-            if (NULL != newp) {
-                memcpy(newp, old, oldsize < size ? oldsize : size);
-                my_free_default(opaque, old);
-            }
-            log_size("realloc");
-            is_realloc = false;
-        }
+        account_sub(newh->h.category, oldsize - size);
     }
-
-    return(newp);
+    __atomic_add_fetch(&my_stats.reallocs, 1, __ATOMIC_RELAXED);
+    if (newh == h) {
+        __atomic_add_fetch(&my_stats.reallocs_in_place, 1, __ATOMIC_RELAXED);
+    }
+    return (void *)(newh + 1);
 }
 
 fz_alloc_context my_alloc_default =
@@ -152,7 +155,65 @@ fz_alloc_context* mupdf_get_my_alloc_context() {
 }
 
 int mupdf_get_cache_size() {
-    return msize;
+    size_t current = __atomic_load_n(&my_stats.current, __ATOMIC_RELAXED);
+    return current > INT_MAX ? INT_MAX : (int) current;
+}
+
+int mupdf_set_alloc_category(int category) {
+    int previous = my_category;
+    if (category >= 0 && category < MUPDF_ALLOC_CATEGORIES) {
+        my_category = category;
+    }
+    return previous;
+}
+
+void mupdf_get_alloc_stats(mupdf_alloc_stats *stats) {
+    stats->current = __atomic_load_n(&my_stats.current, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&my_stats.peak, __ATOMIC_RELAXED);
+    stats->blocks = __atomic_load_n(&my_stats.blocks, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&my_stats.allocs, __ATOMIC_RELAXED);
+    stats->reallocs = __atomic_load_n(&my_stats.reallocs, __ATOMIC_RELAXED);
+    stats->reallocs_in_place = __atomic_load_n(&my_stats.reallocs_in_place, __ATOMIC_RELAXED);
+    for (int i = 0; i < MUPDF_ALLOC_CATEGORIES; i++) {
+        stats->category[i] = __atomic_load_n(&my_stats.category[i], __ATOMIC_RELAXED);
+    }
+}
+
+void mupdf_reset_alloc_peak() {
+    __atomic_store_n(&my_stats.peak, __atomic_load_n(&my_stats.current, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+/* locking, needed to use cloned contexts from several threads */
+
+static pthread_mutex_t my_mutexes[FZ_LOCK_MAX];
+static pthread_once_t my_mutexes_once = PTHREAD_ONCE_INIT;
+
+static void my_init_mutexes(void)
+{
+    for (int i = 0; i < FZ_LOCK_MAX; i++)
+        pthread_mutex_init(&my_mutexes[i], NULL);
+}
+
+static void my_lock(void *user, int lock)
+{
+    pthread_mutex_lock(&my_mutexes[lock]);
+}
+
+static void my_unlock(void *user, int lock)
+{
+    pthread_mutex_unlock(&my_mutexes[lock]);
+}
+
+static fz_locks_context my_locks =
+{
+    NULL,
+    my_lock,
+    my_unlock
+};
+
+fz_locks_context* mupdf_get_my_locks_context() {
+    pthread_once(&my_mutexes_once, my_init_mutexes);
+    return &my_locks;
 }
 
 int mupdf_error_code(fz_context *ctx) {
@@ -266,6 +327,1008 @@ int page_has_transparency_mask(fz_context* ctx, fz_page* p)
     return 0;
 }
 
+/* flat extraction of the words of a structured text page */
+
+static bool is_unicode_wspace(int c)
+{
+    return c == 9 || c == 0x0a || c == 0x0b || c == 0x0c || c == 0x0d || c == 0x20
+        || c == 0x85 || c == 0xA0 || c == 0x1680 || c == 0x180E
+        || (c >= 0x2000 && c <= 0x200A)
+        || c == 0x2028 || c == 0x2029 || c == 0x202F || c == 0x205F || c == 0x3000;
+}
+
+static bool is_unicode_bullet(int c)
+{
+    // Not all of them are strictly bullets, but will do for our usage here
+    return c == 0x2022 || c == 0x2023 || c == 0x25a0 || c == 0x25cb || c == 0x25cf
+        || c == 0x25e6 || c == 0x2043 || c == 0x2219 || c == 149 || c == '*';
+}
+
+/* chars that make a word on their own (and end the current one) */
+static bool is_word_breaking(int c)
+{
+    return (c >= 0x4e00 && c <= 0x9FFF)     // CJK Unified Ideographs
+        || (c >= 0x2000 && c <= 0x206F)     // General Punctuation
+        || (c >= 0x3000 && c <= 0x303F)     // CJK Symbols and Punctuation
+        || (c >= 0x3400 && c <= 0x4DBF)     // CJK Unified Ideographs Extension A
+        || (c >= 0xF900 && c <= 0xFAFF)     // CJK Compatibility Ideographs
+        || (c >= 0xFF01 && c <= 0xFFEE)     // Halfwidth and Fullwidth Forms
+        || (c >= 0x20000 && c <= 0x2A6DF);  // CJK Unified Ideographs Extension B
+}
+
+static fz_stext_char *skip_starting_bullet(fz_stext_line *line)
+{
+    fz_stext_char *ch;
+    bool found_bullet = false;
+    for (ch = line->first_char; ch; ch = ch->next) {
+        if (is_unicode_bullet(ch->c))
+            found_bullet = true;
+        else if (!is_unicode_wspace(ch->c))
+            break;
+    }
+    return found_bullet ? ch : line->first_char;
+}
+
+static bool is_valid_rect(fz_rect r)
+{
+    return r.x0 < r.x1 && r.y0 < r.y1;
+}
+
+static void set_bbox(float *bbox, fz_rect r)
+{
+    bbox[0] = r.x0;
+    bbox[1] = r.y0;
+    bbox[2] = r.x1;
+    bbox[3] = r.y1;
+}
+
+/* Split the text lines of the page into words, the way getPageText() always
+ * did: leading bullets are skipped, words end on white space and around CJK
+ * chars, and words or lines with an empty bbox are dropped.
+ * Everything lives in a single block, to be freed with fz_free().
+ */
+mupdf_stext_words *stext_words_from_page(fz_context *ctx, fz_stext_page *text)
+{
+    // words and lines can't outnumber chars: size the arrays for that
+    size_t n_chars = 0, n_lines = 0;
+    for (fz_stext_block *block = text->first_block; block; block = block->next) {
+        if (block->type != FZ_STEXT_BLOCK_TEXT)
+            continue;
+        for (fz_stext_line *line = block->u.t.first_line; line; line = line->next) {
+            n_lines++;
+            for (fz_stext_char *ch = line->first_char; ch; ch = ch->next)
+                n_chars++;
+        }
+    }
+
+    size_t size = sizeof(mupdf_stext_words)
+        + n_chars * 4 * sizeof(float) + n_lines * 4 * sizeof(float)
+        + (n_chars + 1) * sizeof(int) + n_chars * sizeof(int)
+        + n_chars * FZ_UTFMAX + 1;
+    mupdf_stext_words *words = fz_malloc(ctx, size);
+    words->word_bboxes = (float *)(words + 1);
+    words->line_bboxes = words->word_bboxes + n_chars * 4;
+    words->word_offsets = (int *)(words->line_bboxes + n_lines * 4);
+    words->word_lines = words->word_offsets + n_chars + 1;
+    words->text = (char *)(words->word_lines + n_chars);
+
+    int nw = 0, nl = 0, len = 0;
+    for (fz_stext_block *block = text->first_block; block; block = block->next) {
+        if (block->type != FZ_STEXT_BLOCK_TEXT)
+            continue;
+        for (fz_stext_line *line = block->u.t.first_line; line; line = line->next) {
+            fz_rect line_bbox = fz_empty_rect;
+            int line_first_word = nw, line_start = len;
+            fz_stext_char *ch = skip_starting_bullet(line);
+            while (ch) {
+                fz_rect word_bbox = fz_empty_rect;
+                int word_start = len;
+                while (ch) {
+                    if (is_unicode_wspace(ch->c))
+                        break; // ignore and end word
+                    len += fz_runetochar(words->text + len, ch->c);
+                    fz_rect char_bbox = fz_rect_from_quad(ch->quad);
+                    word_bbox = fz_union_rect(word_bbox, char_bbox);
+                    line_bbox = fz_union_rect(line_bbox, char_bbox);
+                    if (is_word_breaking(ch->c))
+                        break;
+                    ch = ch->next;
+                }
+                if (is_valid_rect(word_bbox)) {
+                    words->word_offsets[nw] = word_start;
+                    set_bbox(words->word_bboxes + nw * 4, word_bbox);
+                    words->word_lines[nw] = nl;
+                    nw++;
+                } else {
+                    len = word_start;
+                }
+                if (!ch)
+                    break;
+                ch = ch->next;
+            }
+            if (is_valid_rect(line_bbox)) {
+                set_bbox(words->line_bboxes + nl * 4, line_bbox);
+                nl++;
+            } else {
+                // forget the words of that line
+                nw = line_first_word;
+                len = line_start;
+            }
+        }
+    }
+    words->word_offsets[nw] = len;
+    words->text[len] = '\0';
+    words->n_words = nw;
+    words->n_lines = nl;
+    return words;
+}
+
+/* decoded image cache
+ *
+ * Hooked into draw devices: images larger than needed at the current scale
+ * are decoded at 1/2, 1/4 or 1/8 of their size (subsample_bias more times
+ * if asked to, trading quality for speed and memory), and kept in an LRU
+ * of its own, within max_size bytes, so they survive the store evicting
+ * them. It's shared by all contexts (and render threads). Entries keep
+ * their original image alive, so its size counts towards max_size too,
+ * and they are tagged with the document they were drawn for, so closing
+ * it can evict them (see mupdf_clear_image_cache()).
+ */
+
+#define MAX_IMAGE_L2FACTOR 3
+
+typedef struct image_cache_entry {
+    fz_image *image;  /* original, kept so its address isn't reused */
+    fz_document *owner; /* not kept, only compared */
+    int l2factor;
+    fz_image *scaled;
+    size_t size;
+    struct image_cache_entry *prev;
+    struct image_cache_entry *next;
+} image_cache_entry;
+
+/* the document a hooked draw device draws for */
+typedef struct image_cache_device {
+    fz_device *dev;
+    fz_document *owner;
+    struct image_cache_device *next;
+} image_cache_device;
+
+static struct {
+    pthread_mutex_t lock;
+    image_cache_entry *head; /* most recently used */
+    image_cache_entry *tail;
+    image_cache_device *devices;
+    size_t used;
+    size_t max_size;
+    int subsample_bias;
+} image_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL, 0, 0, 0 };
+
+/* the draw device's own fill_image and drop_device */
+static void (*draw_fill_image)(fz_context *, fz_device *, fz_image *, fz_matrix, float, fz_color_params);
+static void (*draw_drop_device)(fz_context *, fz_device *);
+
+static void image_cache_unlink(image_cache_entry *e)
+{
+    if (e->prev) e->prev->next = e->next; else image_cache.head = e->next;
+    if (e->next) e->next->prev = e->prev; else image_cache.tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void image_cache_push(image_cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = image_cache.head;
+    if (image_cache.head) image_cache.head->prev = e;
+    image_cache.head = e;
+    if (!image_cache.tail) image_cache.tail = e;
+}
+
+/* evict entries until used <= max_size, returns them in a list to drop
+ * once the lock is released (dropping images may take locks of its own) */
+static image_cache_entry *image_cache_trim(size_t max_size)
+{
+    image_cache_entry *evicted = NULL;
+    while (image_cache.tail && image_cache.used > max_size) {
+        image_cache_entry *e = image_cache.tail;
+        image_cache_unlink(e);
+        image_cache.used -= e->size;
+        e->next = evicted;
+        evicted = e;
+    }
+    return evicted;
+}
+
+static void image_cache_drop_entries(fz_context *ctx, image_cache_entry *e)
+{
+    while (e) {
+        image_cache_entry *next = e->next;
+        fz_drop_image(ctx, e->image);
+        fz_drop_image(ctx, e->scaled);
+        free(e);
+        e = next;
+    }
+}
+
+void mupdf_set_image_cache(fz_context *ctx, size_t max_size, int subsample_bias)
+{
+    pthread_mutex_lock(&image_cache.lock);
+    image_cache.max_size = max_size;
+    image_cache.subsample_bias = subsample_bias < 0 ? 0 : subsample_bias;
+    image_cache_entry *evicted = image_cache_trim(max_size);
+    pthread_mutex_unlock(&image_cache.lock);
+    image_cache_drop_entries(ctx, evicted);
+}
+
+size_t mupdf_get_image_cache_used()
+{
+    pthread_mutex_lock(&image_cache.lock);
+    size_t used = image_cache.used;
+    pthread_mutex_unlock(&image_cache.lock);
+    return used;
+}
+
+/* evict the entries drawn for owner, or all of them if owner is NULL */
+void mupdf_clear_image_cache(fz_context *ctx, fz_document *owner)
+{
+    image_cache_entry *evicted = NULL;
+    pthread_mutex_lock(&image_cache.lock);
+    if (!owner) {
+        evicted = image_cache_trim(0);
+    } else {
+        image_cache_entry *e = image_cache.head;
+        while (e) {
+            image_cache_entry *next = e->next;
+            if (e->owner == owner) {
+                image_cache_unlink(e);
+                image_cache.used -= e->size;
+                e->next = evicted;
+                evicted = e;
+            }
+            e = next;
+        }
+    }
+    pthread_mutex_unlock(&image_cache.lock);
+    image_cache_drop_entries(ctx, evicted);
+}
+
+static fz_document *image_cache_device_owner(fz_device *dev)
+{
+    fz_document *owner = NULL;
+    pthread_mutex_lock(&image_cache.lock);
+    for (image_cache_device *d = image_cache.devices; d; d = d->next) {
+        if (d->dev == dev) {
+            owner = d->owner;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&image_cache.lock);
+    return owner;
+}
+
+/* how many times the image can be halved and still cover its area at ctm */
+static int image_l2factor(fz_image *image, fz_matrix ctm, int bias)
+{
+    float dw = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
+    float dh = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
+    int l2factor = 0;
+    while (l2factor < MAX_IMAGE_L2FACTOR
+           && (image->w >> (l2factor + 1)) >= dw && (image->h >> (l2factor + 1)) >= dh)
+        l2factor++;
+    if (l2factor + bias > MAX_IMAGE_L2FACTOR)
+        return MAX_IMAGE_L2FACTOR;
+    return l2factor + bias;
+}
+
+static fz_image *image_cache_get(fz_context *ctx, fz_document *owner, fz_image *image, int l2factor)
+{
+    fz_image *scaled = NULL;
+    pthread_mutex_lock(&image_cache.lock);
+    for (image_cache_entry *e = image_cache.head; e; e = e->next) {
+        if (e->image == image && e->owner == owner && e->l2factor == l2factor) {
+            image_cache_unlink(e);
+            image_cache_push(e);
+            scaled = fz_keep_image(ctx, e->scaled);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&image_cache.lock);
+    return scaled;
+}
+
+static void image_cache_put(fz_context *ctx, fz_document *owner, fz_image *image, int l2factor, fz_image *scaled, size_t size)
+{
+    image_cache_entry *e = malloc(sizeof(image_cache_entry));
+    if (!e)
+        return;
+    e->image = fz_keep_image(ctx, image);
+    e->owner = owner;
+    e->l2factor = l2factor;
+    e->scaled = fz_keep_image(ctx, scaled);
+    e->size = size;
+    pthread_mutex_lock(&image_cache.lock);
+    image_cache_push(e);
+    image_cache.used += size;
+    image_cache_entry *evicted = image_cache_trim(image_cache.max_size);
+    pthread_mutex_unlock(&image_cache.lock);
+    image_cache_drop_entries(ctx, evicted);
+}
+
+static void image_cache_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, float alpha, fz_color_params color_params)
+{
+    int l2factor = 0;
+    if (image->mask == NULL && image_cache.max_size > 0)
+        l2factor = image_l2factor(image, ctm, image_cache.subsample_bias);
+    if (l2factor == 0) {
+        // nothing to gain, let the store handle it
+        draw_fill_image(ctx, dev, image, ctm, alpha, color_params);
+        return;
+    }
+
+    fz_document *owner = image_cache_device_owner(dev);
+    fz_image *scaled = image_cache_get(ctx, owner, image, l2factor);
+    if (!scaled) {
+        int category = mupdf_set_alloc_category(MUPDF_ALLOC_IMAGE);
+        fz_pixmap *pix = NULL;
+        fz_var(pix);
+        fz_try(ctx) {
+            int w = image->w >> l2factor;
+            int h = image->h >> l2factor;
+            pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, &w, &h);
+            scaled = fz_new_image_from_pixmap(ctx, pix, NULL);
+        }
+        fz_always(ctx) {
+            mupdf_set_alloc_category(category);
+        }
+        fz_catch(ctx) {
+            fz_drop_pixmap(ctx, pix);
+            fz_rethrow(ctx);
+        }
+        /* the original stays alive as long as the entry (counted once per entry) */
+        size_t size = (size_t)pix->w * pix->h * pix->n + fz_image_size(ctx, image);
+        fz_drop_pixmap(ctx, pix);
+        if (size <= image_cache.max_size)
+            image_cache_put(ctx, owner, image, l2factor, scaled, size);
+    }
+
+    fz_try(ctx) {
+        draw_fill_image(ctx, dev, scaled, ctm, alpha, color_params);
+    }
+    fz_always(ctx) {
+        fz_drop_image(ctx, scaled);
+    }
+    fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+}
+
+static void image_cache_drop_device(fz_context *ctx, fz_device *dev)
+{
+    pthread_mutex_lock(&image_cache.lock);
+    for (image_cache_device **d = &image_cache.devices; *d; d = &(*d)->next) {
+        if ((*d)->dev == dev) {
+            image_cache_device *found = *d;
+            *d = found->next;
+            free(found);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&image_cache.lock);
+    draw_drop_device(ctx, dev);
+}
+
+/* dev must be a draw device, drawing for the document owner (its cached
+ * images are evicted by mupdf_clear_image_cache(ctx, owner)) */
+void mupdf_hook_image_cache(fz_device *dev, fz_document *owner)
+{
+    if (dev->fill_image == image_cache_fill_image)
+        return;
+    image_cache_device *d = malloc(sizeof(image_cache_device));
+    if (!d)
+        return;
+    d->dev = dev;
+    d->owner = owner;
+    pthread_mutex_lock(&image_cache.lock);
+    d->next = image_cache.devices;
+    image_cache.devices = d;
+    pthread_mutex_unlock(&image_cache.lock);
+    // all draw devices share the same implementation
+    draw_fill_image = dev->fill_image;
+    draw_drop_device = dev->drop_device;
+    dev->fill_image = image_cache_fill_image;
+    dev->drop_device = image_cache_drop_device;
+}
+
+/* banded rendering of a display list, one band per thread */
+
+#define MAX_RENDER_BANDS 8
+#define MIN_BAND_HEIGHT 64
+/* below that many pixels, the setup costs more than it saves */
+#define MIN_BANDED_AREA (512 * 512)
+
+typedef struct render_band {
+    fz_context *ctx;
+    fz_document *owner;
+    fz_display_list *list;
+    fz_pixmap *dest;
+    fz_matrix ctm;
+    int mask;
+    int y0;
+    int h;
+    bool ok;
+} render_band;
+
+static void *render_band_run(void *arg)
+{
+    render_band *band = arg;
+    fz_context *ctx = band->ctx;
+    int category = mupdf_set_alloc_category(MUPDF_ALLOC_RENDER);
+    fz_pixmap *dest = band->dest;
+    fz_pixmap *pix = NULL;
+    fz_device *dev = NULL;
+
+    fz_var(pix);
+    fz_var(dev);
+    fz_try(ctx) {
+        /* a view over the band rows of the destination samples */
+        pix = fz_new_pixmap_with_data(ctx, dest->colorspace, dest->w, band->h, NULL, dest->alpha,
+                                      dest->stride, dest->samples + (size_t)(band->y0 - dest->y) * dest->stride);
+        pix->x = dest->x;
+        pix->y = band->y0;
+        fz_clear_pixmap_with_value(ctx, pix, 0xff);
+        dev = fz_new_draw_device(ctx, fz_identity, pix);
+        mupdf_hook_image_cache(dev, band->owner);
+        if (band->mask) {
+            fz_device *mask_dev = new_transparency_mask_device(ctx, dev);
+            fz_drop_device(ctx, dev);
+            dev = mask_dev;
+        }
+        fz_run_display_list(ctx, band->list, dev, band->ctm, fz_rect_from_irect(fz_pixmap_bbox(ctx, pix)), NULL);
+        fz_close_device(ctx, dev);
+        band->ok = true;
+    }
+    fz_always(ctx) {
+        fz_drop_device(ctx, dev);
+        fz_drop_pixmap(ctx, pix);
+    }
+    fz_catch(ctx) {
+        band->ok = false;
+    }
+    mupdf_set_alloc_category(category);
+    return NULL;
+}
+
+/* Persistent pool of band workers, each with its own context cloned once
+ * from the context it renders for (see mupdf_render_pool_shutdown()).
+ * Only one banded draw runs at a time: a concurrent one renders alone. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond; /* new job or quit */
+    pthread_cond_t done_cond; /* a band is done */
+    fz_context *base;
+    int nworkers;
+    pthread_t threads[MAX_RENDER_BANDS];
+    fz_context *ctxs[MAX_RENDER_BANDS];
+    unsigned int seen[MAX_RENDER_BANDS]; /* last job generation each worker saw */
+    render_band *bands; /* current job: band i+1 goes to worker i */
+    int nbands;
+    unsigned int generation;
+    int pending;
+    bool busy;
+    bool quit;
+} render_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void *render_pool_run(void *arg)
+{
+    int index = (int)(intptr_t) arg;
+    pthread_mutex_lock(&render_pool.lock);
+    for (;;) {
+        while (!render_pool.quit && render_pool.generation == render_pool.seen[index])
+            pthread_cond_wait(&render_pool.work_cond, &render_pool.lock);
+        if (render_pool.quit)
+            break;
+        render_pool.seen[index] = render_pool.generation;
+        if (index + 1 >= render_pool.nbands)
+            continue;
+        render_band *band = &render_pool.bands[index + 1];
+        band->ctx = render_pool.ctxs[index];
+        pthread_mutex_unlock(&render_pool.lock);
+        render_band_run(band);
+        pthread_mutex_lock(&render_pool.lock);
+        render_pool.pending--;
+        pthread_cond_broadcast(&render_pool.done_cond);
+    }
+    pthread_mutex_unlock(&render_pool.lock);
+    return NULL;
+}
+
+/* Stops the workers and drops their contexts (pool lock must be held, and no job running) */
+static void render_pool_stop(void)
+{
+    if (render_pool.nworkers == 0)
+        return;
+    render_pool.quit = true;
+    /* keep other draws off the pool while it's unlocked */
+    bool busy = render_pool.busy;
+    render_pool.busy = true;
+    pthread_cond_broadcast(&render_pool.work_cond);
+    pthread_mutex_unlock(&render_pool.lock);
+    for (int i = 0; i < render_pool.nworkers; i++)
+        pthread_join(render_pool.threads[i], NULL);
+    pthread_mutex_lock(&render_pool.lock);
+    for (int i = 0; i < render_pool.nworkers; i++)
+        fz_drop_context(render_pool.ctxs[i]);
+    render_pool.nworkers = 0;
+    render_pool.base = NULL;
+    render_pool.quit = false;
+    render_pool.busy = busy;
+}
+
+/* Makes sure there are (up to) n workers for ctx (pool lock must be held, and no job running) */
+/* A forked child inherits the pool's state, but none of its threads: hold
+ * the lock across fork(), and start the child with an empty pool (leaking
+ * the inherited worker contexts, which may be in any state). */
+static void render_pool_atfork_prepare(void)
+{
+    pthread_mutex_lock(&render_pool.lock);
+}
+
+static void render_pool_atfork_parent(void)
+{
+    pthread_mutex_unlock(&render_pool.lock);
+}
+
+static void render_pool_atfork_child(void)
+{
+    pthread_mutex_init(&render_pool.lock, NULL);
+    pthread_cond_init(&render_pool.work_cond, NULL);
+    pthread_cond_init(&render_pool.done_cond, NULL);
+    render_pool.base = NULL;
+    render_pool.nworkers = 0;
+    render_pool.bands = NULL;
+    render_pool.nbands = 0;
+    render_pool.pending = 0;
+    render_pool.busy = false;
+    render_pool.quit = false;
+}
+
+static pthread_once_t render_pool_atfork_once = PTHREAD_ONCE_INIT;
+
+static void render_pool_register_atfork(void)
+{
+    pthread_atfork(render_pool_atfork_prepare, render_pool_atfork_parent, render_pool_atfork_child);
+}
+
+static void render_pool_grow(fz_context *ctx, int n)
+{
+    pthread_once(&render_pool_atfork_once, render_pool_register_atfork);
+    if (render_pool.base != ctx)
+        render_pool_stop();
+    render_pool.base = ctx;
+    while (render_pool.nworkers < n) {
+        int i = render_pool.nworkers;
+        fz_context *wctx = fz_clone_context(ctx);
+        if (wctx == NULL)
+            break;
+        render_pool.ctxs[i] = wctx;
+        render_pool.seen[i] = render_pool.generation;
+        if (pthread_create(&render_pool.threads[i], NULL, render_pool_run, (void *)(intptr_t) i) != 0) {
+            fz_drop_context(wctx);
+            break;
+        }
+        render_pool.nworkers++;
+    }
+}
+
+/* Must be called before dropping a context that was used for banded rendering */
+void mupdf_render_pool_shutdown(fz_context *ctx)
+{
+    pthread_mutex_lock(&render_pool.lock);
+    while (render_pool.busy)
+        pthread_cond_wait(&render_pool.done_cond, &render_pool.lock);
+    if (render_pool.base == ctx)
+        render_pool_stop();
+    pthread_mutex_unlock(&render_pool.lock);
+}
+
+/* Render list into dest, split in horizontal bands rendered in parallel
+ * by the workers of our pool (ctx must have been created with our locks context).
+ * nthreads <= 0 means one per online CPU. Pages smaller than MIN_BANDED_AREA
+ * pixels (tiles, previews...) are rendered in one go. The caller's thread renders
+ * the first band itself, and on failure, the error is set on ctx.
+ */
+bool mupdf_draw_display_list_banded(fz_context *ctx, fz_document *owner, fz_display_list *list, fz_pixmap *dest, const fz_matrix *ctm, int mask, int nthreads)
+{
+    render_band bands[MAX_RENDER_BANDS];
+
+    if (nthreads <= 0)
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > MAX_RENDER_BANDS)
+        nthreads = MAX_RENDER_BANDS;
+    if (nthreads > dest->h / MIN_BAND_HEIGHT)
+        nthreads = dest->h / MIN_BAND_HEIGHT;
+    if ((size_t)dest->w * dest->h < MIN_BANDED_AREA)
+        nthreads = 1;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    bool pooled = false;
+    if (nthreads > 1) {
+        pthread_mutex_lock(&render_pool.lock);
+        if (!render_pool.busy) {
+            render_pool_grow(ctx, nthreads - 1);
+            if (render_pool.nworkers > 0) {
+                render_pool.busy = true;
+                pooled = true;
+            }
+        }
+        pthread_mutex_unlock(&render_pool.lock);
+        if (!pooled)
+            nthreads = 1;
+    }
+
+    int band_h = (dest->h + nthreads - 1) / nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        bands[i].ctx = ctx;
+        bands[i].owner = owner;
+        bands[i].list = list;
+        bands[i].dest = dest;
+        bands[i].ctm = *ctm;
+        bands[i].mask = mask;
+        bands[i].y0 = dest->y + i * band_h;
+        bands[i].h = i == nthreads - 1 ? dest->h - i * band_h : band_h;
+        bands[i].ok = false;
+    }
+
+    /* bands beyond the workers we got are rendered by the caller too */
+    int nworkers = 0;
+    if (pooled) {
+        pthread_mutex_lock(&render_pool.lock);
+        nworkers = fz_mini(render_pool.nworkers, nthreads - 1);
+        render_pool.bands = bands;
+        render_pool.nbands = nworkers + 1;
+        render_pool.pending = nworkers;
+        render_pool.generation++;
+        pthread_cond_broadcast(&render_pool.work_cond);
+        pthread_mutex_unlock(&render_pool.lock);
+    }
+
+    render_band_run(&bands[0]);
+    bool ok = bands[0].ok;
+    for (int i = nworkers + 1; i < nthreads; i++) {
+        if (ok) {
+            render_band_run(&bands[i]);
+            ok = bands[i].ok;
+        }
+    }
+
+    if (pooled) {
+        pthread_mutex_lock(&render_pool.lock);
+        while (render_pool.pending > 0)
+            pthread_cond_wait(&render_pool.done_cond, &render_pool.lock);
+        render_pool.bands = NULL;
+        render_pool.nbands = 0;
+        render_pool.busy = false;
+        /* may wake mupdf_render_pool_shutdown() */
+        pthread_cond_broadcast(&render_pool.done_cond);
+        pthread_mutex_unlock(&render_pool.lock);
+        for (int i = 1; i <= nworkers; i++)
+            ok = ok && bands[i].ok;
+    }
+
+    if (!ok && bands[0].ok) {
+        /* the failure happened on another context, flag it on ours */
+        fz_try(ctx) { fz_throw(ctx, FZ_ERROR_GENERIC, "cannot render page band"); }
+        fz_catch(ctx) {}
+    }
+    return ok;
+}
+
+/* document-wide text search
+ *
+ * A searcher owns a cloned context and its own instance of the document
+ * (a document can't be used from several threads at once), and a worker
+ * thread going through the pages of the current request. Hits are queued
+ * for the caller to poll, and the structured text of searched pages is kept
+ * (within cache_size bytes) so that the next searches don't have to
+ * extract it again.
+ */
+
+struct mupdf_searcher {
+    fz_context *ctx;
+    fz_document *doc;
+    int page_count;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* current request */
+    char *needle;
+    int from;
+    int to;
+    int hit_max;
+    int generation; /* bumped on each new request */
+    bool pending;   /* a new request is waiting */
+    bool cancel;
+    bool quit;
+    /* progress */
+    bool running;
+    int page;
+    mupdf_search_hit *hits;
+    int hits_count;
+    int hits_size;
+    /* text cache, indexed by page */
+    fz_stext_page **texts;
+    size_t *text_sizes;
+    unsigned *text_ticks; /* last use, for LRU eviction */
+    unsigned tick;
+    size_t cache_used;
+    size_t cache_size;
+};
+
+/* rough size of a text page, it's allocated from a pool we can't inspect */
+static size_t stext_page_size(fz_stext_page *text)
+{
+    size_t size = sizeof(fz_stext_page);
+    for (fz_stext_block *block = text->first_block; block; block = block->next) {
+        size += sizeof(fz_stext_block);
+        if (block->type != FZ_STEXT_BLOCK_TEXT)
+            continue;
+        for (fz_stext_line *line = block->u.t.first_line; line; line = line->next) {
+            size += sizeof(fz_stext_line);
+            for (fz_stext_char *ch = line->first_char; ch; ch = ch->next)
+                size += sizeof(fz_stext_char);
+        }
+    }
+    return size;
+}
+
+static void searcher_evict(mupdf_searcher *s, size_t needed)
+{
+    while (s->cache_used + needed > s->cache_size) {
+        int oldest = -1;
+        for (int i = 0; i < s->page_count; i++) {
+            if (s->texts[i] && (oldest < 0 || s->text_ticks[i] < s->text_ticks[oldest]))
+                oldest = i;
+        }
+        if (oldest < 0)
+            break;
+        fz_drop_stext_page(s->ctx, s->texts[oldest]);
+        s->texts[oldest] = NULL;
+        s->cache_used -= s->text_sizes[oldest];
+    }
+}
+
+/* returns a text page the caller must drop when it's not cached */
+static fz_stext_page *searcher_get_text(mupdf_searcher *s, int pageno, bool *cached)
+{
+    fz_context *ctx = s->ctx;
+    *cached = s->texts[pageno] != NULL;
+    if (*cached) {
+        s->text_ticks[pageno] = ++s->tick;
+        return s->texts[pageno];
+    }
+
+    fz_page *page = NULL;
+    fz_stext_page *text = NULL;
+    fz_var(page);
+    fz_try(ctx) {
+        page = fz_load_page(ctx, s->doc, pageno);
+        text = fz_new_stext_page_from_page(ctx, page, NULL);
+    }
+    fz_always(ctx) {
+        fz_drop_page(ctx, page);
+    }
+    fz_catch(ctx) {
+        return NULL;
+    }
+
+    size_t size = stext_page_size(text);
+    if (size <= s->cache_size) {
+        searcher_evict(s, size);
+        s->texts[pageno] = text;
+        s->text_sizes[pageno] = size;
+        s->text_ticks[pageno] = ++s->tick;
+        s->cache_used += size;
+        *cached = true;
+    }
+    return text;
+}
+
+static void *searcher_run(void *arg)
+{
+    mupdf_searcher *s = arg;
+    fz_context *ctx = s->ctx;
+    mupdf_set_alloc_category(MUPDF_ALLOC_TEXT);
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->quit) {
+        if (!s->pending) {
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        s->pending = false;
+        s->running = true;
+        int generation = s->generation;
+        char *needle = fz_strdup(ctx, s->needle);
+        int from = s->from, to = s->to, hit_max = s->hit_max;
+        pthread_mutex_unlock(&s->lock);
+
+        fz_quad *quads = malloc(hit_max * sizeof(fz_quad));
+        int *marks = malloc(hit_max * sizeof(int));
+        for (int pageno = from; quads && marks && pageno <= to; pageno++) {
+            pthread_mutex_lock(&s->lock);
+            bool stop = s->quit || s->cancel || s->pending;
+            s->page = pageno;
+            pthread_mutex_unlock(&s->lock);
+            if (stop)
+                break;
+
+            bool cached;
+            fz_stext_page *text = searcher_get_text(s, pageno, &cached);
+            if (!text)
+                continue;
+            int count = 0;
+            fz_try(ctx) {
+                count = fz_search_stext_page(ctx, text, needle, marks, quads, hit_max);
+            }
+            fz_catch(ctx) {
+                count = 0;
+            }
+            if (!cached)
+                fz_drop_stext_page(ctx, text);
+            if (count <= 0)
+                continue;
+
+            pthread_mutex_lock(&s->lock);
+            if (generation == s->generation) {
+                if (s->hits_count + count > s->hits_size) {
+                    int size = fz_maxi(s->hits_size * 2, s->hits_count + count);
+                    mupdf_search_hit *hits = realloc(s->hits, size * sizeof(mupdf_search_hit));
+                    if (hits) {
+                        s->hits = hits;
+                        s->hits_size = size;
+                    }
+                }
+                for (int i = 0; i < count && s->hits_count < s->hits_size; i++) {
+                    mupdf_search_hit *hit = &s->hits[s->hits_count++];
+                    hit->page = pageno;
+                    hit->mark = marks[i];
+                    hit->quad = quads[i];
+                }
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+        free(quads);
+        free(marks);
+        fz_free(ctx, needle);
+
+        pthread_mutex_lock(&s->lock);
+        // still running if a new request came in meanwhile
+        s->running = s->pending;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* ctx must have been created with our locks context (it gets cloned),
+ * layout_em > 0 to lay out reflowable documents like the caller did. */
+mupdf_searcher *mupdf_new_searcher(fz_context *ctx, const char *filename, const char *password, float layout_w, float layout_h, float layout_em, size_t cache_size)
+{
+    mupdf_searcher *s = calloc(1, sizeof(mupdf_searcher));
+    if (!s)
+        return NULL;
+    s->ctx = fz_clone_context(ctx);
+    if (!s->ctx) {
+        free(s);
+        return NULL;
+    }
+
+    fz_context *wctx = s->ctx;
+    fz_try(wctx) {
+        s->doc = fz_open_document(wctx, filename);
+        if (fz_needs_password(wctx, s->doc) && !(password && fz_authenticate_password(wctx, s->doc, password)))
+            fz_throw(wctx, FZ_ERROR_GENERIC, "cannot authenticate document");
+        if (layout_em > 0)
+            fz_layout_document(wctx, s->doc, layout_w, layout_h, layout_em);
+        s->page_count = fz_count_pages(wctx, s->doc);
+    }
+    fz_catch(wctx) {
+        fz_drop_document(wctx, s->doc);
+        fz_drop_context(wctx);
+        free(s);
+        return NULL;
+    }
+
+    s->texts = calloc(s->page_count, sizeof(fz_stext_page *));
+    s->text_sizes = calloc(s->page_count, sizeof(size_t));
+    s->text_ticks = calloc(s->page_count, sizeof(unsigned));
+    s->cache_size = cache_size;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (!s->texts || !s->text_sizes || !s->text_ticks
+            || pthread_create(&s->thread, NULL, searcher_run, s) != 0) {
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        free(s->texts);
+        free(s->text_sizes);
+        free(s->text_ticks);
+        fz_drop_document(wctx, s->doc);
+        fz_drop_context(wctx);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void mupdf_drop_searcher(mupdf_searcher *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->quit = true;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+
+    for (int i = 0; i < s->page_count; i++)
+        fz_drop_stext_page(s->ctx, s->texts[i]);
+    free(s->texts);
+    free(s->text_sizes);
+    free(s->text_ticks);
+    free(s->hits);
+    free(s->needle);
+    fz_drop_document(s->ctx, s->doc);
+    fz_drop_context(s->ctx);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+/* search pages from..to (0-based, inclusive) for needle, replacing any
+ * current search: hits not polled yet are dropped */
+void mupdf_searcher_start(mupdf_searcher *s, const char *needle, int from, int to, int hit_max)
+{
+    pthread_mutex_lock(&s->lock);
+    free(s->needle);
+    s->needle = strdup(needle);
+    s->from = fz_maxi(from, 0);
+    s->to = fz_mini(to, s->page_count - 1);
+    s->hit_max = fz_maxi(hit_max, 1);
+    s->generation++;
+    s->hits_count = 0;
+    s->cancel = false;
+    s->pending = s->needle != NULL;
+    s->running = s->pending;
+    s->page = s->from;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void mupdf_searcher_cancel(mupdf_searcher *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->cancel = true;
+    s->pending = false;
+    s->generation++;
+    s->hits_count = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* move up to max queued hits to hits, returns how many; running is set
+ * when the search isn't over yet, page to the page being searched */
+int mupdf_searcher_poll(mupdf_searcher *s, mupdf_search_hit *hits, int max, int *running, int *page)
+{
+    pthread_mutex_lock(&s->lock);
+    int count = fz_mini(max, s->hits_count);
+    if (count > 0) {
+        memcpy(hits, s->hits, count * sizeof(mupdf_search_hit));
+        memmove(s->hits, s->hits + count, (s->hits_count - count) * sizeof(mupdf_search_hit));
+        s->hits_count -= count;
+    }
+    *running = s->running;
+    *page = s->page;
+    pthread_mutex_unlock(&s->lock);
+    return count;
+}
+
 /* wrappers for functions that throw exceptions mupdf-style (setjmp/longjmp) */
 
 #define MUPDF_DO_WRAP
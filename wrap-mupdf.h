@@ -29,8 +29,34 @@
 #define DLL_PUBLIC __attribute__((visibility("default")))
 #define DLL_LOCAL  __attribute__((visibility("hidden")))
 
+// categories of the accounting allocator: allocations are charged to
+// the category set on the allocating thread when they're made.
+enum mupdf_alloc_category {
+    MUPDF_ALLOC_OTHER,
+    MUPDF_ALLOC_DOCUMENT,     // documents, pages and their resources
+    MUPDF_ALLOC_DISPLAY_LIST, // page display lists
+    MUPDF_ALLOC_RENDER,       // rendering: pixmaps, glyph cache, decoded images
+    MUPDF_ALLOC_TEXT,         // structured text
+    MUPDF_ALLOC_IMAGE,        // our decoded image cache
+    MUPDF_ALLOC_CATEGORIES
+};
+
+typedef struct mupdf_alloc_stats {
+    size_t current;           // bytes currently allocated
+    size_t peak;              // highest value of current (since the last reset)
+    size_t blocks;            // blocks currently allocated
+    size_t allocs;            // total number of allocations
+    size_t reallocs;          // total number of reallocations
+    size_t reallocs_in_place; // ... that didn't need to move the block
+    size_t category[MUPDF_ALLOC_CATEGORIES]; // current bytes by category
+} mupdf_alloc_stats;
+
 DLL_PUBLIC fz_alloc_context* mupdf_get_my_alloc_context();
+DLL_PUBLIC fz_locks_context* mupdf_get_my_locks_context();
 DLL_PUBLIC int mupdf_get_cache_size();
+DLL_PUBLIC int mupdf_set_alloc_category(int category);
+DLL_PUBLIC void mupdf_get_alloc_stats(mupdf_alloc_stats *stats);
+DLL_PUBLIC void mupdf_reset_alloc_peak();
 DLL_PUBLIC int mupdf_error_code(fz_context *ctx);
 DLL_PUBLIC char* mupdf_error_message(fz_context *ctx);
 
@@ -43,6 +69,39 @@ DLL_PUBLIC fz_irect *mupdf_fz_round_rect(fz_irect *ir, const fz_rect *r);
 DLL_PUBLIC fz_rect *mupdf_fz_union_rect(fz_rect *a, const fz_rect *b);
 DLL_PUBLIC fz_rect *mupdf_fz_rect_from_quad(fz_rect *r, const fz_quad *q);
 DLL_PUBLIC fz_rect *mupdf_fz_bound_page(fz_context *ctx, fz_page *page, fz_rect *r);
+// words of a structured text page, in flat arrays (see stext_words_from_page)
+typedef struct mupdf_stext_words {
+    int n_words;
+    int n_lines;
+    char *text;          // UTF-8 text of all words, concatenated
+    int *word_offsets;   // n_words + 1 offsets of each word in text
+    float *word_bboxes;  // x0, y0, x1, y1 of each word
+    int *word_lines;     // 0-based index of the line of each word
+    float *line_bboxes;  // x0, y0, x1, y1 of each line
+} mupdf_stext_words;
+
+DLL_PUBLIC mupdf_stext_words *stext_words_from_page(fz_context *ctx, fz_stext_page *text);
+DLL_PUBLIC void mupdf_set_image_cache(fz_context *ctx, size_t max_size, int subsample_bias);
+DLL_PUBLIC size_t mupdf_get_image_cache_used();
+DLL_PUBLIC void mupdf_clear_image_cache(fz_context *ctx, fz_document *owner);
+DLL_PUBLIC void mupdf_hook_image_cache(fz_device *dev, fz_document *owner);
+DLL_PUBLIC bool mupdf_draw_display_list_banded(fz_context *ctx, fz_document *owner, fz_display_list *list, fz_pixmap *dest, const fz_matrix *ctm, int mask, int nthreads);
+DLL_PUBLIC void mupdf_render_pool_shutdown(fz_context *ctx);
+
+// document-wide text search on a worker thread (see mupdf_new_searcher)
+typedef struct mupdf_searcher mupdf_searcher;
+
+typedef struct mupdf_search_hit {
+    int page;   // 0-based
+    int mark;   // non-zero on the first quad of a match
+    fz_quad quad;
+} mupdf_search_hit;
+
+DLL_PUBLIC mupdf_searcher *mupdf_new_searcher(fz_context *ctx, const char *filename, const char *password, float layout_w, float layout_h, float layout_em, size_t cache_size);
+DLL_PUBLIC void mupdf_drop_searcher(mupdf_searcher *s);
+DLL_PUBLIC void mupdf_searcher_start(mupdf_searcher *s, const char *needle, int from, int to, int hit_max);
+DLL_PUBLIC void mupdf_searcher_cancel(mupdf_searcher *s);
+DLL_PUBLIC int mupdf_searcher_poll(mupdf_searcher *s, mupdf_search_hit *hits, int max, int *running, int *page);
 
 // this will turn the wrappers defined below into their declarations
 #define MUPDF_WRAP(wrapper_name, ret_type, failure_value, call, ...) \
@@ -113,6 +172,9 @@ MUPDF_WRAP(mupdf_load_page, fz_page*, NULL,
 MUPDF_WRAP(mupdf_new_stext_page_from_page, fz_stext_page*, NULL,
     ret = fz_new_stext_page_from_page(ctx, page, options),
     fz_page *page, const fz_stext_options *options)
+MUPDF_WRAP(mupdf_new_stext_words, mupdf_stext_words*, NULL,
+    ret = stext_words_from_page(ctx, text),
+    fz_stext_page *text)
 MUPDF_WRAP(mupdf_search_stext_page, int, -1,
     ret = fz_search_stext_page(ctx, text, needle, hit_mark, hit_bbox, hit_max),
     fz_stext_page *text, const char *needle, int *hit_mark, fz_quad *hit_bbox, int hit_max)
@@ -131,6 +193,12 @@ MUPDF_WRAP(mupdf_page_has_transparency_mask, int, 0,
 MUPDF_WRAP_BOOL(mupdf_run_page,
     fz_run_page(ctx, page, dev, *transform, cookie),
     fz_page *page, fz_device *dev, const fz_matrix *transform, fz_cookie *cookie)
+MUPDF_WRAP(mupdf_new_display_list_from_page, fz_display_list*, NULL,
+    ret = fz_new_display_list_from_page(ctx, page),
+    fz_page *page)
+MUPDF_WRAP_BOOL(mupdf_run_display_list,
+    fz_run_display_list(ctx, list, dev, *transform, scissor ? *scissor : fz_infinite_rect, cookie),
+    fz_display_list *list, fz_device *dev, const fz_matrix *transform, const fz_rect *scissor, fz_cookie *cookie)
 MUPDF_WRAP_BOOL(mupdf_close_device,
     fz_close_device(ctx, dev),
     fz_device *dev)
@@ -146,6 +214,11 @@ MUPDF_WRAP(mupdf_new_pixmap_with_data, fz_pixmap*, NULL,
 MUPDF_WRAP(mupdf_new_pixmap_with_bbox_and_data, fz_pixmap*, NULL,
     ret = fz_new_pixmap_with_bbox_and_data(ctx, cs, *rect, seps, alpha, samples),
     fz_colorspace *cs, const fz_irect *rect, fz_separations *seps, int alpha, unsigned char *samples)
+MUPDF_WRAP(mupdf_new_pixmap_with_bbox_and_data_stride, fz_pixmap*, NULL,
+    { ret = fz_new_pixmap_with_data(ctx, cs, rect->x1 - rect->x0, rect->y1 - rect->y0, seps, alpha, stride, samples);
+      ret->x = rect->x0;
+      ret->y = rect->y0; },
+    fz_colorspace *cs, const fz_irect *rect, fz_separations *seps, int alpha, int stride, unsigned char *samples)
 MUPDF_WRAP(mupdf_load_links, fz_link*, NULL,
     ret = fz_load_links(ctx, page),
     fz_page *page)
@@ -27,6 +27,7 @@ extern "C"
 
 // Freetype
 #include <freetype/ftmodapi.h>
+#include <freetype/ftoutln.h>
 #include <freetype/ftsizes.h>
 
 // libunibreak
@@ -377,13 +378,27 @@ public:
         }
     }
     void deallocate() {
+        reset();
+        if (m_lang)        { delete[] m_lang;     m_lang = NULL; }
+        m_no_longer_usable = true;
+    }
+
+    // Free the text and its measurements, but keep our settings (direction,
+    // language) and the hyphen width, so this instance can be reused with
+    // another text set with setTextFromUTF8String().
+    void reset() {
         if (m_text)        { free(m_text);        m_text = NULL;   }
         if (m_charinfo)    { free(m_charinfo);    m_charinfo = NULL; }
         if (m_bidi_ctypes) { free(m_bidi_ctypes); m_bidi_ctypes = NULL; }
         if (m_bidi_btypes) { free(m_bidi_btypes); m_bidi_btypes = NULL; }
         if (m_bidi_levels) { free(m_bidi_levels); m_bidi_levels = NULL; }
-        if (m_lang)        { delete[] m_lang;     m_lang = NULL; }
-        m_no_longer_usable = true;
+        m_length = 0;
+        m_is_valid = false;
+        m_is_measured = false;
+        m_has_rtl = false;
+        m_has_bidi = false;
+        m_has_multiple_scripts = false;
+        m_width = NOT_MEASURED;
     }
 
     void setLanguage(const char * lang) {
@@ -2059,6 +2074,23 @@ public:
         lua_pushinteger(m_L, last_width); // segment width
     }
 
+    // Get the number of chars, from the start of m_text, that fit in targeted_width
+    // (not cutting clusters). Unlike getSegmentFromEnd(), this pushes nothing.
+    int getTruncationIndex(int targeted_width) {
+        int last_fit = 0;
+        int width = 0;
+        for ( int i=0; i<m_length; i++) {
+            width += m_charinfo[i].width;
+            // Include the tail chars of this cluster (of width 0)
+            if ( i+1 < m_length && (m_charinfo[i+1].flags & CHAR_IS_CLUSTER_TAIL) )
+                continue;
+            if (width > targeted_width) // The whole cluster does not fit
+                break;
+            last_fit = i+1;
+        }
+        return last_fit;
+    }
+
     // Get (as a single UTF-8 string) the segment of m_text
     void getText(int start, int end) {
         // FriBiDi provides a unicode to UTF-8 conversion function, so use it.
@@ -2148,6 +2180,340 @@ xtext_shapeinfo_t XText::s_shape_result[MAX_LINE_GLYPHS];
 bool XText::s_libunibreak_init_done = false;
 
 
+// ==============================================
+// Glyph atlas
+// Rendered glyph bitmaps, packed into shared 8bpp pages (one set of pages
+// per (FT_Size, embolden strength)), with a hash of glyph index -> rect.
+// This is used by ffi/freetype.lua to avoid rendering and allocating a
+// new BlitBuffer for each glyph drawn. Pages are evicted, least recently
+// used first, when the total size of all pages exceeds the byte budget.
+// The returned glyph bitmaps are views into a page: they are only valid
+// until the next call that may add a glyph to the atlas (or clear it).
+
+#define GLYPH_ATLAS_PAGE_SIZE 256
+#define GLYPH_ATLAS_DEFAULT_MAX_BYTES (2*1024*1024)
+#define GLYPH_ATLAS_HASH_INITIAL_SIZE 256 // must be a power of 2
+
+// These flags should be sync'ed with freetype.lua FT_Load_Glyph_flags
+#define GLYPH_ATLAS_LOAD_FLAGS (FT_LOAD_DEFAULT | FT_LOAD_TARGET_LIGHT | FT_LOAD_NO_HINTING | FT_LOAD_NO_AUTOHINT)
+
+typedef struct {
+    uint8_t * data;     // w*h bytes, pitch is w
+    int w;
+    int h;
+    int shelf_y;        // top of the current shelf
+    int shelf_h;        // height of the current shelf
+    int shelf_x;        // next free x on the current shelf
+    unsigned int last_used;
+} xtext_atlas_page_t;
+
+typedef struct {
+    int page;           // -1 for an empty hash slot
+    uint32_t glyph;
+    unsigned short x;
+    unsigned short y;
+    unsigned short w;
+    unsigned short h;
+    int l;              // bitmap_left
+    int t;              // bitmap_top
+    int r;              // horiAdvance, in px
+    int ax;             // advance.x, in px
+    int ay;             // advance.y, in px
+} xtext_atlas_glyph_t;
+
+typedef struct xtext_glyph_atlas {
+    FT_Size ft_size;    // we hold a reference on it
+    FT_Pos embolden_half_strength;
+    xtext_atlas_page_t * pages;
+    int pages_nb;
+    xtext_atlas_glyph_t * glyphs; // open addressing hash table
+    int glyphs_size;    // power of 2
+    int glyphs_nb;
+    struct xtext_glyph_atlas * next;
+} xtext_glyph_atlas_t;
+
+static xtext_glyph_atlas_t * s_glyph_atlases = NULL;
+static size_t s_glyph_atlas_bytes = 0;
+static size_t s_glyph_atlas_max_bytes = GLYPH_ATLAS_DEFAULT_MAX_BYTES;
+static unsigned int s_glyph_atlas_clock = 0;
+
+static inline unsigned int glyph_atlas_hash(uint32_t glyph, int size) {
+    // Knuth's multiplicative hash
+    return (glyph * 2654435761U) & (size - 1);
+}
+
+static xtext_atlas_glyph_t * glyph_atlas_lookup(xtext_glyph_atlas_t * atlas, uint32_t glyph) {
+    if ( !atlas->glyphs )
+        return NULL;
+    unsigned int mask = atlas->glyphs_size - 1;
+    unsigned int i = glyph_atlas_hash(glyph, atlas->glyphs_size);
+    while ( atlas->glyphs[i].page >= 0 ) {
+        if ( atlas->glyphs[i].glyph == glyph )
+            return &atlas->glyphs[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+// Returns the (empty) slot where glyph should be stored, growing the table if needed
+static xtext_atlas_glyph_t * glyph_atlas_new_slot(xtext_glyph_atlas_t * atlas, uint32_t glyph) {
+    if ( !atlas->glyphs || (atlas->glyphs_nb + 1) * 4 > atlas->glyphs_size * 3 ) {
+        // Keep the load factor under 3/4
+        int new_size = atlas->glyphs ? atlas->glyphs_size * 2 : GLYPH_ATLAS_HASH_INITIAL_SIZE;
+        xtext_atlas_glyph_t * new_glyphs = (xtext_atlas_glyph_t *)malloc(new_size * sizeof(*new_glyphs));
+        if ( !new_glyphs )
+            return NULL;
+        for ( int i=0; i < new_size; i++ )
+            new_glyphs[i].page = -1;
+        unsigned int mask = new_size - 1;
+        for ( int i=0; i < atlas->glyphs_size; i++ ) {
+            if ( atlas->glyphs[i].page < 0 )
+                continue;
+            unsigned int j = glyph_atlas_hash(atlas->glyphs[i].glyph, new_size);
+            while ( new_glyphs[j].page >= 0 )
+                j = (j + 1) & mask;
+            new_glyphs[j] = atlas->glyphs[i];
+        }
+        free(atlas->glyphs);
+        atlas->glyphs = new_glyphs;
+        atlas->glyphs_size = new_size;
+    }
+    unsigned int mask = atlas->glyphs_size - 1;
+    unsigned int i = glyph_atlas_hash(glyph, atlas->glyphs_size);
+    while ( atlas->glyphs[i].page >= 0 )
+        i = (i + 1) & mask;
+    atlas->glyphs_nb++;
+    return &atlas->glyphs[i];
+}
+
+// Drop page #num from this atlas, and all the glyphs it holds
+static void glyph_atlas_drop_page(xtext_glyph_atlas_t * atlas, int num) {
+    s_glyph_atlas_bytes -= atlas->pages[num].w * atlas->pages[num].h;
+    free(atlas->pages[num].data);
+    int last = atlas->pages_nb - 1;
+    if ( num != last )
+        atlas->pages[num] = atlas->pages[last];
+    atlas->pages_nb--;
+    // Rebuild the hash table in place: entries may move back into the slots freed.
+    // (This is rare enough that simply re-inserting everything is fine.)
+    int size = atlas->glyphs_size;
+    xtext_atlas_glyph_t * old_glyphs = atlas->glyphs;
+    atlas->glyphs = (xtext_atlas_glyph_t *)malloc(size * sizeof(*old_glyphs));
+    if ( !atlas->glyphs ) { // Can't rebuild: forget all glyphs
+        atlas->glyphs = old_glyphs;
+        for ( int i=0; i < size; i++ )
+            atlas->glyphs[i].page = -1;
+        atlas->glyphs_nb = 0;
+        return;
+    }
+    for ( int i=0; i < size; i++ )
+        atlas->glyphs[i].page = -1;
+    atlas->glyphs_nb = 0;
+    unsigned int mask = size - 1;
+    for ( int i=0; i < size; i++ ) {
+        xtext_atlas_glyph_t * g = &old_glyphs[i];
+        if ( g->page < 0 || g->page == num )
+            continue;
+        if ( g->page == last ) // was moved into num's place
+            g->page = num;
+        unsigned int j = glyph_atlas_hash(g->glyph, size);
+        while ( atlas->glyphs[j].page >= 0 )
+            j = (j + 1) & mask;
+        atlas->glyphs[j] = *g;
+        atlas->glyphs_nb++;
+    }
+    free(old_glyphs);
+}
+
+static void glyph_atlas_destroy(xtext_glyph_atlas_t * atlas) {
+    while ( atlas->pages_nb > 0 ) {
+        atlas->pages_nb--;
+        s_glyph_atlas_bytes -= atlas->pages[atlas->pages_nb].w * atlas->pages[atlas->pages_nb].h;
+        free(atlas->pages[atlas->pages_nb].data);
+    }
+    free(atlas->pages);
+    free(atlas->glyphs);
+    // Release our reference on the FT_Size (see xtext_hb_font_data_destroy())
+    FT_Face ft_face = atlas->ft_size->face;
+    FT_Library ft_lib = (FT_Library)ft_face->generic.data;
+    int *refcount = (int *)atlas->ft_size->generic.data;
+    assert(*refcount > 0);
+    if (!--*refcount) {
+        free(refcount);
+        FT_Done_Size(atlas->ft_size);
+        FT_Done_Face(ft_face);
+    }
+    FT_Done_Library(ft_lib);
+    free(atlas);
+}
+
+// Evict least recently used pages (among all atlases) until we can allocate
+// 'bytes' more without exceeding the budget. Atlases left without any page
+// are destroyed, except 'keep' (the one we are about to add a page to).
+static void glyph_atlas_make_room(size_t bytes, xtext_glyph_atlas_t * keep) {
+    while ( s_glyph_atlas_bytes > 0 && s_glyph_atlas_bytes + bytes > s_glyph_atlas_max_bytes ) {
+        xtext_glyph_atlas_t * lru_atlas = NULL;
+        int lru_page = -1;
+        for ( xtext_glyph_atlas_t * a = s_glyph_atlases; a; a = a->next ) {
+            for ( int i=0; i < a->pages_nb; i++ ) {
+                if ( !lru_atlas || a->pages[i].last_used < lru_atlas->pages[lru_page].last_used ) {
+                    lru_atlas = a;
+                    lru_page = i;
+                }
+            }
+        }
+        if ( !lru_atlas )
+            break;
+        glyph_atlas_drop_page(lru_atlas, lru_page);
+    }
+    xtext_glyph_atlas_t ** prev = &s_glyph_atlases;
+    while ( *prev ) {
+        xtext_glyph_atlas_t * a = *prev;
+        if ( a->pages_nb == 0 && a != keep ) {
+            *prev = a->next;
+            glyph_atlas_destroy(a);
+        }
+        else {
+            prev = &a->next;
+        }
+    }
+}
+
+static xtext_glyph_atlas_t * glyph_atlas_get(FT_Size size, FT_Pos embolden_half_strength) {
+    for ( xtext_glyph_atlas_t * a = s_glyph_atlases; a; a = a->next ) {
+        if ( a->ft_size == size && a->embolden_half_strength == embolden_half_strength )
+            return a;
+    }
+    xtext_glyph_atlas_t * atlas = (xtext_glyph_atlas_t *)calloc(1, sizeof(*atlas));
+    if ( !atlas )
+        return NULL;
+    // Keep a reference on this FT_Size, so it can't be freed and its
+    // address reused while we have glyphs keyed on it.
+    ++*(int *)size->generic.data;
+    FT_Reference_Library((FT_Library)size->face->generic.data);
+    atlas->ft_size = size;
+    atlas->embolden_half_strength = embolden_half_strength;
+    atlas->next = s_glyph_atlases;
+    s_glyph_atlases = atlas;
+    return atlas;
+}
+
+// Find room for a w x h bitmap (shelf packing in the last page, or a new page)
+static int glyph_atlas_place(xtext_glyph_atlas_t * atlas, int w, int h, int * x, int * y) {
+    // Keep a 1px gap between glyphs, so views never bleed into neighbours
+    int pw = w + 1;
+    int ph = h + 1;
+    if ( atlas->pages_nb > 0 ) {
+        xtext_atlas_page_t * page = &atlas->pages[atlas->pages_nb - 1];
+        if ( page->shelf_x + pw > page->w || (ph > page->shelf_h && page->shelf_x > 0) ) {
+            // Doesn't fit on the current shelf: start a new one below it
+            page->shelf_y += page->shelf_h;
+            page->shelf_x = 0;
+            page->shelf_h = 0;
+        }
+        if ( page->shelf_x + pw <= page->w && page->shelf_y + ph <= page->h ) {
+            if ( ph > page->shelf_h )
+                page->shelf_h = ph;
+            *x = page->shelf_x;
+            *y = page->shelf_y;
+            page->shelf_x += pw;
+            return atlas->pages_nb - 1;
+        }
+    }
+    // Need a new page (a dedicated one if the glyph is larger than our page size)
+    int page_w = pw > GLYPH_ATLAS_PAGE_SIZE ? pw : GLYPH_ATLAS_PAGE_SIZE;
+    int page_h = ph > GLYPH_ATLAS_PAGE_SIZE ? ph : GLYPH_ATLAS_PAGE_SIZE;
+    size_t bytes = (size_t)page_w * page_h;
+    glyph_atlas_make_room(bytes, atlas);
+    xtext_atlas_page_t * pages = (xtext_atlas_page_t *)realloc(atlas->pages, (atlas->pages_nb + 1) * sizeof(*pages));
+    if ( !pages )
+        return -1;
+    atlas->pages = pages;
+    xtext_atlas_page_t * page = &atlas->pages[atlas->pages_nb];
+    page->data = (uint8_t *)calloc(bytes, 1);
+    if ( !page->data )
+        return -1;
+    page->w = page_w;
+    page->h = page_h;
+    page->shelf_x = pw;
+    page->shelf_y = 0;
+    page->shelf_h = ph;
+    s_glyph_atlas_bytes += bytes;
+    *x = 0;
+    *y = 0;
+    return atlas->pages_nb++;
+}
+
+// Render glyph with Freetype and store it in the atlas
+static xtext_atlas_glyph_t * glyph_atlas_render(xtext_glyph_atlas_t * atlas, uint32_t glyph) {
+    FT_Face face = atlas->ft_size->face;
+    if ( FT_Activate_Size(atlas->ft_size) != 0 )
+        return NULL;
+    if ( FT_Load_Glyph(face, glyph, GLYPH_ATLAS_LOAD_FLAGS) != 0 )
+        return NULL;
+    FT_GlyphSlot slot = face->glyph;
+    // Same emboldening as freetype.lua renderGlyphByIndex(), which doesn't
+    // move metrics (so we don't mess the adjustments provided by Harfbuzz)
+    FT_Pos strength = atlas->embolden_half_strength;
+    if ( strength && slot->format == FT_GLYPH_FORMAT_OUTLINE ) {
+        FT_Outline_Embolden(&slot->outline, 2*strength);
+        FT_Outline_Translate(&slot->outline, -strength, -strength);
+    }
+    if ( FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL) != 0 )
+        return NULL;
+    FT_Bitmap * bitmap = &slot->bitmap;
+    int w = bitmap->width;
+    int h = bitmap->rows;
+    int x = 0;
+    int y = 0;
+    int page = -1;
+    if ( w > 0 && h > 0 ) {
+        if ( w > 0xFFFE || h > 0xFFFE )
+            return NULL;
+        page = glyph_atlas_place(atlas, w, h, &x, &y);
+        if ( page < 0 )
+            return NULL;
+        xtext_atlas_page_t * p = &atlas->pages[page];
+        for ( int row=0; row < h; row++ ) {
+            memcpy(p->data + (size_t)(y + row) * p->w + x, bitmap->buffer + (ptrdiff_t)row * bitmap->pitch, w);
+        }
+        p->last_used = ++s_glyph_atlas_clock;
+    }
+    else {
+        // Empty glyph (ie. space): no bitmap, but we still want its metrics
+        // cached. Attach it to any page, or create one if we have none.
+        w = 0;
+        h = 0;
+        page = glyph_atlas_place(atlas, 0, 0, &x, &y);
+        if ( page < 0 )
+            return NULL;
+    }
+    xtext_atlas_glyph_t * g = glyph_atlas_new_slot(atlas, glyph);
+    if ( !g )
+        return NULL;
+    g->page = page;
+    g->glyph = glyph;
+    g->x = x;
+    g->y = y;
+    g->w = w;
+    g->h = h;
+    g->l = slot->bitmap_left;
+    g->t = slot->bitmap_top;
+    g->r = slot->metrics.horiAdvance / 64;
+    g->ax = slot->advance.x / 64;
+    g->ay = slot->advance.y / 64;
+    return g;
+}
+
+static void glyph_atlas_clear() {
+    while ( s_glyph_atlases ) {
+        xtext_glyph_atlas_t * a = s_glyph_atlases;
+        s_glyph_atlases = a->next;
+        glyph_atlas_destroy(a);
+    }
+}
+
+
 // ==============================================
 // Lua wrapping functions
 
@@ -2273,6 +2639,102 @@ static int xtext_new(lua_State *L) {
     return 1; // Return this new userdata
 }
 
+// Measure many strings in a single call, reusing a single XText instance
+// (and the font's shaping data), instead of having the frontend create,
+// measure and free one XText object per string.
+// Arguments:
+// 1: our Lua font object (face_obj), as with xtext.new()
+// 2: a Lua array of UTF-8 strings
+// 3: optional max width: if provided, also returns truncation points
+// 4, 5, 6: optional auto_para_direction, para_direction_rtl and lang, as with xtext.new()
+// Returns a Lua array of widths, and if max width was provided, a Lua array of
+// the number of chars that fit in it (which is the string length when it fits).
+static int xtext_measureStrings(lua_State *L) {
+    // The font table must stay at 1 on the stack, where getHbFontData() expects it
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, XTEXT_LUA_FONT_GETFONT_CALLBACK_NAME);
+    if ( !lua_isfunction(L, -1) ) {
+        luaL_error(L, "provided font table lacks entry 'getFallbackFont' with a function");
+    }
+    lua_pop(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int max_width = -1;
+    if ( lua_isnumber(L, 3) ) {
+        max_width = luaL_checkint(L, 3);
+        luaL_argcheck(L, max_width >= 0, 3, "max width must be positive");
+    }
+    bool auto_para_direction = false;
+    if (lua_isboolean(L,4)) {
+        auto_para_direction = lua_toboolean(L, 4);
+    }
+    bool para_direction_rtl = default_para_direction_rtl;
+    if (lua_isboolean(L,5)) {
+        para_direction_rtl = lua_toboolean(L, 5);
+    }
+    const char * lang = NULL;
+    if ( lua_isstring(L, 6) ) {
+        lang = luaL_checkstring(L, 6);
+    }
+
+    int nb = (int) lua_objlen(L, 2);
+    // Check all items before allocating anything, so we can't leak on error
+    for (int i = 1; i <= nb; i++) {
+        lua_rawgeti(L, 2, i);
+        if ( !lua_isstring(L, -1) )
+            luaL_error(L, "item %d of strings array is not a string", i);
+        lua_pop(L, 1);
+    }
+
+    lua_createtable(L, nb, 0); // widths
+    int widths_idx = lua_gettop(L);
+    int truncs_idx = 0;
+    if ( max_width >= 0 ) {
+        lua_createtable(L, nb, 0);
+        truncs_idx = lua_gettop(L);
+    }
+
+    // Wrap our XText instance in a luaL_XText userdata, so its __gc deletes it
+    // even if measuring errors out (lua_error() longjmps past our own cleanup).
+    XText ** udata = (XText **)lua_newuserdata(L, sizeof(XText *));
+    *udata = new XText();
+    luaL_getmetatable(L, XTEXT_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    XText * xt = *udata;
+    xt->m_L = L;
+    xt->m_para_direction_rtl = para_direction_rtl;
+    xt->m_auto_para_direction = auto_para_direction;
+    if (lang) {
+        xt->setLanguage(lang);
+    }
+    for (int i = 1; i <= nb; i++) {
+        lua_rawgeti(L, 2, i);
+        size_t utf8_len;
+        const char * utf8_text = lua_tolstring(L, -1, &utf8_len);
+        xt->reset();
+        if ( utf8_len > 0 )
+            xt->setTextFromUTF8String(utf8_text, utf8_len);
+        else
+            xt->m_is_valid = true;
+        lua_pop(L, 1); // (the string is still referenced by the array)
+        xt->measure();
+        int w = xt->m_width;
+        if ( w == NOT_MEASURED )
+            w = 0;
+        lua_pushinteger(L, w);
+        lua_rawseti(L, widths_idx, i);
+        if ( truncs_idx ) {
+            int fit = w <= max_width ? xt->m_length : xt->getTruncationIndex(max_width);
+            lua_pushinteger(L, fit);
+            lua_rawseti(L, truncs_idx, i);
+        }
+    }
+    // Free its buffers now, the instance itself goes with the userdata
+    xt->deallocate();
+    lua_pop(L, 1);
+
+    return truncs_idx ? 2 : 1;
+}
+
 XText * check_XText(lua_State * L, int n, bool replace_with_uservalue=true, bool error_if_no_longer_usable=true) {
     // This checks that the thing at n on the stack is a correct XText
     // wrapping userdata (tagged with the "luaL_XText" metatable).
@@ -2517,12 +2979,77 @@ static int XText_getSelectedWordIndices(lua_State *L) {
 }
 
 
+// Get glyph from the glyph atlas, rendering it if not yet there.
+// Arguments: ftsize (ffi FT_Size cdata), glyph index, embolden half
+// strength (a number, 0 or nil for none).
+// Returns: pointer to bitmap (lightuserdata), pitch, w, h, l, t, r, ax, ay
+// (or nil if the glyph could not be rendered).
+static int xtext_getAtlasGlyph(lua_State *L) {
+    if ( lua_type(L, 1) <= LUA_TTHREAD ) {// Higher plain Lua datatype (lua.h)
+        luaL_typerror(L, 1, "cdata");
+    }
+    FT_Size size = *(FT_Size *)lua_topointer(L, 1);
+    uint32_t glyph = (uint32_t)luaL_checkinteger(L, 2);
+    FT_Pos embolden_half_strength = (FT_Pos)luaL_optnumber(L, 3, 0);
+    xtext_glyph_atlas_t * atlas = glyph_atlas_get(size, embolden_half_strength);
+    if ( !atlas ) {
+        lua_pushnil(L);
+        return 1;
+    }
+    xtext_atlas_glyph_t * g = glyph_atlas_lookup(atlas, glyph);
+    if ( !g ) {
+        g = glyph_atlas_render(atlas, glyph);
+        if ( !g ) {
+            lua_pushnil(L);
+            return 1;
+        }
+    }
+    xtext_atlas_page_t * page = &atlas->pages[g->page];
+    page->last_used = ++s_glyph_atlas_clock;
+    lua_pushlightuserdata(L, page->data + (size_t)g->y * page->w + g->x);
+    lua_pushinteger(L, page->w);
+    lua_pushinteger(L, g->w);
+    lua_pushinteger(L, g->h);
+    lua_pushinteger(L, g->l);
+    lua_pushinteger(L, g->t);
+    lua_pushinteger(L, g->r);
+    lua_pushinteger(L, g->ax);
+    lua_pushinteger(L, g->ay);
+    return 9;
+}
+
+// Set the glyph atlas byte budget (evicting pages if needed), and
+// return the previous one and the number of bytes currently used.
+static int xtext_setGlyphAtlasMaxBytes(lua_State *L) {
+    size_t prev_max_bytes = s_glyph_atlas_max_bytes;
+    if ( lua_isnumber(L, 1) ) {
+        lua_Integer max_bytes = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, max_bytes > 0, 1, "max_bytes must be strictly positive");
+        s_glyph_atlas_max_bytes = max_bytes;
+        glyph_atlas_make_room(0, NULL);
+    }
+    lua_pushinteger(L, prev_max_bytes);
+    lua_pushinteger(L, s_glyph_atlas_bytes);
+    return 2;
+}
+
+// Drop all atlases (and release the FT_Size objects they reference)
+static int xtext_clearGlyphAtlas(lua_State *L) {
+    glyph_atlas_clear();
+    return 0;
+}
+
+
 // ==============================================
 // Lua registration
 static const struct luaL_Reg xtext_func[] = {
     {"setDefaultParaDirection", xtext_setDefaultParaDirection}, // false: LTR / true: RTL
     {"setDefaultLang", xtext_setDefaultLang},
     {"new", xtext_new},
+    {"measureStrings", xtext_measureStrings},
+    {"getAtlasGlyph", xtext_getAtlasGlyph},
+    {"setGlyphAtlasMaxBytes", xtext_setGlyphAtlasMaxBytes},
+    {"clearGlyphAtlas", xtext_clearGlyphAtlas},
     {NULL, NULL}
 };
 